@@ -21,9 +21,316 @@
 */
 
 #include <fenn.h>
+#include <parser.h>
+#include <time.h>
+#include "image.h"
+#include "parallel.h"
+#include "stream.h"
+#include "util.h"
+#include "objects/farray.h"
+#include "objects/ftuple.h"
 
-int main(int argc, char **argv) {
-    int i, status;
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_UNIT "cycle"
+static uint64_t bench_ticks(void) {
+    return __rdtsc();
+}
+#else
+#define BENCH_UNIT "ns"
+static uint64_t bench_ticks(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+#endif
+
+/* The byte at a time djb2 hash that strings used to be hashed with */
+static uint32_t bench_djb2(const uint8_t *str, size_t len) {
+    const uint8_t *end = str + len;
+    uint32_t hash = 5381;
+    while (str < end)
+        hash = (hash << 5) + hash + *str++;
+    return hash;
+}
+
+static uint32_t bench_seeded(const uint8_t *str, size_t len) {
+    return (uint32_t) fenn_hash_bytes(str, len);
+}
+
+/* Bytes hashed per tick for keys of a given length. The hashes are mixed
+ * into *check, which is printed so the loop cannot be left out. */
+static double bench_run(uint32_t (*hash)(const uint8_t *, size_t), const uint8_t *data, size_t len,
+                        uint32_t *check) {
+    size_t rounds = ((size_t) 64 << 20) / len + 1;
+    size_t i;
+    uint32_t acc = 0;
+    uint64_t start = bench_ticks();
+    for (i = 0; i < rounds; i++)
+        acc += hash(data + (i & 7), len);
+    *check ^= acc;
+    return (double) (rounds * len) / (double) (bench_ticks() - start);
+}
+
+/* Compare the string hash with the old djb2 hash */
+static int bench_hash(void) {
+    static const size_t sizes[] = {4, 8, 16, 32, 64, 256, 1024, 4096, 65536};
+    size_t i, maxlen = 65536 + 8;
+    uint32_t check = 0;
+    uint8_t *data = malloc(maxlen);
+    if (NULL == data)
+        return 1;
+    for (i = 0; i < maxlen; i++)
+        data[i] = (uint8_t) (i * 131 + (i >> 7));
+    printf("%8s %16s %16s\n", "bytes", "djb2 B/" BENCH_UNIT, "seeded B/" BENCH_UNIT);
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double old = bench_run(bench_djb2, data, sizes[i], &check);
+        double new = bench_run(bench_seeded, data, sizes[i], &check);
+        printf("%8zu %16.3f %16.3f\n", sizes[i], old, new);
+    }
+    printf("checksum %08x\n", (unsigned) check);
+    free(data);
+    return 0;
+}
+
+static double stream_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static int stream_count(void *data, FennObject form) {
+    (void) data;
+    (void) form;
+    return 0;
+}
+
+/* Parse a whole file form by form and report the throughput */
+static int stream_file(const char *path) {
+    Parser parser;
+    ParserStream stream = {stream_count, NULL, 0, 0, 0};
+    double start, elapsed;
+    int status;
+    parser_init(&parser);
+    start = stream_seconds();
+    status = strcmp(path, "-")
+             ? parser_stream_file(&parser, path, &stream)
+             : parser_stream(&parser, stdin, &stream);
+    elapsed = stream_seconds() - start;
+    if (status) {
+        int line, col;
+        parser_where(&parser, &line, &col);
+        fprintf(stderr, "%s:%d:%d: %s\n", path, line, col, parser.error);
+    } else {
+        if (elapsed <= 0) elapsed = 1e-9;
+        printf("%zu forms, %zu bytes in %.3fs\n", stream.forms, stream.bytes, elapsed);
+        printf("%.0f forms/s, %.2f MB/s\n",
+               (double) stream.forms / elapsed, (double) stream.bytes / elapsed / 1e6);
+    }
+    parser_destroy(&parser);
+    return status;
+}
 
+/* Parse a whole file on several threads and report the throughput */
+static int parallel_file(const char *path, int threads) {
+    ParserBatch batch;
+    FILE *in = fopen(path, "rb");
+    uint8_t *bytes;
+    long len;
+    double start, elapsed;
+    int status;
+    if (NULL == in) {
+        fprintf(stderr, "%s: could not open file\n", path);
+        return 1;
+    }
+    fseek(in, 0, SEEK_END);
+    len = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    bytes = malloc(len > 0 ? (size_t) len : 1);
+    if (NULL == bytes || (len > 0 && fread(bytes, 1, (size_t) len, in) != (size_t) len)) {
+        fprintf(stderr, "%s: read error\n", path);
+        free(bytes);
+        fclose(in);
+        return 1;
+    }
+    fclose(in);
+    if (threads < 1) {
+#ifdef _SC_NPROCESSORS_ONLN
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        if (threads < 1) threads = 1;
+    }
+    start = stream_seconds();
+    status = parser_parse_parallel(&batch, bytes, (size_t) len, threads);
+    elapsed = stream_seconds() - start;
+    if (status) {
+        fprintf(stderr, "%s:%d:%d: %s\n", path, batch.lineno, batch.colno, batch.error);
+    } else {
+        if (elapsed <= 0) elapsed = 1e-9;
+        printf("%zu forms, %ld bytes in %.3fs on %d threads\n", batch.count, len, elapsed, threads);
+        printf("%.0f forms/s, %.2f MB/s\n",
+               (double) batch.count / elapsed, (double) len / elapsed / 1e6);
+    }
+    parser_batch_destroy(&batch);
+    free(bytes);
+    return status;
+}
+
+static int image_collect(void *data, FennObject form) {
+    fenn_array_push((FennArray *) data, form);
+    return 0;
+}
+
+/* Parse a whole file and write its forms to a heap image as a tuple */
+static int image_file(const char *path, const char *out) {
+    Parser parser;
+    FennArray *forms = fenn_array(0);
+    ParserStream stream = {image_collect, NULL, 0, 0, 0};
+    const char *error;
+    double start, parsed, written;
+    int status;
+    stream.data = forms;
+    fenn_gcroot(fenn_wrap_array(forms));
+    parser_init(&parser);
+    start = stream_seconds();
+    status = parser_stream_file(&parser, path, &stream);
+    parsed = stream_seconds();
+    if (status) {
+        int line, col;
+        parser_where(&parser, &line, &col);
+        fprintf(stderr, "%s:%d:%d: %s\n", path, line, col, parser.error);
+    } else {
+        FennObject tuple = fenn_wrap_tuple(fenn_tuple_n(forms->data, forms->count));
+        error = fenn_image_write(out, tuple);
+        written = stream_seconds();
+        if (NULL != error) {
+            fprintf(stderr, "%s: %s\n", out, error);
+            status = 1;
+        } else {
+            printf("%d forms, parsed in %.3fs, image written in %.3fs\n",
+                   forms->count, parsed - start, written - parsed);
+        }
+    }
+    parser_destroy(&parser);
+    fenn_gcunroot(fenn_wrap_array(forms));
+    return status;
+}
+
+/* Load a heap image and report how long it took */
+static int load_image(const char *path) {
+    FennObject root;
+    double start = stream_seconds(), elapsed;
+    const char *error = fenn_image_load(path, &root);
+    elapsed = stream_seconds() - start;
+    if (NULL != error) {
+        fprintf(stderr, "%s: %s\n", path, error);
+        return 1;
+    }
+    if (fenn_checktype(root, FENN_TUPLE))
+        printf("%d forms loaded in %.3fs\n", fenn_tuple_length(fenn_unwrap_tuple(root)), elapsed);
+    else
+        printf("image loaded in %.3fs\n", elapsed);
+    return 0;
+}
+
+#ifndef _WIN32
+static void fork_report(const char *when) {
+    FennHeapPages pages;
+    if (fenn_heap_pages(&pages)) {
+        printf("%s: heap pages unavailable\n", when);
+        return;
+    }
+    printf("%s: %zu heap pages, %zu resident, %zu shared with the parent\n",
+           when, pages.pages, pages.resident, pages.shared);
+}
+
+/* Parse a file, fork, and collect in the child to see how many heap pages
+ * it keeps sharing with the parent */
+static int fork_file(const char *path) {
+    Parser parser;
+    FennArray *forms = fenn_array(0);
+    ParserStream stream = {image_collect, NULL, 0, 0, 0};
+    int status;
+    pid_t pid;
+    stream.data = forms;
+    fenn_gcroot(fenn_wrap_array(forms));
+    parser_init(&parser);
+    status = parser_stream_file(&parser, path, &stream);
+    if (status) {
+        int line, col;
+        parser_where(&parser, &line, &col);
+        fprintf(stderr, "%s:%d:%d: %s\n", path, line, col, parser.error);
+    }
+    parser_destroy(&parser);
+    if (!status) {
+        fenn_collect();
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            status = 1;
+        } else if (pid == 0) {
+            fork_report("child after fork");
+            fenn_collect();
+            fork_report("child after collect");
+            fflush(stdout);
+            _exit(0);
+        } else {
+            waitpid(pid, &status, 0);
+            status = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+        }
+    }
+    fenn_gcunroot(fenn_wrap_array(forms));
+    return status;
+}
+#endif
+
+static void usage(const char *name) {
+    printf("usage: %s [option]\n"
+           "  --bench-hash   compare string hash throughput with djb2\n"
+           "  --stream FILE  parse FILE (or - for stdin) and report throughput\n"
+           "  --parallel FILE [THREADS]\n"
+           "                 parse FILE on several threads and report throughput\n"
+           "  --image FILE OUT\n"
+           "                 parse FILE and write its forms to the heap image OUT\n"
+           "  --load IMAGE   load a heap image and report how long it took\n"
+#ifndef _WIN32
+           "  --fork FILE    parse FILE, fork and report how many heap pages a\n"
+           "                 collection in the child leaves shared\n"
+#endif
+           "  --version      print the version and exit\n", name);
+}
+
+int main(int argc, char **argv) {
+    int status = 0;
+    fenn_init();
+    if (argc < 2) {
+        usage(argv[0]);
+    } else if (!strcmp(argv[1], "--bench-hash")) {
+        status = bench_hash();
+    } else if (!strcmp(argv[1], "--stream") && argc > 2) {
+        status = stream_file(argv[2]);
+    } else if (!strcmp(argv[1], "--parallel") && argc > 2) {
+        status = parallel_file(argv[2], argc > 3 ? atoi(argv[3]) : 0);
+    } else if (!strcmp(argv[1], "--image") && argc > 3) {
+        status = image_file(argv[2], argv[3]);
+    } else if (!strcmp(argv[1], "--load") && argc > 2) {
+        status = load_image(argv[2]);
+#ifndef _WIN32
+    } else if (!strcmp(argv[1], "--fork") && argc > 2) {
+        status = fork_file(argv[2]);
+#endif
+    } else if (!strcmp(argv[1], "--version")) {
+        printf("fenn %s\n", FENN_VERSION_STRING);
+    } else {
+        usage(argv[0]);
+        status = 1;
+    }
+    fenn_deinit();
     return status;
 }
@@ -22,9 +22,1008 @@
 
 #include <fenn.h>
 #include "gc.h"
+#include "scan.h"
+#include "slab.h"
+#include "symcache.h"
+#include "shapecache.h"
+#include "tuplecache.h"
+#include "util.h"
+#include "image.h"
+#include "objects/fstring.h"
+#include "objects/fabstract.h"
+#include "objects/farray.h"
+#include "objects/fstruct.h"
+#include "objects/ftable.h"
+#include "objects/ftrie.h"
+#include "objects/ftuple.h"
+#include "objects/fbuffer.h"
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+FENN_THREAD_LOCAL FennGC fenn_gc;
+
+
+/* Push a pointer onto one of the collector's pointer stacks */
+static void fenn_gc_push(FennGCObject ***stack, size_t *count, size_t *cap, FennGCObject *obj) {
+    size_t newcount = *count + 1;
+    if (newcount > *cap) {
+        FennGCObject **next;
+        size_t newcap = 2 * newcount;
+        next = realloc(*stack, sizeof(FennGCObject *) * newcap);
+        if (NULL == next) {
+            // TODO: Handle Out Of Memory error
+        }
+        *stack = next;
+        *cap = newcap;
+    }
+    (*stack)[*count] = obj;
+    *count = newcount;
+}
+
+#define fenn_gc_pushgray(obj) \
+    fenn_gc_push(&fenn_gc.gray, &fenn_gc.graycount, &fenn_gc.graycap, (obj))
+
+/* Get the allocation behind a value, or NULL if it is not heap allocated */
+FennGCObject *fenn_gc_object(FennObject x) {
+    switch (fenn_type(x)) {
+        case FENN_STRING:
+        case FENN_SYMBOL:
+        case FENN_KEYWORD:
+            return &fenn_string_head(fenn_unwrap_string(x))->gc;
+        case FENN_TUPLE:
+            return &fenn_tuple_head(fenn_unwrap_tuple(x))->gc;
+        case FENN_STRUCT:
+            return &fenn_struct_head(fenn_unwrap_struct(x))->gc;
+        case FENN_ARRAY:
+            return &fenn_unwrap_array(x)->gc;
+        case FENN_TABLE:
+            return &fenn_unwrap_table(x)->gc;
+        case FENN_BUFFER:
+            return &fenn_unwrap_buffer(x)->gc;
+        case FENN_ABSTRACT:
+            return &fenn_abstract_head(fenn_unwrap_abstract(x))->gc;
+        default:
+            return NULL;
+    }
+}
+
+/* Call visit on every value slot of an object. Returns the number of slots */
+size_t fenn_gc_visit(FennGCObject *obj, FennGCVisitor visit) {
+    switch (fenn_gc_type(obj)) {
+        case FENN_MEMORY_TUPLE: {
+            FennTupleHead *head = (FennTupleHead *) obj;
+            FennObject *data = (FennObject *) head->data;
+            int32_t i;
+            for (i = 0; i < head->length; i++)
+                visit(data + i);
+            return (size_t) head->length;
+        }
+        case FENN_MEMORY_STRUCT: {
+            FennStructHead *head = (FennStructHead *) obj;
+            FennKV *data = (FennKV *) head->data;
+            int32_t i;
+            visit(&head->shape);
+            if (obj->flags & FENN_MEM_TRIE) {
+                visit(&fenn_struct_trie(head->data)->root);
+                return 2;
+            }
+            if (!fenn_checktype(head->shape, FENN_NIL)) {
+                FennObject *values = (FennObject *) head->data;
+                for (i = 0; i < head->length; i++)
+                    visit(values + i);
+                return 1 + (size_t) head->length;
+            }
+            for (i = 0; i < head->capacity; i++) {
+                visit(&data[i].key);
+                visit(&data[i].value);
+            }
+            return 1 + (size_t) head->capacity;
+        }
+        case FENN_MEMORY_TRIE: {
+            FennTrieNode *node = (FennTrieNode *) obj;
+            int32_t i;
+            for (i = 0; i < node->size; i++)
+                visit(node->slots + i);
+            return (size_t) node->size;
+        }
+        case FENN_MEMORY_ABSTRACT: {
+            FennAbstractHead *head = (FennAbstractHead *) obj;
+            if (NULL == head->type->gcvisit)
+                return 0;
+            return head->type->gcvisit(head->data, head->size, visit);
+        }
+        case FENN_MEMORY_ARRAY: {
+            FennArray *array = (FennArray *) obj;
+            int32_t i;
+            for (i = 0; i < array->count; i++)
+                visit(array->data + i);
+            return (size_t) array->count;
+        }
+        case FENN_MEMORY_TABLE: {
+            FennTable *t = (FennTable *) obj;
+            int32_t i;
+            visit(&t->shape);
+            if (!fenn_checktype(t->shape, FENN_NIL)) {
+                for (i = 0; i < t->count; i++)
+                    visit(t->values + i);
+                return 1 + (size_t) t->count;
+            }
+            for (i = 0; i < t->capacity; i++) {
+                if (!(t->ctrl[i] & FENN_TABLE_EMPTY)) {
+                    visit(&t->data[i].key);
+                    visit(&t->data[i].value);
+                }
+            }
+            return 1 + (size_t) t->capacity;
+        }
+        default:
+            return 0;
+    }
+}
+
+/* Set the mark of an object, in its flags if it is young or an image
+ * object and in the side bitmaps otherwise. Returns 1 if it was already
+ * marked. */
+int fenn_gc_setmark(FennGCObject *obj) {
+    int32_t marked;
+    if (obj->flags & (FENN_MEM_YOUNG | FENN_MEM_IMAGE)) {
+        // Image objects are always marked and live in read-only pages
+        marked = obj->flags & FENN_MEM_BLACK;
+        if (!marked)
+            obj->flags |= FENN_MEM_BLACK;
+        return marked != 0;
+    }
+    return fenn_markbits_set(obj);
+}
+
+/* Mark an object that is not marked yet and push it on the gray stack */
+void fenn_gc_markobject(FennGCObject *obj) {
+    if (!fenn_gc_setmark(obj))
+        fenn_gc_pushgray(obj);
+}
+
+/* Mark a value. Only heap allocated values are of interest to the collector */
+void fenn_mark(FennObject x) {
+    FennGCObject *obj = fenn_gc_object(x);
+    if (NULL != obj)
+        fenn_gc_markobject(obj);
+}
+
+static void fenn_gc_markslot(FennObject *slot) {
+    fenn_mark(*slot);
+}
+
+/* Turn a gray object black by marking everything it refers to. Returns
+ * the amount of work done. */
+static size_t fenn_gc_blacken(FennGCObject *obj) {
+    if (obj->flags & FENN_MEM_GRAY)
+        obj->flags &= ~FENN_MEM_GRAY;
+    return 1 + fenn_gc_visit(obj, fenn_gc_markslot);
+}
+
+/* Size in bytes of an allocation */
+size_t fenn_gc_size(FennGCObject *obj) {
+    switch (fenn_gc_type(obj)) {
+        case FENN_MEMORY_STRING:
+        case FENN_MEMORY_SYMBOL:
+            return sizeof(FennStringHead) + ((FennStringHead *) obj)->length + 1;
+        case FENN_MEMORY_TUPLE:
+            return sizeof(FennTupleHead) + ((FennTupleHead *) obj)->length * sizeof(FennObject)
+                   + ((obj->flags & FENN_MEM_SOURCEMAP) ? sizeof(FennSourceMap) : 0);
+        case FENN_MEMORY_STRUCT:
+            if (obj->flags & FENN_MEM_TRIE)
+                return sizeof(FennStructHead) + sizeof(FennStructTrie);
+            // Shaped structs have no slots, only values
+            return sizeof(FennStructHead) + ((FennStructHead *) obj)->capacity * sizeof(FennKV)
+                   + (fenn_checktype(((FennStructHead *) obj)->shape, FENN_NIL)
+                      ? 0
+                      : ((FennStructHead *) obj)->length * sizeof(FennObject));
+        case FENN_MEMORY_TRIE:
+            return sizeof(FennTrieNode) + ((FennTrieNode *) obj)->size * sizeof(FennObject);
+        case FENN_MEMORY_ARRAY:
+            return sizeof(FennArray);
+        case FENN_MEMORY_TABLE:
+            return sizeof(FennTable);
+        case FENN_MEMORY_BUFFER:
+            return sizeof(FennBuffer);
+        case FENN_MEMORY_ABSTRACT:
+            return sizeof(FennAbstractHead) + ((FennAbstractHead *) obj)->size;
+        default:
+            return 0;
+    }
+}
+
+/* Release memory owned by an object outside of the heap */
+static void fenn_gc_finalize(FennGCObject *obj) {
+    switch (fenn_gc_type(obj)) {
+        case FENN_MEMORY_BUFFER:
+            fenn_buffer_deinit((FennBuffer *) obj);
+            break;
+        case FENN_MEMORY_ARRAY:
+            fenn_array_deinit((FennArray *) obj);
+            break;
+        case FENN_MEMORY_TABLE:
+            fenn_table_deinit((FennTable *) obj);
+            break;
+        case FENN_MEMORY_ABSTRACT: {
+            FennAbstractHead *head = (FennAbstractHead *) obj;
+            if (NULL != head->type->gc)
+                head->type->gc(head->data, head->size);
+            break;
+        }
+        case FENN_MEMORY_SYMBOL:
+            fenn_symbol_deinit(((FennStringHead *) obj)->data);
+            break;
+        case FENN_MEMORY_TUPLE:
+            if (obj->flags & FENN_MEM_CONSED)
+                fenn_tuple_deinit(((FennTupleHead *) obj)->data);
+            break;
+        case FENN_MEMORY_STRUCT:
+            if (obj->flags & FENN_MEM_CONSED)
+                fenn_shape_deinit(((FennStructHead *) obj)->data);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Only objects of these types that need no finalizer, or whose finalizer is
+ * tracked in the finalize list, are allocated in the nursery */
+static int fenn_gc_nurserytype(FennMemoryType type) {
+    switch (type) {
+        case FENN_MEMORY_STRING:
+        case FENN_MEMORY_TUPLE:
+        case FENN_MEMORY_ARRAY:
+        case FENN_MEMORY_STRUCT:
+        case FENN_MEMORY_TABLE:
+        case FENN_MEMORY_TRIE:
+        case FENN_MEMORY_BUFFER:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* Account for an object that is no longer live */
+static void fenn_gc_release(FennGCObject *obj, size_t size) {
+    FennMemoryStats *stats = fenn_gc.stats + fenn_gc_type(obj);
+    fenn_gc.allocated -= size;
+    stats->objects--;
+    stats->bytes -= size;
+    stats->frees++;
+}
+
+/* Release the memory of a single old object */
+static void fenn_gc_free(FennGCObject *obj) {
+    fenn_gc_release(obj, fenn_gc_size(obj));
+    fenn_gc_finalize(obj);
+    if (obj->flags & FENN_MEM_LARGE) {
+        fenn_gc.stats[fenn_gc_type(obj)].large--;
+        free(obj);
+    } else if (obj->flags & FENN_MEM_NURSERY) {
+        FennNurseryBlock *block = fenn_nursery_of(obj);
+        if (--block->live == 0)
+            free(block);
+    } else {
+        fenn_slab_free(obj);
+    }
+}
+
+/* Link an old object into the heap. Objects that join while the heap is
+ * being swept were not there when marking finished, so they are marked to
+ * survive the sweep. */
+static void fenn_gc_link(FennGCObject *obj) {
+    obj->next = fenn_gc.blocks;
+    fenn_gc.blocks = obj;
+    if (fenn_gc.phase == FENN_GC_SWEEP)
+        fenn_markbits_set(obj);
+}
+
+/* Allocate an old object and link it into the heap */
+static FennGCObject *fenn_gc_allocold(FennMemoryType type, size_t size, int32_t flags) {
+    FennGCObject *mem = fenn_slab_alloc(size);
+    if (NULL == mem) {
+        mem = malloc(size);
+        if (NULL == mem) {
+            // TODO: Handle Out Of Memory
+        }
+        flags |= FENN_MEM_LARGE;
+        fenn_gc.stats[type].large++;
+    }
+    mem->flags = flags;
+    fenn_gc_link(mem);
+    return mem;
+}
+
+/* Minor collection */
+
+/* Get an empty nursery block and make it the current one */
+static FennNurseryBlock *fenn_nursery_grow(void) {
+    FennNurseryBlock *block = fenn_gc.nurseryfree;
+    if (NULL != block) {
+        fenn_gc.nurseryfree = block->next;
+    } else {
+        void *mem = NULL;
+        if (posix_memalign(&mem, FENN_NURSERY_BLOCK, FENN_NURSERY_BLOCK)) {
+            // TODO: Handle Out Of Memory
+            return NULL;
+        }
+        block = mem;
+        block->end = (char *) block + FENN_NURSERY_BLOCK;
+    }
+    block->bump = (char *) block + fenn_nursery_round(sizeof(FennNurseryBlock));
+    block->pinned = 0;
+    block->live = 0;
+    block->next = fenn_gc.nursery;
+    fenn_gc.nursery = block;
+    return block;
+}
+
+/* Bump allocate from the current nursery block */
+static FennGCObject *fenn_nursery_alloc(size_t size) {
+    FennNurseryBlock *block = fenn_gc.nursery;
+    char *mem;
+    size = fenn_nursery_round(size);
+    if (NULL == block || block->bump + size > block->end) {
+        block = fenn_nursery_grow();
+        if (NULL == block) return NULL;
+    }
+    mem = block->bump;
+    block->bump += size;
+    fenn_gc.young += size;
+    return (FennGCObject *) mem;
+}
+
+/* Add an old object to the remembered set */
+void fenn_gc_remember(FennGCObject *obj) {
+    obj->flags |= FENN_MEM_REMEMBERED;
+    fenn_gc_push(&fenn_gc.remembered, &fenn_gc.rememberedcount, &fenn_gc.rememberedcap, obj);
+}
+
+/* Write barrier for a container that had many values stored into it at
+ * once. Rather than marking every value, a marked container is made gray
+ * again so it is scanned once more. The gray flag keeps it on the gray
+ * stack only once however many stores come before it is scanned; the
+ * container is being written to, so setting a flag dirties no extra
+ * page. */
+void fenn_gc_barrierback(FennGCObject *obj) {
+    if (!(obj->flags & (FENN_MEM_YOUNG | FENN_MEM_REMEMBERED)))
+        fenn_gc_remember(obj);
+    if (fenn_gc.phase == FENN_GC_MARK && !(obj->flags & FENN_MEM_GRAY) && fenn_gc_ismarked(obj)) {
+        obj->flags |= FENN_MEM_GRAY;
+        fenn_gc_pushgray(obj);
+    }
+}
+
+/* Objects that survived and still need their slots scanned */
+static FENN_THREAD_LOCAL FennGCObject **fenn_gc_scan;
+static FENN_THREAD_LOCAL size_t fenn_gc_scancount;
+static FENN_THREAD_LOCAL size_t fenn_gc_scancap;
+
+/* Keep a young object alive, either in place if its block is pinned or by
+ * copying it into the old generation. Returns where the object now lives. */
+static FennGCObject *fenn_gc_evacuate(FennGCObject *obj) {
+    FennGCObject *copy;
+    size_t size;
+    if (obj->flags & FENN_MEM_FORWARDED)
+        return obj->next;
+    if (obj->flags & FENN_MEM_PINNED)
+        return obj;
+    if (fenn_nursery_of(obj)->pinned) {
+        obj->flags |= FENN_MEM_PINNED;
+        fenn_gc_push(&fenn_gc_scan, &fenn_gc_scancount, &fenn_gc_scancap, obj);
+        return obj;
+    }
+    size = fenn_gc_size(obj);
+    copy = fenn_gc_allocold(fenn_gc_type(obj), size, obj->flags & ~(FENN_MEM_YOUNG | FENN_MEM_BLACK | FENN_MEM_GRAY));
+    if (obj->flags & FENN_MEM_BLACK)
+        fenn_markbits_set(copy);
+    memcpy((char *) copy + sizeof(FennGCObject),
+           (char *) obj + sizeof(FennGCObject),
+           size - sizeof(FennGCObject));
+    obj->flags |= FENN_MEM_FORWARDED;
+    obj->next = copy;
+    fenn_gc_push(&fenn_gc_scan, &fenn_gc_scancount, &fenn_gc_scancap, copy);
+    return copy;
+}
+
+/* Copy a young object that nothing refers to yet into the old generation,
+ * for objects that are about to be kept around in a table. The young
+ * object is forwarded to the copy. */
+FennGCObject *fenn_gc_tenure(FennGCObject *obj) {
+    FennGCObject *copy;
+    size_t size;
+    if (!(obj->flags & FENN_MEM_YOUNG))
+        return obj;
+    size = fenn_gc_size(obj);
+    copy = fenn_gc_allocold(fenn_gc_type(obj), size, obj->flags & ~(FENN_MEM_YOUNG | FENN_MEM_BLACK | FENN_MEM_GRAY));
+    if (obj->flags & FENN_MEM_BLACK)
+        fenn_markbits_set(copy);
+    memcpy((char *) copy + sizeof(FennGCObject),
+           (char *) obj + sizeof(FennGCObject),
+           size - sizeof(FennGCObject));
+    obj->flags |= FENN_MEM_FORWARDED;
+    obj->next = copy;
+    return copy;
+}
+
+/* Evacuate the object a slot refers to and update the slot */
+static void fenn_gc_evacuateslot(FennObject *slot) {
+    FennGCObject *obj = fenn_gc_object(*slot);
+    FennGCObject *moved;
+    if (NULL == obj || !(obj->flags & FENN_MEM_YOUNG))
+        return;
+    moved = fenn_gc_evacuate(obj);
+    if (moved != obj) {
+        char *ptr = (char *) fenn_to_pointer(*slot);
+        *slot = fenn_from_pointer((char *) moved + (ptr - (char *) obj), fenn_u64(*slot) & FENN_TAGBITS);
+    }
+}
+
+/* Pin the block of a young object that is referenced from outside the heap */
+static void fenn_gc_pin(FennGCObject *obj) {
+    if (NULL != obj && (obj->flags & FENN_MEM_YOUNG))
+        fenn_nursery_of(obj)->pinned = 1;
+}
+
+/* Promote a pinned block into the old generation in place. Survivors are
+ * linked into the heap, the block is freed once they have all died. */
+static void fenn_gc_promoteblock(FennNurseryBlock *block) {
+    char *p = (char *) block + fenn_nursery_round(sizeof(FennNurseryBlock));
+    while (p < block->bump) {
+        FennGCObject *obj = (FennGCObject *) p;
+        size_t size = fenn_gc_size(obj);
+        p += fenn_nursery_round(size);
+        if (obj->flags & FENN_MEM_PINNED) {
+            int32_t marked = obj->flags & FENN_MEM_BLACK;
+            obj->flags &= ~(FENN_MEM_YOUNG | FENN_MEM_PINNED | FENN_MEM_BLACK);
+            obj->flags |= FENN_MEM_NURSERY;
+            fenn_gc_link(obj);
+            if (marked)
+                fenn_markbits_set(obj);
+            block->live++;
+        }
+    }
+}
+
+/* Collect the nursery. Everything reachable from the roots, the gray stack
+ * and the remembered set is promoted, so afterwards no old object refers to
+ * a young one. Blocks holding objects referenced from outside the heap are
+ * promoted in place, every other survivor is copied out. The cost is
+ * proportional to the number of survivors. */
+void fenn_gc_minor(void) {
+    FennNurseryBlock *block, *next;
+    size_t i;
+    if (NULL == fenn_gc.nursery)
+        return;
+
+    // Values held by the host and the collector cannot move
+    for (i = 0; i < fenn_gc.rootcount; i++)
+        fenn_gc_pin(fenn_gc_object(fenn_gc.roots[i]));
+    for (i = 0; i < fenn_gc.graycount; i++)
+        fenn_gc_pin(fenn_gc.gray[i]);
+
+    for (i = 0; i < fenn_gc.rootcount; i++)
+        fenn_gc_evacuateslot(fenn_gc.roots + i);
+    for (i = 0; i < fenn_gc.rootsetcount; i++) {
+        FennGCRootSet *set = fenn_gc.rootsets + i;
+        FennObject *values = *set->values;
+        size_t j = set->clean ? *set->clean : 0, count = *set->count;
+        for (; j < count; j++)
+            fenn_gc_evacuateslot(values + j);
+        if (set->clean)
+            *set->clean = count;
+    }
+    for (i = 0; i < fenn_gc.graycount; i++)
+        if (fenn_gc.gray[i]->flags & FENN_MEM_YOUNG)
+            fenn_gc_evacuate(fenn_gc.gray[i]);
+    for (i = 0; i < fenn_gc.rememberedcount; i++) {
+        FennGCObject *obj = fenn_gc.remembered[i];
+        obj->flags &= ~FENN_MEM_REMEMBERED;
+        fenn_gc_visit(obj, fenn_gc_evacuateslot);
+    }
+    fenn_gc.rememberedcount = 0;
+    while (fenn_gc_scancount)
+        fenn_gc_visit(fenn_gc_scan[--fenn_gc_scancount], fenn_gc_evacuateslot);
+
+    // Dead young objects with outside memory
+    for (i = 0; i < fenn_gc.finalizecount; i++) {
+        FennGCObject *obj = fenn_gc.finalize[i];
+        if (!(obj->flags & (FENN_MEM_FORWARDED | FENN_MEM_PINNED)))
+            fenn_gc_finalize(obj);
+    }
+    fenn_gc.finalizecount = 0;
+
+    // Account for the dead, promote pinned blocks and recycle the rest
+    for (block = fenn_gc.nursery; NULL != block; block = next) {
+        char *p = (char *) block + fenn_nursery_round(sizeof(FennNurseryBlock));
+        next = block->next;
+        while (p < block->bump) {
+            FennGCObject *obj = (FennGCObject *) p;
+            size_t size = fenn_gc_size(obj);
+            p += fenn_nursery_round(size);
+            if (!(obj->flags & (FENN_MEM_PINNED | FENN_MEM_FORWARDED)))
+                fenn_gc_release(obj, size);
+        }
+        if (block->pinned) {
+            fenn_gc_promoteblock(block);
+            if (block->live == 0)
+                free(block);
+        } else {
+            block->next = fenn_gc.nurseryfree;
+            fenn_gc.nurseryfree = block;
+        }
+    }
+    fenn_gc.nursery = NULL;
+    fenn_gc.young = 0;
+    fenn_gc.minors++;
+}
+
+/* Moving heaps between threads */
+
+/* Hand every object of this thread over to fenn_gc_attach on another
+ * thread. Values that must survive have to be rooted; the nursery is
+ * emptied first so that every object left is old. The thread keeps an
+ * empty heap and can carry on or call fenn_deinit. */
+void fenn_gc_detach(FennGCHeap *heap) {
+    fenn_gc_minor();
+    heap->blocks = fenn_gc.blocks;
+    heap->allocated = fenn_gc.allocated;
+    memcpy(heap->stats, fenn_gc.stats, sizeof(heap->stats));
+    fenn_slab_detach(heap->slabs);
+    // Abandon the current cycle, the objects are unmarked on attach
+    fenn_markbits_clear();
+    fenn_gc.blocks = NULL;
+    fenn_gc.sweep = NULL;
+    fenn_gc.phase = FENN_GC_PAUSE;
+    fenn_gc.graycount = 0;
+    fenn_gc.allocated = 0;
+    fenn_gc.since = 0;
+    memset(fenn_gc.stats, 0, sizeof(fenn_gc.stats));
+}
+
+/* Points symbol slots at the symbol interned here if they were forwarded */
+static void fenn_gc_adoptslot(FennObject *slot) {
+    FennObject x = *slot;
+    if (fenn_checktype(x, FENN_SYMBOL) || fenn_checktype(x, FENN_KEYWORD)) {
+        FennGCObject *obj = fenn_gc_object(x);
+        if (obj->flags & FENN_MEM_FORWARDED) {
+            const uint8_t *sym = ((FennStringHead *) obj->next)->data;
+            slot->u64 = (x.u64 & FENN_TAGBITS) | (uint64_t) (uintptr_t) sym;
+        }
+    }
+}
+
+/* Take over a heap detached on another thread, which must have finished
+ * with it. Symbols are interned here; where a symbol of the same name
+ * already exists, references to the copy from the heap and from values
+ * are redirected and the copy is freed. The objects start out unmarked,
+ * just like new allocations. */
+void fenn_gc_attach(FennGCHeap *heap, FennObject *values, size_t count) {
+    FennGCObject **link = &heap->blocks;
+    FennGCObject *obj;
+    size_t i;
+    fenn_slab_attach(heap->slabs);
+    fenn_gc.allocated += heap->allocated;
+    fenn_gc.since += heap->allocated;
+    for (i = 0; i < FENN_MEMORY_TYPES; i++) {
+        fenn_gc.stats[i].objects += heap->stats[i].objects;
+        fenn_gc.stats[i].bytes += heap->stats[i].bytes;
+        fenn_gc.stats[i].allocations += heap->stats[i].allocations;
+        fenn_gc.stats[i].frees += heap->stats[i].frees;
+        fenn_gc.stats[i].large += heap->stats[i].large;
+    }
+    while (NULL != (obj = *link)) {
+        // Tuples and shapes consed on the other thread are not in the
+        // tables here
+        obj->flags &= ~(FENN_MEM_BLACK | FENN_MEM_GRAY | FENN_MEM_REMEMBERED | FENN_MEM_CONSED);
+        // Owners of trie nodes are only unique per thread
+        if (fenn_gc_type(obj) == FENN_MEMORY_TRIE)
+            ((FennTrieNode *) obj)->owner = 0;
+        if (fenn_gc_type(obj) == FENN_MEMORY_SYMBOL) {
+            const uint8_t *sym = ((FennStringHead *) obj)->data;
+            const uint8_t *interned = fenn_symbol_adopt(sym);
+            if (interned != sym) {
+                // Unlink the copy and forward it to the interned symbol
+                *link = obj->next;
+                obj->flags |= FENN_MEM_FORWARDED;
+                obj->next = &fenn_string_head(interned)->gc;
+                fenn_gc_push(&fenn_gc_scan, &fenn_gc_scancount, &fenn_gc_scancap, obj);
+                continue;
+            }
+        }
+        if (fenn_gc.phase == FENN_GC_SWEEP)
+            fenn_markbits_set(obj);
+        link = &obj->next;
+    }
+    if (fenn_gc_scancount) {
+        for (obj = heap->blocks; NULL != obj; obj = obj->next)
+            fenn_gc_visit(obj, fenn_gc_adoptslot);
+        for (i = 0; i < count; i++)
+            fenn_gc_adoptslot(values + i);
+        while (fenn_gc_scancount) {
+            obj = fenn_gc_scan[--fenn_gc_scancount];
+            obj->flags &= ~FENN_MEM_FORWARDED;
+            fenn_gc_free(obj);
+        }
+    }
+    *link = fenn_gc.blocks;
+    fenn_gc.blocks = heap->blocks;
+    heap->blocks = NULL;
+}
+
+/* Major collection */
+
+/* Shade every root */
+static void fenn_gc_markroots(void) {
+    size_t i, j;
+    for (i = 0; i < fenn_gc.rootcount; i++)
+        fenn_mark(fenn_gc.roots[i]);
+    for (i = 0; i < fenn_gc.rootsetcount; i++) {
+        FennObject *values = *fenn_gc.rootsets[i].values;
+        size_t count = *fenn_gc.rootsets[i].count;
+        for (j = 0; j < count; j++)
+            fenn_mark(values[j]);
+    }
+}
+
+/* Start a new collection cycle by shading the roots */
+static void fenn_gc_start(void) {
+    fenn_gc.phase = FENN_GC_MARK;
+    fenn_gc_markroots();
+}
+
+/* Finish marking. The nursery is emptied so that every live object takes
+ * part in the sweep. Everything still unmarked after this is garbage.
+ * Objects linked into the heap from here on are marked as they join and
+ * survive the sweep. */
+static void fenn_gc_atomic(void) {
+    // Root sets change without a barrier, so they are shaded again
+    fenn_gc_markroots();
+    while (fenn_gc.graycount)
+        fenn_gc_blacken(fenn_gc.gray[--fenn_gc.graycount]);
+    fenn_gc_minor();
+    fenn_gc.sweep = &fenn_gc.blocks;
+    fenn_gc.phase = FENN_GC_SWEEP;
+}
+
+/* Do up to budget units of work on the current cycle, starting a new one if
+ * the collector is idle. Returns 1 if the cycle finished in this step. */
+int fenn_gcstep(size_t budget) {
+    size_t work = 0;
+    if (fenn_gc.phase == FENN_GC_PAUSE)
+        fenn_gc_start();
+    if (fenn_gc.phase == FENN_GC_MARK) {
+        while (work < budget && fenn_gc.graycount)
+            work += fenn_gc_blacken(fenn_gc.gray[--fenn_gc.graycount]);
+        if (fenn_gc.graycount)
+            return 0;
+        fenn_gc_atomic();
+    }
+    if (fenn_gc.phase == FENN_GC_SWEEP) {
+        // Survivors are only read, their marks are dropped all at once
+        while (work < budget && *fenn_gc.sweep) {
+            FennGCObject *obj = *fenn_gc.sweep;
+            if (!fenn_markbits_get(obj)) {
+                *fenn_gc.sweep = obj->next;
+                fenn_gc_free(obj);
+            } else {
+                fenn_gc.sweep = &obj->next;
+            }
+            work++;
+        }
+        if (*fenn_gc.sweep)
+            return 0;
+        fenn_markbits_clear();
+        fenn_gc.sweep = NULL;
+        fenn_gc.since = 0;
+        fenn_gc.phase = FENN_GC_PAUSE;
+    }
+    return 1;
+}
+
+/* Run a collection to completion. A cycle that is already in progress is
+ * finished first, so that garbage left by it is collected too. */
+void fenn_collect(void) {
+    if (fenn_gc.phase != FENN_GC_PAUSE)
+        while (!fenn_gcstep(SIZE_MAX));
+    fenn_gcstep(SIZE_MAX);
+}
+
+/* Collect the nursery once it is full and do a single incremental step if
+ * enough memory has been allocated. Should only be called when every live
+ * value is reachable from a root. */
+void fenn_maybe_collect(void) {
+    if (fenn_gc.young >= fenn_gc.nurserysize)
+        fenn_gc_minor();
+    if (fenn_gc.phase == FENN_GC_PAUSE && fenn_gc.since < fenn_gc.interval)
+        return;
+    fenn_gcstep(fenn_gc.stepsize);
+}
+
+/* Set the work budget of each step taken by fenn_maybe_collect */
+void fenn_gcsetstep(size_t stepsize) {
+    fenn_gc.stepsize = stepsize ? stepsize : 1;
+}
+
+/* Set the number of bytes to allocate before a new cycle is started */
+void fenn_gcsetinterval(size_t interval) {
+    fenn_gc.interval = interval;
+}
+
+/* Set the number of bytes to allocate young before the nursery is collected */
+void fenn_gcsetnursery(size_t size) {
+    fenn_gc.nurserysize = size;
+}
+
+/* Add a root value to the collector. Roots and everything reachable from
+ * them are never collected or moved. */
+void fenn_gcroot(FennObject root) {
+    size_t newcount = fenn_gc.rootcount + 1;
+    if (newcount > fenn_gc.rootcap) {
+        FennObject *next;
+        size_t newcap = 2 * newcount;
+        next = realloc(fenn_gc.roots, sizeof(FennObject) * newcap);
+        if (NULL == next) {
+            // TODO: Handle Out Of Memory error
+        }
+        fenn_gc.roots = next;
+        fenn_gc.rootcap = newcap;
+    }
+    fenn_gc.roots[fenn_gc.rootcount] = root;
+    fenn_gc.rootcount = newcount;
+    // Keep the invariant that roots are never unmarked while marking
+    if (fenn_gc.phase == FENN_GC_MARK)
+        fenn_mark(root);
+}
+
+/* Treat an array of values owned by C code as roots. The values may be
+ * moved out of the nursery, in which case the array is updated in place. */
+void fenn_gc_addrootset(FennObject **values, size_t *count, size_t *clean) {
+    size_t newcount = fenn_gc.rootsetcount + 1;
+    if (newcount > fenn_gc.rootsetcap) {
+        FennGCRootSet *next;
+        size_t newcap = 2 * newcount;
+        next = realloc(fenn_gc.rootsets, sizeof(FennGCRootSet) * newcap);
+        if (NULL == next) {
+            // TODO: Handle Out Of Memory error
+        }
+        fenn_gc.rootsets = next;
+        fenn_gc.rootsetcap = newcap;
+    }
+    fenn_gc.rootsets[fenn_gc.rootsetcount].values = values;
+    fenn_gc.rootsets[fenn_gc.rootsetcount].count = count;
+    fenn_gc.rootsets[fenn_gc.rootsetcount].clean = clean;
+    fenn_gc.rootsetcount = newcount;
+}
+
+/* Stop treating an array of values as roots */
+void fenn_gc_removerootset(FennObject **values) {
+    size_t i;
+    for (i = 0; i < fenn_gc.rootsetcount; i++) {
+        if (fenn_gc.rootsets[i].values == values) {
+            fenn_gc.rootsets[i] = fenn_gc.rootsets[--fenn_gc.rootsetcount];
+            return;
+        }
+    }
+}
+
+/* Remove one instance of a root value. Returns 1 if it was found */
+int fenn_gcunroot(FennObject root) {
+    FennObject *roots = fenn_gc.roots;
+    FennObject *end = roots + fenn_gc.rootcount;
+    for (; roots < end; roots++) {
+        if (fenn_u64(*roots) == fenn_u64(root)) {
+            *roots = end[-1];
+            fenn_gc.rootcount--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Remove every instance of a root value. Returns 1 if any were found */
+int fenn_gcunrootall(FennObject root) {
+    FennObject *roots = fenn_gc.roots;
+    FennObject *end = roots + fenn_gc.rootcount;
+    int found = 0;
+    while (roots < end) {
+        if (fenn_u64(*roots) == fenn_u64(root)) {
+            *roots = *--end;
+            fenn_gc.rootcount--;
+            found = 1;
+        } else {
+            roots++;
+        }
+    }
+    return found;
+}
+
+/* Allocate memory managed by the collector. Small objects of types that die
+ * young are allocated in the nursery, everything else is allocated old. */
 void *fenn_gcalloc(FennMemoryType type, size_t size) {
-    (void)type;
-    // TODO: Build better GC
-    return malloc(size);
-}
\ No newline at end of file
+    FennMemoryStats *stats = fenn_gc.stats + type;
+    int32_t flags = (int32_t) type;
+    FennGCObject *mem = NULL;
+    if (size <= FENN_NURSERY_MAXSIZE && fenn_gc_nurserytype(type))
+        mem = fenn_nursery_alloc(size);
+    if (NULL != mem) {
+        mem->flags = flags | FENN_MEM_YOUNG;
+        mem->next = NULL;
+        if (type == FENN_MEMORY_BUFFER || type == FENN_MEMORY_TABLE || type == FENN_MEMORY_ARRAY)
+            fenn_gc_push(&fenn_gc.finalize, &fenn_gc.finalizecount, &fenn_gc.finalizecap, mem);
+    } else {
+        mem = fenn_gc_allocold(type, size, flags);
+    }
+    stats->objects++;
+    stats->bytes += size;
+    stats->allocations++;
+    fenn_gc.allocated += size;
+    fenn_gc.since += size;
+    return mem;
+}
+
+/* Set if this thread is counted as using the hash seed */
+static FENN_THREAD_LOCAL int fenn_gc_hashing = 0;
+
+/* Set up the collector for the current thread */
+void fenn_init(void) {
+    fenn_hash_init();
+    if (!fenn_gc_hashing) {
+        fenn_hash_attach();
+        fenn_gc_hashing = 1;
+    }
+    fenn_scan_init();
+    memset(&fenn_gc, 0, sizeof(fenn_gc));
+    fenn_gc.phase = FENN_GC_PAUSE;
+    fenn_gc.interval = FENN_GC_INTERVAL;
+    fenn_gc.stepsize = FENN_GC_STEPSIZE;
+    fenn_gc.nurserysize = FENN_NURSERY_SIZE;
+    fenn_symcache_init();
+}
+
+/* Free every object and all collector state of the current thread */
+void fenn_deinit(void) {
+    FennGCObject *obj;
+    FennNurseryBlock *block;
+    size_t i;
+    // Every tuple and shape is about to go, there is no need to remove them
+    // one by one
+    fenn_tuplecache_deinit();
+    fenn_shapecache_deinit();
+    // Young objects that were tenured hand their memory to the copy
+    for (i = 0; i < fenn_gc.finalizecount; i++)
+        if (!(fenn_gc.finalize[i]->flags & FENN_MEM_FORWARDED))
+            fenn_gc_finalize(fenn_gc.finalize[i]);
+    while (NULL != (block = fenn_gc.nursery)) {
+        fenn_gc.nursery = block->next;
+        free(block);
+    }
+    while (NULL != (block = fenn_gc.nurseryfree)) {
+        fenn_gc.nurseryfree = block->next;
+        free(block);
+    }
+    obj = fenn_gc.blocks;
+    while (NULL != obj) {
+        FennGCObject *next = obj->next;
+        fenn_gc_free(obj);
+        obj = next;
+    }
+    free(fenn_gc.gray);
+    free(fenn_gc.roots);
+    free(fenn_gc.rootsets);
+    free(fenn_gc.remembered);
+    free(fenn_gc.finalize);
+    free(fenn_gc_scan);
+    fenn_gc_scan = NULL;
+    fenn_gc_scancount = fenn_gc_scancap = 0;
+    fenn_symcache_deinit();
+    fenn_image_deinit();
+    fenn_markbits_deinit();
+    fenn_buffer_pooldeinit();
+    fenn_slab_deinit();
+    memset(&fenn_gc, 0, sizeof(fenn_gc));
+    if (fenn_gc_hashing) {
+        fenn_hash_detach();
+        fenn_gc_hashing = 0;
+    }
+}
+
+/* Get the allocation statistics for a type of memory */
+void fenn_memory_stats(FennMemoryType type, FennMemoryStats *stats) {
+    *stats = fenn_gc.stats[type];
+}
+
+#ifdef __linux__
+
+/* Pages of the heap, collected by fenn_heap_pages */
+static FENN_THREAD_LOCAL uintptr_t *fenn_gc_pages;
+static FENN_THREAD_LOCAL size_t fenn_gc_pagecount;
+static FENN_THREAD_LOCAL size_t fenn_gc_pagecap;
+static FENN_THREAD_LOCAL uintptr_t fenn_gc_pagesize;
+
+/* Add the pages of a span of memory */
+static void fenn_gc_addpages(const void *mem, size_t size) {
+    uintptr_t page = (uintptr_t) mem / fenn_gc_pagesize;
+    uintptr_t last = ((uintptr_t) mem + size - 1) / fenn_gc_pagesize;
+    for (; page <= last; page++) {
+        // Objects next to each other in the heap often share a page
+        if (fenn_gc_pagecount && fenn_gc_pages[fenn_gc_pagecount - 1] == page)
+            continue;
+        if (fenn_gc_pagecount == fenn_gc_pagecap) {
+            size_t newcap = fenn_gc_pagecap ? 2 * fenn_gc_pagecap : 1024;
+            uintptr_t *next = realloc(fenn_gc_pages, newcap * sizeof(uintptr_t));
+            if (NULL == next) {
+                // TODO: Handle Out Of Memory
+            }
+            fenn_gc_pages = next;
+            fenn_gc_pagecap = newcap;
+        }
+        fenn_gc_pages[fenn_gc_pagecount++] = page;
+    }
+}
+
+static int fenn_gc_comparepages(const void *a, const void *b) {
+    uintptr_t x = *(const uintptr_t *) a, y = *(const uintptr_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+#endif
+
+/* Count the pages that hold old objects and loaded images, and how many
+ * of them are resident and shared with another process, such as the
+ * parent of a forked worker. Returns 0 on success or -1 if the system
+ * cannot tell. */
+int fenn_heap_pages(FennHeapPages *pages) {
+#ifdef __linux__
+    uint64_t entries[512];
+    FennGCObject *obj;
+    size_t i, n;
+    int status = 0;
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    memset(pages, 0, sizeof(*pages));
+    if (fd < 0)
+        return -1;
+    fenn_gc_pagesize = (uintptr_t) sysconf(_SC_PAGESIZE);
+    fenn_gc_pagecount = 0;
+    for (obj = fenn_gc.blocks; NULL != obj; obj = obj->next)
+        fenn_gc_addpages(obj, fenn_gc_size(obj));
+    fenn_image_spans(fenn_gc_addpages);
+    qsort(fenn_gc_pages, fenn_gc_pagecount, sizeof(uintptr_t), fenn_gc_comparepages);
+    for (i = n = 0; i < fenn_gc_pagecount; i++)
+        if (n == 0 || fenn_gc_pages[n - 1] != fenn_gc_pages[i])
+            fenn_gc_pages[n++] = fenn_gc_pages[i];
+    pages->pages = n;
+    // Read the entries of runs of consecutive pages at once. Bit 63 is set
+    // for pages in memory, bit 56 for pages mapped by this process only.
+    for (i = 0; i < n;) {
+        size_t run = 1, j;
+        while (i + run < n && run < 512 && fenn_gc_pages[i + run] == fenn_gc_pages[i] + run)
+            run++;
+        if (pread(fd, entries, run * sizeof(uint64_t), (off_t) (fenn_gc_pages[i] * sizeof(uint64_t)))
+            != (ssize_t) (run * sizeof(uint64_t))) {
+            status = -1;
+            break;
+        }
+        for (j = 0; j < run; j++) {
+            if (entries[j] >> 63) {
+                pages->resident++;
+                if (!((entries[j] >> 56) & 1))
+                    pages->shared++;
+            }
+        }
+        i += run;
+    }
+    close(fd);
+    free(fenn_gc_pages);
+    fenn_gc_pages = NULL;
+    fenn_gc_pagecap = 0;
+    return status;
+#else
+    memset(pages, 0, sizeof(*pages));
+    return -1;
+#endif
+}
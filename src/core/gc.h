@@ -23,4 +23,176 @@
 #ifndef GC_H
 #define GC_H
 
-#endif
\ No newline at end of file
+#include "slab.h"
+#include "markbits.h"
+
+/* The low bits of FennGCObject.flags store the FennMemoryType of the
+ * allocation, the bits above describe where it lives. Old objects are
+ * marked in side bitmaps, so a collection does not write to them; only
+ * young objects, whose pages are private anyway, and image objects, which
+ * count as always marked, carry their mark in the flags. */
+#define FENN_MEM_TYPEBITS  0xFF
+#define FENN_MEM_BLACK     0x400  // Marked, on young and image objects only
+#define FENN_MEM_LARGE     0x800  // Allocated with malloc rather than a slab
+#define FENN_MEM_YOUNG     0x1000 // Lives in the nursery
+#define FENN_MEM_FORWARDED 0x2000 // Copied out of the nursery, next is the copy
+#define FENN_MEM_PINNED    0x4000 // Survived a minor collection in place
+#define FENN_MEM_REMEMBERED 0x8000 // Old object in the remembered set
+#define FENN_MEM_NURSERY   0x10000 // Old object living in a promoted nursery block
+#define FENN_MEM_SOURCEMAP 0x20000 // Tuple followed by a FennSourceMap
+#define FENN_MEM_CONSED    0x40000 // Tuple or shape in a hash-cons table
+#define FENN_MEM_TRIE      0x80000 // Struct stored as a hash trie
+#define FENN_MEM_IMAGE     0x100000 // Lives in a mapped heap image, never collected
+#define FENN_MEM_GRAY      0x200000 // Pushed gray again by fenn_gc_barrierback
+
+#define fenn_gc_type(o) ((FennMemoryType)((o)->flags & FENN_MEM_TYPEBITS))
+
+#define FENN_MEMORY_TYPES (FENN_MEMORY_TRIE + 1)
+
+/* Default tuning */
+#define FENN_GC_INTERVAL 0x400000 // Bytes allocated between collection cycles
+#define FENN_GC_STEPSIZE 1024     // Units of work done by each incremental step
+#define FENN_NURSERY_SIZE 0x100000 // Bytes allocated young before a minor collection
+
+/* Short lived objects are bump allocated from nursery blocks. Blocks are
+ * aligned to their size so the block of a young object can be found by
+ * masking its address. */
+#define FENN_NURSERY_BLOCK 0x10000
+#define FENN_NURSERY_MAXSIZE 256
+#define FENN_NURSERY_ALIGN 16
+
+#define fenn_nursery_round(size) (((size) + FENN_NURSERY_ALIGN - 1) & ~(size_t)(FENN_NURSERY_ALIGN - 1))
+#define fenn_nursery_of(p) \
+    ((FennNurseryBlock *)((uintptr_t)(p) & ~(uintptr_t)(FENN_NURSERY_BLOCK - 1)))
+
+typedef struct FennNurseryBlock FennNurseryBlock;
+
+struct FennNurseryBlock {
+    FennNurseryBlock *next;
+    char *bump;             // Next free byte
+    char *end;              // End of the block
+    int32_t pinned;         // Holds an object referenced from outside the heap
+    int32_t live;           // Old objects still in a promoted block
+};
+
+typedef enum FennGCPhase FennGCPhase;
+
+enum FennGCPhase {
+    FENN_GC_PAUSE,
+    FENN_GC_MARK,
+    FENN_GC_SWEEP
+};
+
+typedef struct FennGCRootSet FennGCRootSet;
+
+/* An array of values owned by C code, such as the value stack of a parser.
+ * The array may be reallocated and resized at any time, so the collector
+ * keeps the addresses of the pointer and the count. If clean is given, the
+ * values below *clean are known to be old and minor collections only scan
+ * from there, moving *clean up to the count. The owner must lower *clean
+ * whenever it replaces a value below it. */
+struct FennGCRootSet {
+    FennObject **values;
+    size_t *count;
+    size_t *clean;
+};
+
+typedef struct FennGC FennGC;
+
+/* Collector state, one per thread */
+struct FennGC {
+    FennGCObject *blocks;   // Every live allocation
+    FennGCObject **sweep;   // Link to the next object to be swept
+    FennGCPhase phase;      // Current phase of the collection cycle
+
+    // Gray stack
+    FennGCObject **gray;
+    size_t graycount;
+    size_t graycap;
+
+    // Roots
+    FennObject *roots;
+    size_t rootcount;
+    size_t rootcap;
+
+    // Arrays of values owned by C code
+    FennGCRootSet *rootsets;
+    size_t rootsetcount;
+    size_t rootsetcap;
+
+    // Accounting
+    size_t allocated;       // Bytes currently allocated
+    size_t since;           // Bytes allocated since the last cycle finished
+    size_t interval;        // Bytes to allocate before starting a cycle
+    size_t stepsize;        // Work budget used by fenn_maybe_collect
+    FennMemoryStats stats[FENN_MEMORY_TYPES];
+
+    // Nursery
+    FennNurseryBlock *nursery;     // Blocks holding young objects, current first
+    FennNurseryBlock *nurseryfree; // Empty blocks ready for reuse
+    size_t young;                  // Bytes allocated young since the last minor collection
+    size_t nurserysize;            // Bytes to allocate young before a minor collection
+    size_t minors;                 // Number of minor collections
+
+    // Old objects that may refer to young ones
+    FennGCObject **remembered;
+    size_t rememberedcount;
+    size_t rememberedcap;
+
+    // Young objects that own memory outside the heap
+    FennGCObject **finalize;
+    size_t finalizecount;
+    size_t finalizecap;
+};
+
+typedef struct FennGCHeap FennGCHeap;
+
+/* The objects of one thread, detached so another thread can take them
+ * over. Used to build values in parallel on worker threads. */
+struct FennGCHeap {
+    FennGCObject *blocks;
+    FennSlab *slabs[FENN_SLAB_CLASSES];
+    size_t allocated;
+    FennMemoryStats stats[FENN_MEMORY_TYPES];
+};
+
+extern FENN_THREAD_LOCAL FennGC fenn_gc;
+
+/* Check if an object has been reached by the current cycle. Marked
+ * objects are gray while on the gray stack and black after that. */
+#define fenn_gc_ismarked(o) \
+    (((o)->flags & (FENN_MEM_YOUNG | FENN_MEM_IMAGE)) \
+        ? ((o)->flags & FENN_MEM_BLACK) != 0 \
+        : fenn_markbits_get(o))
+
+/* Check if an old object was left unmarked by the last cycle and is about
+ * to be swept, in which case it may refer to objects already freed */
+#define fenn_gc_dying(o) \
+    (fenn_gc.phase == FENN_GC_SWEEP && !((o)->flags & FENN_MEM_YOUNG) && !fenn_gc_ismarked(o))
+
+FennGCObject *fenn_gc_object(FennObject);
+size_t fenn_gc_visit(FennGCObject *, FennGCVisitor);
+void fenn_gc_markobject(FennGCObject *);
+int fenn_gc_setmark(FennGCObject *);
+size_t fenn_gc_size(FennGCObject *);
+void fenn_gc_remember(FennGCObject *);
+void fenn_gc_barrierback(FennGCObject *);
+FennGCObject *fenn_gc_tenure(FennGCObject *);
+void fenn_gc_addrootset(FennObject **, size_t *, size_t *);
+void fenn_gc_removerootset(FennObject **);
+void fenn_gc_minor(void);
+void fenn_gc_detach(FennGCHeap *);
+void fenn_gc_attach(FennGCHeap *, FennObject *, size_t);
+
+/* Write barrier, must be called when a value is stored into a mutable
+ * container that has already been handed out. Keeps old containers that
+ * refer to young objects in the remembered set, and keeps marked containers
+ * from pointing at unmarked objects while marking. */
+#define fenn_gc_barrier(o, x) do { \
+    if (!((o)->flags & (FENN_MEM_YOUNG | FENN_MEM_REMEMBERED))) \
+        fenn_gc_remember(o); \
+    if (fenn_gc.phase == FENN_GC_MARK && fenn_gc_ismarked(o)) \
+        fenn_mark(x); \
+} while (0)
+
+#endif
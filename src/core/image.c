@@ -0,0 +1,818 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include "gc.h"
+#include "symcache.h"
+#include "util.h"
+#include "objects/farray.h"
+#include "objects/fbuffer.h"
+#include "objects/fstring.h"
+#include "objects/fstruct.h"
+#include "objects/ftable.h"
+#include "objects/ftrie.h"
+#include "objects/ftuple.h"
+#include "image.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define fenn_image_round(size) (((size) + FENN_IMAGE_ALIGN - 1) & ~(uint64_t) (FENN_IMAGE_ALIGN - 1))
+
+typedef struct FennImageStub FennImageStub;
+
+/* How arrays, tables and buffers are stored: the elements of an array,
+ * the keys and values of a table one after the other, or the bytes of a
+ * buffer. They are rebuilt on the heap when the image is loaded. */
+struct FennImageStub {
+    FennGCObject gc;
+    int32_t count;  // Elements, pairs or bytes
+    int32_t unused;
+    FennObject data[];
+};
+
+typedef struct FennImage FennImage;
+
+/* A loaded image */
+struct FennImage {
+    FennImage *next;
+    char *base;
+    size_t size;
+    FennObject *values; // Heap objects the image refers to, kept as roots
+    size_t count;
+    size_t capacity;
+};
+
+typedef struct FennImageWriter FennImageWriter;
+
+struct FennImageWriter {
+    FennTable *offsets;     // Objects laid out so far, to their offset
+    FennGCObject **objects; // Objects in the order they are written
+    size_t count;
+    size_t capacity;
+    uint64_t size;          // Bytes laid out so far
+    const char *error;
+};
+
+/* Images loaded on this thread */
+static FENN_THREAD_LOCAL FennImage *fenn_images;
+
+/* State of the image being written or loaded, for the visitors */
+static FENN_THREAD_LOCAL FennImageWriter *fenn_image_writer;
+static FENN_THREAD_LOCAL FennImage *fenn_image_loading;
+static FENN_THREAD_LOCAL uint8_t *fenn_image_starts;
+
+/* Each byte of fenn_image_starts is 0 where no object starts, or one more
+ * than the memory type of the object, with marks for checking tuples */
+#define FENN_IMAGE_TYPEBITS 0x1F
+#define FENN_IMAGE_MOVED    0x20 // Tuple hashed by where a rebuilt object lives
+#define FENN_IMAGE_SEEN     0x40 // Tuple whose elements are being checked
+#define FENN_IMAGE_DONE     0x80 // Tuple checked
+static FENN_THREAD_LOCAL int fenn_image_corrupt;
+
+/* Check if an object is stored as a FennImageStub */
+static int fenn_image_isstub(FennMemoryType type) {
+    return type == FENN_MEMORY_ARRAY || type == FENN_MEMORY_TABLE || type == FENN_MEMORY_BUFFER;
+}
+
+static uint64_t fenn_image_stubsize(FennMemoryType type, int32_t count) {
+    switch (type) {
+        case FENN_MEMORY_ARRAY:
+            return sizeof(FennImageStub) + (uint64_t) count * sizeof(FennObject);
+        case FENN_MEMORY_TABLE:
+            return sizeof(FennImageStub) + (uint64_t) count * sizeof(FennKV);
+        default:
+            return sizeof(FennImageStub) + (uint64_t) count;
+    }
+}
+
+/* Check if a value holds a pointer to a heap object that can be written */
+static int fenn_image_haspointer(FennObject x) {
+    switch (fenn_type(x)) {
+        case FENN_STRING:
+        case FENN_SYMBOL:
+        case FENN_KEYWORD:
+        case FENN_ARRAY:
+        case FENN_TUPLE:
+        case FENN_TABLE:
+        case FENN_STRUCT:
+        case FENN_BUFFER:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* Writing */
+
+/* Bytes an object takes up in the image, before rounding */
+static uint64_t fenn_image_writesize(FennGCObject *obj) {
+    switch (fenn_gc_type(obj)) {
+        case FENN_MEMORY_ARRAY:
+            return fenn_image_stubsize(FENN_MEMORY_ARRAY, ((FennArray *) obj)->count);
+        case FENN_MEMORY_TABLE:
+            return fenn_image_stubsize(FENN_MEMORY_TABLE, ((FennTable *) obj)->count);
+        case FENN_MEMORY_BUFFER:
+            return fenn_image_stubsize(FENN_MEMORY_BUFFER, ((FennBuffer *) obj)->count);
+        default:
+            return fenn_gc_size(obj);
+    }
+}
+
+/* Give the object a value points to a place in the image if it has none */
+static void fenn_image_layout(FennObject *slot) {
+    FennImageWriter *w = fenn_image_writer;
+    FennGCObject *obj;
+    FennObject key;
+    if (!fenn_image_haspointer(*slot)) {
+        switch (fenn_type(*slot)) {
+            case FENN_FIBER:
+            case FENN_FUNCTION:
+            case FENN_CFUNCTION:
+            case FENN_ABSTRACT:
+            case FENN_POINTER:
+                w->error = "cannot write pointers or abstract values to an image";
+                break;
+            default:
+                break;
+        }
+        return;
+    }
+    obj = fenn_gc_object(*slot);
+    if (fenn_gc_type(obj) == FENN_MEMORY_BUFFER && ((FennBuffer *) obj)->count > INT32_MAX) {
+        w->error = "cannot write buffers over 2GB to an image";
+        return;
+    }
+    key = fenn_wrap_pointer(obj);
+    if (!fenn_checktype(fenn_table_get(w->offsets, key), FENN_NIL))
+        return;
+    fenn_table_put(w->offsets, key, fenn_wrap_number((double) w->size));
+    if (w->count == w->capacity) {
+        size_t newcap = w->capacity ? 2 * w->capacity : 64;
+        FennGCObject **next = realloc(w->objects, newcap * sizeof(FennGCObject *));
+        if (NULL == next) {
+            // TODO: Handle Out Of Memory
+        }
+        w->objects = next;
+        w->capacity = newcap;
+    }
+    w->objects[w->count++] = obj;
+    w->size += fenn_image_round(fenn_image_writesize(obj));
+}
+
+/* Lay out everything an object refers to. Tables are written as their
+ * pairs, so the shape of a shaped table is left out. */
+static void fenn_image_layoutslots(FennGCObject *obj) {
+    if (fenn_gc_type(obj) == FENN_MEMORY_TABLE) {
+        FennKV kv;
+        int32_t i = 0;
+        while (0 != (i = fenn_table_next((FennTable *) obj, i, &kv))) {
+            fenn_image_layout(&kv.key);
+            fenn_image_layout(&kv.value);
+        }
+    } else {
+        fenn_gc_visit(obj, fenn_image_layout);
+    }
+}
+
+/* Replace a pointer by the offset of the byte it points to */
+static void fenn_image_offset(FennObject *slot) {
+    FennGCObject *obj;
+    uint64_t offset;
+    if (!fenn_image_haspointer(*slot))
+        return;
+    obj = fenn_gc_object(*slot);
+    offset = (uint64_t) fenn_unwrap_number(fenn_table_get(fenn_image_writer->offsets, fenn_wrap_pointer(obj)));
+    offset += (uint64_t) ((char *) fenn_to_pointer(*slot) - (char *) obj);
+    slot->u64 = (slot->u64 & FENN_TAGBITS) | offset;
+}
+
+/* Copy an object into buf as it is stored in the image. buf holds the
+ * rounded size of the object. */
+static void fenn_image_copy(FennGCObject *obj, char *buf, size_t size) {
+    FennGCObject *copy = (FennGCObject *) buf;
+    FennImageStub *stub = (FennImageStub *) buf;
+    FennMemoryType type = fenn_gc_type(obj);
+    int32_t i;
+    memset(buf, 0, size);
+    switch (type) {
+        case FENN_MEMORY_ARRAY: {
+            FennArray *array = (FennArray *) obj;
+            stub->count = array->count;
+            if (array->count)
+                memcpy(stub->data, array->data, array->count * sizeof(FennObject));
+            for (i = 0; i < array->count; i++)
+                fenn_image_offset(stub->data + i);
+            break;
+        }
+        case FENN_MEMORY_TABLE: {
+            FennKV *pairs = (FennKV *) stub->data;
+            int32_t n = 0;
+            i = 0;
+            while (0 != (i = fenn_table_next((FennTable *) obj, i, pairs + n))) {
+                fenn_image_offset(&pairs[n].key);
+                fenn_image_offset(&pairs[n].value);
+                n++;
+            }
+            stub->count = n;
+            break;
+        }
+        case FENN_MEMORY_BUFFER: {
+            FennBuffer *buffer = (FennBuffer *) obj;
+            stub->count = (int32_t) buffer->count;
+            if (buffer->count)
+                memcpy(stub->data, buffer->data, buffer->count);
+            break;
+        }
+        default:
+            memcpy(buf, obj, fenn_gc_size(obj));
+            fenn_gc_visit(copy, fenn_image_offset);
+            // Nothing in an image may be changed in place
+            if (type == FENN_MEMORY_TRIE)
+                ((FennTrieNode *) copy)->owner = 0;
+            else if (type == FENN_MEMORY_STRUCT && (obj->flags & FENN_MEM_TRIE))
+                fenn_struct_trie(((FennStructHead *) copy)->data)->owner = 0;
+            break;
+    }
+    // Always marked, so the collector leaves image objects alone.
+    // Tuples and shapes are no longer in the hash-cons tables.
+    copy->flags = (obj->flags & (FENN_MEM_TYPEBITS | FENN_MEM_SOURCEMAP | FENN_MEM_TRIE))
+                  | FENN_MEM_BLACK | FENN_MEM_IMAGE;
+    copy->next = NULL;
+}
+
+/* Write everything reachable from root to an image file. Returns NULL on
+ * success or an error message. */
+const char *fenn_image_write(const char *path, FennObject root) {
+    FennImageWriter w;
+    FennImageHeader header;
+    char *buf;
+    size_t bufsize, i;
+    FILE *f;
+    memset(&w, 0, sizeof(w));
+    w.offsets = fenn_table(0);
+    w.size = fenn_image_round(sizeof(FennImageHeader));
+    fenn_image_writer = &w;
+    header.root = root;
+    fenn_image_layout(&header.root);
+    for (i = 0; i < w.count && NULL == w.error; i++)
+        fenn_image_layoutslots(w.objects[i]);
+    if (NULL != w.error)
+        goto done;
+    header.magic = FENN_IMAGE_MAGIC;
+    header.version = FENN_IMAGE_VERSION;
+    header.start = (uint32_t) fenn_image_round(sizeof(FennImageHeader));
+    header.seed = fenn_hash_getseed();
+    header.size = w.size;
+    header.objects = w.count;
+    fenn_image_offset(&header.root);
+    f = fopen(path, "wb");
+    if (NULL == f) {
+        w.error = "could not open image file";
+        goto done;
+    }
+    bufsize = header.start;
+    buf = calloc(1, bufsize);
+    if (NULL == buf) {
+        // TODO: Handle Out Of Memory
+    }
+    memcpy(buf, &header, sizeof(header));
+    fwrite(buf, 1, header.start, f);
+    for (i = 0; i < w.count; i++) {
+        size_t size = (size_t) fenn_image_round(fenn_image_writesize(w.objects[i]));
+        if (size > bufsize) {
+            char *next = realloc(buf, size);
+            if (NULL == next) {
+                // TODO: Handle Out Of Memory
+            }
+            buf = next;
+            bufsize = size;
+        }
+        fenn_image_copy(w.objects[i], buf, size);
+        fwrite(buf, 1, size, f);
+    }
+    free(buf);
+    if (ferror(f))
+        w.error = "could not write image file";
+    if (fclose(f) && NULL == w.error)
+        w.error = "could not write image file";
+done:
+    free(w.objects);
+    fenn_image_writer = NULL;
+    return w.error;
+}
+
+/* Loading */
+
+/* Size of an object stored in an image, or 0 if it is not a valid object
+ * or does not fit in the avail bytes that are left */
+static size_t fenn_image_storedsize(FennGCObject *obj, size_t avail) {
+    FennMemoryType type = fenn_gc_type(obj);
+    size_t min, size;
+    switch (type) {
+        case FENN_MEMORY_STRING:
+        case FENN_MEMORY_SYMBOL:
+            min = sizeof(FennStringHead);
+            break;
+        case FENN_MEMORY_TUPLE:
+            min = sizeof(FennTupleHead);
+            break;
+        case FENN_MEMORY_STRUCT:
+            min = sizeof(FennStructHead);
+            break;
+        case FENN_MEMORY_TRIE:
+            min = sizeof(FennTrieNode);
+            break;
+        case FENN_MEMORY_ARRAY:
+        case FENN_MEMORY_TABLE:
+        case FENN_MEMORY_BUFFER:
+            min = sizeof(FennImageStub);
+            break;
+        default:
+            return 0;
+    }
+    if (avail < min || !(obj->flags & FENN_MEM_IMAGE))
+        return 0;
+    if (fenn_image_isstub(type)) {
+        if (((FennImageStub *) obj)->count < 0)
+            return 0;
+        size = (size_t) fenn_image_stubsize(type, ((FennImageStub *) obj)->count);
+    } else {
+        size = fenn_gc_size(obj);
+    }
+    if (size < min || fenn_image_round(size) > avail)
+        return 0;
+    return (size_t) fenn_image_round(size);
+}
+
+/* Check if an offset is where a value of a type points into an image
+ * object. The object must start there, with a memory type the value may
+ * have, as recorded in fenn_image_starts. */
+static int fenn_image_validoffset(FennType type, uint64_t offset) {
+    FennMemoryType want, also;
+    uint64_t delta = 0;
+    uint8_t found;
+    switch (type) {
+        case FENN_STRING:
+            want = also = FENN_MEMORY_STRING;
+            delta = offsetof(FennStringHead, data);
+            break;
+        case FENN_SYMBOL:
+        case FENN_KEYWORD:
+            want = also = FENN_MEMORY_SYMBOL;
+            delta = offsetof(FennStringHead, data);
+            break;
+        case FENN_TUPLE:
+            want = also = FENN_MEMORY_TUPLE;
+            delta = offsetof(FennTupleHead, data);
+            break;
+        case FENN_STRUCT:
+            // Child nodes of tries are kept as struct values
+            want = FENN_MEMORY_STRUCT;
+            also = FENN_MEMORY_TRIE;
+            delta = offsetof(FennStructHead, data);
+            break;
+        case FENN_ARRAY:
+            want = also = FENN_MEMORY_ARRAY;
+            break;
+        case FENN_TABLE:
+            want = also = FENN_MEMORY_TABLE;
+            break;
+        case FENN_BUFFER:
+            want = also = FENN_MEMORY_BUFFER;
+            break;
+        default:
+            return 0;
+    }
+    if (offset < delta)
+        return 0;
+    offset -= delta;
+    if (offset < fenn_image_round(sizeof(FennImageHeader)) || offset >= fenn_image_loading->size
+        || offset % FENN_IMAGE_ALIGN)
+        return 0;
+    found = fenn_image_starts[offset / FENN_IMAGE_ALIGN] & FENN_IMAGE_TYPEBITS;
+    return found == (uint8_t) (want + 1) || found == (uint8_t) (also + 1);
+}
+
+/* Turn an offset back into a pointer */
+static void fenn_image_pointer(FennObject *slot) {
+    uint64_t offset;
+    if (!fenn_image_haspointer(*slot))
+        return;
+    offset = slot->u64 & FENN_PAYLOAD;
+    if (!fenn_image_validoffset(fenn_type(*slot), offset)) {
+        fenn_image_corrupt = 1;
+        *slot = fenn_wrap_nil();
+        return;
+    }
+    slot->u64 = (slot->u64 & FENN_TAGBITS) | (uint64_t) (uintptr_t) (fenn_image_loading->base + offset);
+}
+
+/* Push a tuple on a stack of tuples */
+static void fenn_image_pushtuple(const FennObject ***stack, size_t *count, size_t *cap, const FennObject *t) {
+    if (*count == *cap) {
+        size_t newcap = *cap ? 2 * *cap : 64;
+        const FennObject **next = realloc(*stack, newcap * sizeof(const FennObject *));
+        if (NULL == next) {
+            // TODO: Handle Out Of Memory
+        }
+        *stack = next;
+        *cap = newcap;
+    }
+    (*stack)[(*count)++] = t;
+}
+
+/* Mark byte of an image tuple */
+#define fenn_image_tuplemark(t) \
+    (fenn_image_starts + ((char *) fenn_tuple_head(t) - fenn_image_loading->base) / FENN_IMAGE_ALIGN)
+
+/* Check the stored hash of every tuple in the image, children first, as
+ * nothing may write to the image once it is loaded. A tuple holding an
+ * array, table or buffer, directly or through other tuples, is hashed by
+ * where those live, which changes when they are rebuilt. Such tuples are
+ * added to *moved, in an order that hashes children first, instead of
+ * being checked. Returns 0 if any other tuple has the wrong hash, or if
+ * tuples contain each other. */
+static int fenn_image_checkhashes(char *start, char *end, const FennObject ***moved, size_t *nmoved) {
+    const FennObject **stack = NULL;
+    size_t count = 0, cap = 0, movedcap = 0, size;
+    int32_t i;
+    int ok = 1;
+    char *p;
+    for (p = start; ok && p < end; p += size) {
+        size = fenn_image_storedsize((FennGCObject *) p, (size_t) (end - p));
+        if (fenn_gc_type((FennGCObject *) p) != FENN_MEMORY_TUPLE)
+            continue;
+        fenn_image_pushtuple(&stack, &count, &cap, ((FennTupleHead *) p)->data);
+        while (ok && count) {
+            const FennObject *t = stack[count - 1];
+            uint8_t *mark = fenn_image_tuplemark(t);
+            int32_t len = fenn_tuple_length(t);
+            int pushed = 0, depends = 0;
+            if (*mark & FENN_IMAGE_DONE) {
+                count--;
+                continue;
+            }
+            if (!(*mark & FENN_IMAGE_SEEN)) {
+                *mark |= FENN_IMAGE_SEEN;
+                for (i = 0; i < len; i++) {
+                    uint8_t child;
+                    if (!fenn_checktype(t[i], FENN_TUPLE))
+                        continue;
+                    child = *fenn_image_tuplemark(fenn_unwrap_tuple(t[i]));
+                    if (child & FENN_IMAGE_DONE)
+                        continue;
+                    // Only the tuples being checked below this one are seen
+                    // and not done
+                    if (child & FENN_IMAGE_SEEN) {
+                        ok = 0;
+                        break;
+                    }
+                    fenn_image_pushtuple(&stack, &count, &cap, fenn_unwrap_tuple(t[i]));
+                    pushed = 1;
+                }
+                if (pushed || !ok)
+                    continue;
+            }
+            for (i = 0; i < len; i++) {
+                switch (fenn_type(t[i])) {
+                    case FENN_ARRAY:
+                    case FENN_TABLE:
+                    case FENN_BUFFER:
+                        depends = 1;
+                        break;
+                    case FENN_TUPLE:
+                        if (*fenn_image_tuplemark(fenn_unwrap_tuple(t[i])) & FENN_IMAGE_MOVED)
+                            depends = 1;
+                        break;
+                    default:
+                        break;
+                }
+            }
+            if (depends) {
+                *mark |= FENN_IMAGE_MOVED;
+                fenn_image_pushtuple(moved, nmoved, &movedcap, t);
+            } else if (0 == fenn_tuple_hash(t) || fenn_tuple_hash(t) != fenn_array_calchash(t, len)) {
+                ok = 0;
+            }
+            *mark |= FENN_IMAGE_DONE;
+            count--;
+        }
+    }
+    free(stack);
+    return ok;
+}
+
+/* Point a slot at the heap object that replaced an image object */
+static void fenn_image_forward(FennObject *slot) {
+    FennGCObject *obj;
+    if (!fenn_image_haspointer(*slot))
+        return;
+    obj = fenn_gc_object(*slot);
+    if (obj->flags & FENN_MEM_FORWARDED) {
+        char *ptr = fenn_to_pointer(*slot);
+        *slot = fenn_from_pointer((char *) obj->next + (ptr - (char *) obj), slot->u64 & FENN_TAGBITS);
+    }
+}
+
+/* Call visit on every value stored in an image object */
+static void fenn_image_visit(FennGCObject *obj, FennGCVisitor visit) {
+    FennMemoryType type = fenn_gc_type(obj);
+    if (type == FENN_MEMORY_ARRAY || type == FENN_MEMORY_TABLE) {
+        FennImageStub *stub = (FennImageStub *) obj;
+        int32_t i, n = type == FENN_MEMORY_TABLE ? 2 * stub->count : stub->count;
+        for (i = 0; i < n; i++)
+            visit(stub->data + i);
+    } else if (type != FENN_MEMORY_BUFFER) {
+        fenn_gc_visit(obj, visit);
+    }
+}
+
+/* Keep a heap object the image refers to alive */
+static void fenn_image_keep(FennImage *image, FennObject x) {
+    if (image->count == image->capacity) {
+        size_t newcap = image->capacity ? 2 * image->capacity : 16;
+        FennObject *next = realloc(image->values, newcap * sizeof(FennObject));
+        if (NULL == next) {
+            // TODO: Handle Out Of Memory
+        }
+        image->values = next;
+        image->capacity = newcap;
+    }
+    image->values[image->count++] = x;
+}
+
+/* Make the heap object that takes the place of an image stub. It is made
+ * old straight away, since the image that points to it is never scanned
+ * by minor collections. */
+static FennObject fenn_image_rebuild(FennImageStub *stub) {
+    switch (fenn_gc_type(&stub->gc)) {
+        case FENN_MEMORY_ARRAY: {
+            FennArray *array = fenn_array(stub->count);
+            return fenn_wrap_array(fenn_gc_tenure(&array->gc));
+        }
+        case FENN_MEMORY_TABLE: {
+            FennTable *t = fenn_table(stub->count);
+            return fenn_wrap_table(fenn_gc_tenure(&t->gc));
+        }
+        default: {
+            FennBuffer *buffer = fenn_buffer(stub->count);
+            return fenn_wrap_buffer(fenn_gc_tenure(&buffer->gc));
+        }
+    }
+}
+
+/* Fill the heap object that replaced a stub, once the stub holds pointers */
+static void fenn_image_fill(FennImageStub *stub) {
+    FennGCObject *obj = stub->gc.next;
+    int32_t i;
+    switch (fenn_gc_type(obj)) {
+        case FENN_MEMORY_ARRAY:
+            fenn_array_push_n((FennArray *) obj, stub->data, stub->count);
+            break;
+        case FENN_MEMORY_TABLE:
+            for (i = 0; i < stub->count; i++)
+                fenn_table_put((FennTable *) obj, stub->data[2 * i], stub->data[2 * i + 1]);
+            break;
+        default:
+            fenn_buffer_push_bytes((FennBuffer *) obj, (const uint8_t *) stub->data, stub->count);
+            break;
+    }
+}
+
+/* Map the file of an image, writable until it has been loaded. Changes
+ * are private to this process. */
+static const char *fenn_image_map(FennImage *image, const char *path) {
+#ifndef _WIN32
+    struct stat st;
+    void *base;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return "could not open image file";
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(FennImageHeader)) {
+        close(fd);
+        return "not a heap image";
+    }
+    base = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == base)
+        return "could not map image file";
+    image->base = base;
+    image->size = (size_t) st.st_size;
+    return NULL;
+#else
+    FILE *f = fopen(path, "rb");
+    long len;
+    if (NULL == f)
+        return "could not open image file";
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (len < (long) sizeof(FennImageHeader)) {
+        fclose(f);
+        return "not a heap image";
+    }
+    image->base = malloc((size_t) len);
+    if (NULL == image->base) {
+        // TODO: Handle Out Of Memory
+    }
+    image->size = (size_t) len;
+    if (fread(image->base, 1, image->size, f) != image->size) {
+        free(image->base);
+        fclose(f);
+        return "could not read image file";
+    }
+    fclose(f);
+    return NULL;
+#endif
+}
+
+static void fenn_image_unmap(FennImage *image) {
+#ifndef _WIN32
+    munmap(image->base, image->size);
+#else
+    free(image->base);
+#endif
+}
+
+/* Check if no value made on this thread can depend on the hash seed. The
+ * seed is shared by all threads, fenn_hash_setseed checks the others. */
+static int fenn_image_fresh(void) {
+    size_t i;
+    if (NULL != fenn_images)
+        return 0;
+    for (i = 0; i < FENN_MEMORY_TYPES; i++)
+        if (fenn_gc.stats[i].allocations)
+            return 0;
+    return 1;
+}
+
+/* Load an image written by fenn_image_write and store the value it was
+ * written from in *root. Returns NULL on success or an error message. */
+const char *fenn_image_load(const char *path, FennObject *root) {
+    FennImage *image = calloc(1, sizeof(FennImage));
+    FennImageHeader *header;
+    const char *error;
+    char *p, *end;
+    uint8_t *starts;
+    const FennObject **moved = NULL;
+    size_t i, nmoved = 0;
+    uint64_t objects = 0;
+    size_t size;
+    int forwarded = 0;
+    if (NULL == image) {
+        // TODO: Handle Out Of Memory
+    }
+    error = fenn_image_map(image, path);
+    if (NULL != error) {
+        free(image);
+        return error;
+    }
+    header = (FennImageHeader *) image->base;
+    end = image->base + image->size;
+    if (header->magic != FENN_IMAGE_MAGIC || header->version != FENN_IMAGE_VERSION
+        || header->start != fenn_image_round(sizeof(FennImageHeader))) {
+        error = "not a heap image";
+        goto fail;
+    }
+    if (header->size != image->size) {
+        error = "heap image is truncated";
+        goto fail;
+    }
+    if (header->seed != fenn_hash_getseed()) {
+        if (!fenn_image_fresh() || !fenn_hash_setseed(header->seed)) {
+            error = "heap image was written with another hash seed";
+            goto fail;
+        }
+    }
+
+    // Find where every object starts and what it is, then turn offsets
+    // into pointers, checking that each one points at an object of its
+    // type. Nothing outside of the image is touched before it is known to
+    // be good.
+    starts = calloc(image->size / FENN_IMAGE_ALIGN + 1, 1);
+    if (NULL == starts) {
+        // TODO: Handle Out Of Memory
+    }
+    fenn_image_corrupt = 0;
+    for (p = image->base + header->start; p < end; p += size) {
+        size = fenn_image_storedsize((FennGCObject *) p, (size_t) (end - p));
+        if (0 == size) {
+            fenn_image_corrupt = 1;
+            break;
+        }
+        starts[(p - image->base) / FENN_IMAGE_ALIGN] = (uint8_t) (fenn_gc_type((FennGCObject *) p) + 1);
+        objects++;
+    }
+    if (!fenn_image_corrupt && objects == header->objects) {
+        fenn_image_loading = image;
+        fenn_image_starts = starts;
+        for (p = image->base + header->start; p < end; p += size) {
+            size = fenn_image_storedsize((FennGCObject *) p, (size_t) (end - p));
+            fenn_image_visit((FennGCObject *) p, fenn_image_pointer);
+        }
+        fenn_image_pointer(&header->root);
+        if (!fenn_image_corrupt && !fenn_image_checkhashes(image->base + header->start, end, &moved, &nmoved))
+            fenn_image_corrupt = 1;
+        fenn_image_loading = NULL;
+        fenn_image_starts = NULL;
+    }
+    free(starts);
+    if (fenn_image_corrupt || objects != header->objects) {
+        free(moved);
+        error = "heap image is corrupt";
+        goto fail;
+    }
+
+    // Intern symbols and rebuild mutable objects on the heap, forwarding
+    // the image objects they replace
+    fenn_gc_addrootset(&image->values, &image->count, NULL);
+    for (p = image->base + header->start; p < end; p += size) {
+        FennGCObject *obj = (FennGCObject *) p;
+        FennMemoryType type = fenn_gc_type(obj);
+        size = fenn_image_storedsize(obj, (size_t) (end - p));
+        if (type == FENN_MEMORY_SYMBOL) {
+            const uint8_t *sym = ((FennStringHead *) obj)->data;
+            const uint8_t *interned = fenn_symbol_adopt(sym);
+            if (interned != sym) {
+                obj->flags |= FENN_MEM_FORWARDED;
+                obj->next = &fenn_string_head(interned)->gc;
+                fenn_image_keep(image, fenn_wrap_symbol(interned));
+                forwarded = 1;
+            }
+        } else if (fenn_image_isstub(type)) {
+            FennObject x = fenn_image_rebuild((FennImageStub *) obj);
+            obj->flags |= FENN_MEM_FORWARDED;
+            obj->next = fenn_gc_object(x);
+            fenn_image_keep(image, x);
+            forwarded = 1;
+        }
+    }
+    if (forwarded) {
+        for (p = image->base + header->start; p < end; p += size) {
+            FennGCObject *obj = (FennGCObject *) p;
+            size = fenn_image_storedsize(obj, (size_t) (end - p));
+            fenn_image_visit(obj, fenn_image_forward);
+            if (fenn_image_isstub(fenn_gc_type(obj)))
+                fenn_image_fill((FennImageStub *) obj);
+        }
+        fenn_image_forward(&header->root);
+    }
+    for (i = 0; i < nmoved; i++)
+        fenn_tuple_hash(moved[i]) = fenn_array_calchash(moved[i], fenn_tuple_length(moved[i]));
+    free(moved);
+
+#ifndef _WIN32
+    mprotect(image->base, image->size, PROT_READ);
+#endif
+    *root = header->root;
+    image->next = fenn_images;
+    fenn_images = image;
+    return NULL;
+
+fail:
+    fenn_image_unmap(image);
+    free(image);
+    return error;
+}
+
+/* Call add with the memory of every image loaded on this thread */
+void fenn_image_spans(void (*add)(const void *, size_t)) {
+    FennImage *image;
+    for (image = fenn_images; NULL != image; image = image->next)
+        add(image->base, image->size);
+}
+
+/* Unmap every image loaded on this thread, called once its heap is gone */
+void fenn_image_deinit(void) {
+    FennImage *image;
+    while (NULL != (image = fenn_images)) {
+        fenn_images = image->next;
+        fenn_image_unmap(image);
+        free(image->values);
+        free(image);
+    }
+}
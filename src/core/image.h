@@ -0,0 +1,66 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+/* Heap images. Everything reachable from a value is written to a file as
+ * a copy of its heap objects, with pointers replaced by offsets into the
+ * file. Loading maps the file, turns the offsets back into pointers and
+ * uses the objects where they lie, so a process can start from data it
+ * would otherwise have to parse again.
+ *
+ * Mapped objects are never collected or moved. Symbols are interned on
+ * load, or redirected to the symbol already interned under that name.
+ * Arrays, tables and buffers are written as their contents and rebuilt
+ * on the heap, since they can change. Pointers and abstract values cannot
+ * be written. Images are only valid for the build that wrote them and
+ * carry the hash seed they were laid out with; a process adopts that seed
+ * when it loads its first image before allocating anything, otherwise the
+ * seeds must match. Loaded images belong to the loading thread and stay
+ * mapped until it calls fenn_deinit. */
+
+typedef struct FennImageHeader FennImageHeader;
+
+#define FENN_IMAGE_MAGIC 0x0a474d494e4e4546ull // "FENNIMG\n"
+#define FENN_IMAGE_VERSION 2
+
+/* Objects start at the first multiple of this after the header */
+#define FENN_IMAGE_ALIGN 16
+
+struct FennImageHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t start;     // Offset of the first object
+    uint64_t seed;      // Hash seed of the writer
+    uint64_t size;      // Bytes in the image, header included
+    uint64_t objects;   // Number of objects
+    FennObject root;    // With an offset in place of a pointer
+};
+
+/* Function declarations */
+FENN_API const char *fenn_image_write(const char *, FennObject);
+FENN_API const char *fenn_image_load(const char *, FennObject *);
+void fenn_image_spans(void (*)(const void *, size_t));
+void fenn_image_deinit(void);
+
+#endif
@@ -0,0 +1,83 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include "scan.h"
+#include "lineindex.h"
+
+/* Set up an index over len bytes of source */
+void fenn_lineindex_init(FennLineIndex *index, const uint8_t *bytes, size_t len) {
+    index->bytes = bytes;
+    index->len = len;
+    index->starts = NULL;
+    index->count = 0;
+    index->cap = 0;
+    index->scanned = 0;
+}
+
+void fenn_lineindex_deinit(FennLineIndex *index) {
+    free(index->starts);
+    index->starts = NULL;
+    index->count = 0;
+    index->cap = 0;
+    index->scanned = 0;
+}
+
+/* Index the next block of the source */
+static void fenn_lineindex_extend(FennLineIndex *index) {
+    size_t n = index->len - index->scanned;
+    const uint8_t *p = index->bytes + index->scanned;
+    if (n > FENN_LINEINDEX_BLOCK) n = FENN_LINEINDEX_BLOCK;
+    // Room for a block made of nothing but newlines
+    if (index->count + n > index->cap) {
+        size_t *next;
+        size_t newcap = 2 * (index->count + n);
+        next = realloc(index->starts, sizeof(size_t) * newcap);
+        if (NULL == next) {
+            // TODO: Handle Out Of Memory error
+        }
+        index->starts = next;
+        index->cap = newcap;
+    }
+    index->count += fenn_scan_linestarts(p, p + n, index->scanned, index->starts + index->count);
+    index->scanned += n;
+}
+
+/* Get the line and column of the byte at offset */
+void fenn_lineindex_where(FennLineIndex *index, size_t offset, int *line, int *col) {
+    size_t lo = 0, hi;
+    if (offset > index->len)
+        offset = index->len;
+    while (index->scanned <= offset && index->scanned < index->len)
+        fenn_lineindex_extend(index);
+    // Count the lines that start at or before offset
+    hi = index->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->starts[mid] <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *line = 1 + (int) lo;
+    *col = 1 + (int) (offset - (lo ? index->starts[lo - 1] : 0));
+}
@@ -0,0 +1,50 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef LINEINDEX_H
+#define LINEINDEX_H
+
+/* Turns byte offsets into the source, such as those in a FennSourceMap or
+ * the offset of a parse error, into line and column numbers. The offsets
+ * of line starts are found with the vector kernels from scan.c, only as
+ * far into the source as has been asked about. Lines and columns count
+ * from 1, columns are in bytes. */
+
+/* Bytes indexed at a time */
+#define FENN_LINEINDEX_BLOCK 0x1000
+
+typedef struct FennLineIndex FennLineIndex;
+
+struct FennLineIndex {
+    const uint8_t *bytes;   // The source, owned by the caller
+    size_t len;
+    size_t *starts;         // Offsets of the lines after the first, in order
+    size_t count;
+    size_t cap;
+    size_t scanned;         // Bytes of the source indexed so far
+};
+
+FENN_API void fenn_lineindex_init(FennLineIndex *, const uint8_t *, size_t);
+FENN_API void fenn_lineindex_deinit(FennLineIndex *);
+FENN_API void fenn_lineindex_where(FennLineIndex *, size_t, int *, int *);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include "gc.h"
+#include "markbits.h"
+
+/* Bitmaps are carved from page aligned chunks, so writing them never
+ * touches a page that holds objects */
+#define FENN_MARKBITS_CHUNK 0x10000
+#define FENN_MARKBITS_MINCAP 256
+
+typedef struct FennMarkRegion FennMarkRegion;
+typedef struct FennMarkChunk FennMarkChunk;
+
+struct FennMarkRegion {
+    uintptr_t base;     // Start of the region, 0 for an empty slot
+    uint64_t *bits;     // One bit per granule of the region
+    size_t words;       // Size of bits
+};
+
+struct FennMarkChunk {
+    FennMarkChunk *next;
+    size_t used;        // Words handed out
+    uint64_t words[];
+};
+
+#define FENN_MARKBITS_WORDS ((FENN_MARKBITS_CHUNK - sizeof(FennMarkChunk)) / sizeof(uint64_t))
+
+/* Regions that have bitmaps this cycle, by base address */
+static FENN_THREAD_LOCAL FennMarkRegion *fenn_markbits;
+static FENN_THREAD_LOCAL uint32_t fenn_markbits_cap;
+static FENN_THREAD_LOCAL uint32_t fenn_markbits_count;
+
+/* Regions looked up recently. Neighbouring objects in the heap list come
+ * from a handful of slabs, one per size class. */
+#define FENN_MARKBITS_RECENT 64
+#define fenn_markbits_recent(base) (((base) / FENN_SLAB_SIZE) & (FENN_MARKBITS_RECENT - 1))
+static FENN_THREAD_LOCAL FennMarkRegion fenn_markbits_last[FENN_MARKBITS_RECENT];
+
+/* Chunks in use, the current one first, and chunks left from past cycles */
+static FENN_THREAD_LOCAL FennMarkChunk *fenn_markchunks;
+static FENN_THREAD_LOCAL FennMarkChunk *fenn_markchunks_free;
+
+/* Find the region of an object. Sets the number of bitmap words the region
+ * needs and the bit of the object. */
+static uintptr_t fenn_markbits_region(FennGCObject *obj, size_t *words, size_t *bit) {
+    uintptr_t p = (uintptr_t) obj, base;
+    if (obj->flags & FENN_MEM_LARGE) {
+        *words = 1;
+        *bit = 0;
+        return p;
+    }
+    if (obj->flags & FENN_MEM_NURSERY) {
+        base = (uintptr_t) fenn_nursery_of(obj);
+        *words = FENN_NURSERY_BLOCK / FENN_NURSERY_ALIGN / 64;
+        *bit = (p - base) / FENN_NURSERY_ALIGN;
+        return base;
+    }
+    base = (uintptr_t) fenn_slab_of(obj);
+    *words = FENN_SLAB_SIZE / FENN_SLAB_GRANULE / 64;
+    *bit = (p - base) / FENN_SLAB_GRANULE;
+    return base;
+}
+
+static uint32_t fenn_markbits_index(uintptr_t base, uint32_t cap) {
+    uint64_t h = (uint64_t) (base >> 4) * 0x9E3779B97F4A7C15ull;
+    return (uint32_t) (h >> 32) & (cap - 1);
+}
+
+/* Get the bitmap of a region of words words, or NULL if nothing in it is
+ * marked. Memory freed by the sweep may come back as a region of another
+ * kind at the same address, whose old bitmap has the wrong size. */
+static uint64_t *fenn_markbits_find(uintptr_t base, size_t words) {
+    FennMarkRegion *recent = fenn_markbits_last + fenn_markbits_recent(base);
+    uint32_t i;
+    if (recent->base == base && recent->words == words)
+        return recent->bits;
+    if (0 == fenn_markbits_count)
+        return NULL;
+    for (i = fenn_markbits_index(base, fenn_markbits_cap);; i = (i + 1) & (fenn_markbits_cap - 1)) {
+        FennMarkRegion *r = fenn_markbits + i;
+        if (r->base == base) {
+            if (r->words != words)
+                return NULL;
+            *recent = *r;
+            return r->bits;
+        }
+        if (0 == r->base)
+            return NULL;
+    }
+}
+
+/* Hand out zeroed words for a bitmap */
+static uint64_t *fenn_markbits_alloc(size_t words) {
+    FennMarkChunk *chunk = fenn_markchunks;
+    uint64_t *bits;
+    if (NULL == chunk || chunk->used + words > FENN_MARKBITS_WORDS) {
+        chunk = fenn_markchunks_free;
+        if (NULL != chunk) {
+            fenn_markchunks_free = chunk->next;
+        } else {
+            void *mem = NULL;
+            if (posix_memalign(&mem, FENN_SLAB_SIZE, FENN_MARKBITS_CHUNK)) {
+                // TODO: Handle Out Of Memory
+                return NULL;
+            }
+            chunk = mem;
+        }
+        chunk->used = 0;
+        chunk->next = fenn_markchunks;
+        fenn_markchunks = chunk;
+    }
+    bits = chunk->words + chunk->used;
+    chunk->used += words;
+    memset(bits, 0, words * sizeof(uint64_t));
+    return bits;
+}
+
+/* Put a region in the table, replacing one at the same base. Returns 1 if
+ * the region is new. */
+static int fenn_markbits_insert(FennMarkRegion *table, uint32_t cap, FennMarkRegion region) {
+    uint32_t i = fenn_markbits_index(region.base, cap);
+    while (0 != table[i].base && table[i].base != region.base)
+        i = (i + 1) & (cap - 1);
+    if (0 != table[i].base) {
+        table[i] = region;
+        return 0;
+    }
+    table[i] = region;
+    return 1;
+}
+
+static void fenn_markbits_resize(uint32_t newcap) {
+    FennMarkRegion *old = fenn_markbits;
+    uint32_t oldcap = fenn_markbits_cap, i;
+    fenn_markbits = calloc(newcap, sizeof(FennMarkRegion));
+    if (NULL == fenn_markbits) {
+        // TODO: Handle Out Of Memory
+    }
+    fenn_markbits_cap = newcap;
+    for (i = 0; i < oldcap; i++)
+        if (0 != old[i].base)
+            fenn_markbits_insert(fenn_markbits, newcap, old[i]);
+    free(old);
+}
+
+/* Check if an old object has been marked in the current cycle */
+int fenn_markbits_get(FennGCObject *obj) {
+    size_t words, bit;
+    uintptr_t base = fenn_markbits_region(obj, &words, &bit);
+    uint64_t *bits = fenn_markbits_find(base, words);
+    return NULL != bits && ((bits[bit >> 6] >> (bit & 63)) & 1);
+}
+
+/* Mark an old object. Returns 1 if it was already marked */
+int fenn_markbits_set(FennGCObject *obj) {
+    size_t words, bit;
+    uintptr_t base = fenn_markbits_region(obj, &words, &bit);
+    uint64_t *bits = fenn_markbits_find(base, words);
+    uint64_t mask = (uint64_t) 1 << (bit & 63);
+    if (NULL == bits) {
+        FennMarkRegion region;
+        // Keep the load factor under one half
+        if (2 * (fenn_markbits_count + 1) > fenn_markbits_cap)
+            fenn_markbits_resize(fenn_markbits_cap ? 2 * fenn_markbits_cap : FENN_MARKBITS_MINCAP);
+        region.base = base;
+        region.bits = bits = fenn_markbits_alloc(words);
+        region.words = words;
+        fenn_markbits_count += fenn_markbits_insert(fenn_markbits, fenn_markbits_cap, region);
+        fenn_markbits_last[fenn_markbits_recent(base)] = region;
+    }
+    if (bits[bit >> 6] & mask)
+        return 1;
+    bits[bit >> 6] |= mask;
+    return 0;
+}
+
+/* Drop every mark, at the end of a cycle */
+void fenn_markbits_clear(void) {
+    FennMarkChunk *chunk;
+    if (fenn_markbits_count)
+        memset(fenn_markbits, 0, fenn_markbits_cap * sizeof(FennMarkRegion));
+    fenn_markbits_count = 0;
+    memset(fenn_markbits_last, 0, sizeof(fenn_markbits_last));
+    while (NULL != (chunk = fenn_markchunks)) {
+        fenn_markchunks = chunk->next;
+        chunk->next = fenn_markchunks_free;
+        fenn_markchunks_free = chunk;
+    }
+}
+
+/* Free the bitmaps and the table of the current thread */
+void fenn_markbits_deinit(void) {
+    FennMarkChunk *chunk;
+    fenn_markbits_clear();
+    while (NULL != (chunk = fenn_markchunks_free)) {
+        fenn_markchunks_free = chunk->next;
+        free(chunk);
+    }
+    free(fenn_markbits);
+    fenn_markbits = NULL;
+    fenn_markbits_cap = 0;
+}
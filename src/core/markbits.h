@@ -0,0 +1,38 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef MARKBITS_H
+#define MARKBITS_H
+
+/* Mark bits of old objects, kept in bitmaps outside of the heap rather than
+ * in the objects themselves. A collection then only reads the pages that
+ * hold live objects, so a forked process that collects keeps sharing them
+ * with its parent. There is one bitmap per heap region: a slab, a nursery
+ * block promoted in place, or a single large object. Bitmaps only exist
+ * while a cycle is running and are dropped together when it ends. */
+
+int fenn_markbits_get(FennGCObject *);
+int fenn_markbits_set(FennGCObject *);
+void fenn_markbits_clear(void);
+void fenn_markbits_deinit(void);
+
+#endif
@@ -0,0 +1,485 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include <math.h>
+#include "gc.h"
+#include "symcache.h"
+#include "util.h"
+#include "objects/fabstract.h"
+#include "objects/farray.h"
+#include "objects/fbtree.h"
+#include "objects/fbuffer.h"
+#include "objects/fstring.h"
+#include "objects/fstruct.h"
+#include "objects/ftable.h"
+#include "objects/ftuple.h"
+#include "marshal.h"
+
+/* Tag bytes. Bytes below FENN_MARSHAL_NIL are small integers that stand
+ * for themselves. */
+enum {
+    FENN_MARSHAL_NIL = 0x80,
+    FENN_MARSHAL_FALSE,
+    FENN_MARSHAL_TRUE,
+    FENN_MARSHAL_INTEGER,   // Zigzag varint
+    FENN_MARSHAL_NUMBER,    // 8 bytes of a double, little endian
+    FENN_MARSHAL_STRING,    // Length and bytes
+    FENN_MARSHAL_SYMBOL,    // Length and bytes of a new name
+    FENN_MARSHAL_KEYWORD,
+    FENN_MARSHAL_SYMBOLREF, // Number of a name
+    FENN_MARSHAL_KEYWORDREF,
+    FENN_MARSHAL_BUFFER,    // Length and bytes
+    FENN_MARSHAL_TUPLE,     // Length and values
+    FENN_MARSHAL_ARRAY,
+    FENN_MARSHAL_STRUCT,    // Number of pairs and pairs
+    FENN_MARSHAL_TABLE,
+    FENN_MARSHAL_BTREE,
+    FENN_MARSHAL_REF        // Number of a value
+};
+
+/* Start a context writing values to a buffer */
+void fenn_marshal_init(FennMarshal *m, FennBuffer *buffer) {
+    m->buffer = buffer;
+    m->refs = fenn_table(0);
+    m->syms = fenn_table(0);
+    m->nrefs = 0;
+    m->nsyms = 0;
+    m->depth = 0;
+    fenn_gcroot(fenn_wrap_table(m->refs));
+    fenn_gcroot(fenn_wrap_table(m->syms));
+}
+
+void fenn_marshal_deinit(FennMarshal *m) {
+    fenn_gcunroot(fenn_wrap_table(m->refs));
+    fenn_gcunroot(fenn_wrap_table(m->syms));
+}
+
+static void fenn_marshal_bytes(FennBuffer *buffer, uint8_t tag, const uint8_t *bytes, int64_t len) {
+    fenn_buffer_push_u8(buffer, tag);
+    fenn_buffer_push_varint(buffer, (uint64_t) len);
+    if (len > 0)
+        fenn_buffer_push_bytes(buffer, bytes, len);
+}
+
+static void fenn_marshal_number(FennBuffer *buffer, double d) {
+    // Integers a double holds exactly, but not -0, are written as varints
+    if (d >= -9007199254740992.0 && d <= 9007199254740992.0 &&
+        d == (double) (int64_t) d && !(d == 0 && signbit(d))) {
+        int64_t i = (int64_t) d;
+        if (i >= 0 && i < FENN_MARSHAL_NIL) {
+            fenn_buffer_push_u8(buffer, (uint8_t) i);
+        } else {
+            fenn_buffer_push_u8(buffer, FENN_MARSHAL_INTEGER);
+            fenn_buffer_push_zigzag(buffer, i);
+        }
+        return;
+    }
+    fenn_buffer_push_u8(buffer, FENN_MARSHAL_NUMBER);
+    fenn_buffer_push_u64(buffer, fenn_u64(fenn_wrap_number(d)));
+}
+
+/* Give a value the next number, so it can be referred to */
+static void fenn_marshal_addref(FennMarshal *m, FennObject x) {
+    fenn_table_put(m->refs, x, fenn_wrap_number(m->nrefs++));
+}
+
+static const char *fenn_marshal_one(FennMarshal *m, FennObject x) {
+    FennBuffer *buffer = m->buffer;
+    FennObject ref;
+    FennKV kv;
+    const char *err;
+    int32_t i;
+    switch (fenn_type(x)) {
+        case FENN_NIL:
+            fenn_buffer_push_u8(buffer, FENN_MARSHAL_NIL);
+            return NULL;
+        case FENN_BOOL:
+            fenn_buffer_push_u8(buffer, fenn_unwrap_boolean(x) ? FENN_MARSHAL_TRUE : FENN_MARSHAL_FALSE);
+            return NULL;
+        case FENN_NUMBER:
+            fenn_marshal_number(buffer, fenn_unwrap_number(x));
+            return NULL;
+        case FENN_SYMBOL:
+        case FENN_KEYWORD: {
+            // Symbols and keywords with the same name share it
+            const uint8_t *sym = fenn_unwrap_symbol(x);
+            int keyword = fenn_checktype(x, FENN_KEYWORD);
+            ref = fenn_table_get(m->syms, fenn_wrap_symbol(sym));
+            if (!fenn_checktype(ref, FENN_NIL)) {
+                fenn_buffer_push_u8(buffer, keyword ? FENN_MARSHAL_KEYWORDREF : FENN_MARSHAL_SYMBOLREF);
+                fenn_buffer_push_varint(buffer, (uint64_t) fenn_unwrap_number(ref));
+                return NULL;
+            }
+            fenn_table_put(m->syms, fenn_wrap_symbol(sym), fenn_wrap_number(m->nsyms++));
+            fenn_marshal_bytes(buffer, keyword ? FENN_MARSHAL_KEYWORD : FENN_MARSHAL_SYMBOL,
+                               sym, fenn_string_length(sym));
+            return NULL;
+        }
+        default:
+            break;
+    }
+    ref = fenn_table_get(m->refs, x);
+    if (!fenn_checktype(ref, FENN_NIL)) {
+        fenn_buffer_push_u8(buffer, FENN_MARSHAL_REF);
+        fenn_buffer_push_varint(buffer, (uint64_t) fenn_unwrap_number(ref));
+        return NULL;
+    }
+    if (++m->depth > FENN_MARSHAL_MAXDEPTH)
+        return "value too deeply nested to marshal";
+    // Mutable values are numbered before what they hold, so they can hold
+    // themselves. Immutable values are numbered once they are complete, as
+    // they are read back.
+    switch (fenn_type(x)) {
+        case FENN_STRING: {
+            const uint8_t *str = fenn_unwrap_string(x);
+            fenn_marshal_bytes(buffer, FENN_MARSHAL_STRING, str, fenn_string_length(str));
+            fenn_marshal_addref(m, x);
+            break;
+        }
+        case FENN_BUFFER: {
+            FennBuffer *b = fenn_unwrap_buffer(x);
+            fenn_marshal_addref(m, x);
+            fenn_marshal_bytes(buffer, FENN_MARSHAL_BUFFER, b->data, b->count);
+            break;
+        }
+        case FENN_TUPLE: {
+            const FennObject *tuple = fenn_unwrap_tuple(x);
+            fenn_buffer_push_u8(buffer, FENN_MARSHAL_TUPLE);
+            fenn_buffer_push_varint(buffer, (uint64_t) fenn_tuple_length(tuple));
+            for (i = 0; i < fenn_tuple_length(tuple); i++) {
+                if (NULL != (err = fenn_marshal_one(m, tuple[i])))
+                    return err;
+            }
+            fenn_marshal_addref(m, x);
+            break;
+        }
+        case FENN_ARRAY: {
+            FennArray *array = fenn_unwrap_array(x);
+            fenn_marshal_addref(m, x);
+            fenn_buffer_push_u8(buffer, FENN_MARSHAL_ARRAY);
+            fenn_buffer_push_varint(buffer, (uint64_t) array->count);
+            for (i = 0; i < array->count; i++) {
+                if (NULL != (err = fenn_marshal_one(m, array->data[i])))
+                    return err;
+            }
+            break;
+        }
+        case FENN_STRUCT: {
+            const FennKV *st = fenn_unwrap_struct(x);
+            fenn_buffer_push_u8(buffer, FENN_MARSHAL_STRUCT);
+            fenn_buffer_push_varint(buffer, (uint64_t) fenn_struct_length(st));
+            i = 0;
+            while (0 != (i = fenn_struct_next(st, i, &kv))) {
+                if (NULL != (err = fenn_marshal_one(m, kv.key)) ||
+                    NULL != (err = fenn_marshal_one(m, kv.value)))
+                    return err;
+            }
+            fenn_marshal_addref(m, x);
+            break;
+        }
+        case FENN_TABLE: {
+            FennTable *t = fenn_unwrap_table(x);
+            fenn_marshal_addref(m, x);
+            fenn_buffer_push_u8(buffer, FENN_MARSHAL_TABLE);
+            fenn_buffer_push_varint(buffer, (uint64_t) t->count);
+            i = 0;
+            while (0 != (i = fenn_table_next(t, i, &kv))) {
+                if (NULL != (err = fenn_marshal_one(m, kv.key)) ||
+                    NULL != (err = fenn_marshal_one(m, kv.value)))
+                    return err;
+            }
+            break;
+        }
+        case FENN_ABSTRACT: {
+            FennBTree *t = fenn_unwrap_abstract(x);
+            FennBTreeCursor cursor;
+            if (!fenn_checkabstract(x, &fenn_btree_type))
+                return "cannot marshal abstract value";
+            fenn_marshal_addref(m, x);
+            fenn_buffer_push_u8(buffer, FENN_MARSHAL_BTREE);
+            fenn_buffer_push_varint(buffer, (uint64_t) t->count);
+            fenn_btree_start(t, &cursor);
+            while (fenn_btree_next(&cursor, &kv)) {
+                if (NULL != (err = fenn_marshal_one(m, kv.key)) ||
+                    NULL != (err = fenn_marshal_one(m, kv.value)))
+                    return err;
+            }
+            break;
+        }
+        default:
+            return "cannot marshal value";
+    }
+    m->depth--;
+    return NULL;
+}
+
+/* Write a value. Returns NULL, or an error message if the value holds
+ * something that cannot be marshaled. After an error the buffer is left
+ * as it was, but the context must not be used for more values. */
+const char *fenn_marshal_value(FennMarshal *m, FennObject x) {
+    int64_t count = m->buffer->count;
+    const char *err;
+    m->depth = 0;
+    err = fenn_marshal_one(m, x);
+    if (NULL != err)
+        fenn_buffer_setcount(m->buffer, count);
+    return err;
+}
+
+/* Write a single value with a context of its own */
+const char *fenn_marshal(FennBuffer *buffer, FennObject x) {
+    FennMarshal m;
+    const char *err;
+    fenn_marshal_init(&m, buffer);
+    err = fenn_marshal_value(&m, x);
+    fenn_marshal_deinit(&m);
+    return err;
+}
+
+/* Start a context reading values from bytes. Values are built straight
+ * from the bytes, which must stay unchanged while the context reads
+ * them. */
+void fenn_unmarshal_init(FennUnmarshal *u, const uint8_t *bytes, size_t len) {
+    u->in.data = bytes;
+    u->in.end = bytes + len;
+    u->refs = fenn_array(0);
+    u->syms = fenn_array(0);
+    u->depth = 0;
+    fenn_gcroot(fenn_wrap_array(u->refs));
+    fenn_gcroot(fenn_wrap_array(u->syms));
+}
+
+void fenn_unmarshal_deinit(FennUnmarshal *u) {
+    fenn_gcunroot(fenn_wrap_array(u->refs));
+    fenn_gcunroot(fenn_wrap_array(u->syms));
+}
+
+/* Read the length of something whose items take at least size bytes each,
+ * which must fit in the bytes left */
+static int fenn_unmarshal_length(FennUnmarshal *u, size_t size, int32_t *len) {
+    uint64_t x;
+    if (!fenn_buffer_read_varint(&u->in, &x) || x > INT32_MAX || x * size > (uint64_t) (u->in.end - u->in.data))
+        return 0;
+    *len = (int32_t) x;
+    return 1;
+}
+
+/* Read the number of a value or name read before */
+static int fenn_unmarshal_ref(FennUnmarshal *u, FennArray *refs, FennObject *out) {
+    uint64_t x;
+    if (!fenn_buffer_read_varint(&u->in, &x) || x >= (uint64_t) refs->count)
+        return 0;
+    *out = refs->data[x];
+    return 1;
+}
+
+static const char *fenn_unmarshal_one(FennUnmarshal *u, FennObject *out) {
+    const char *err = NULL;
+    FennObject key, value;
+    uint64_t x;
+    int32_t i, len;
+    uint8_t tag;
+    if (u->in.data >= u->in.end)
+        return "unexpected end of marshaled data";
+    tag = *u->in.data++;
+    if (tag < FENN_MARSHAL_NIL) {
+        *out = fenn_wrap_number(tag);
+        return NULL;
+    }
+    if (++u->depth > FENN_MARSHAL_MAXDEPTH)
+        return "marshaled value too deeply nested";
+    switch (tag) {
+        case FENN_MARSHAL_NIL:
+            *out = fenn_wrap_nil();
+            break;
+        case FENN_MARSHAL_FALSE:
+            *out = fenn_wrap_false();
+            break;
+        case FENN_MARSHAL_TRUE:
+            *out = fenn_wrap_true();
+            break;
+        case FENN_MARSHAL_INTEGER: {
+            int64_t n;
+            if (!fenn_buffer_read_zigzag(&u->in, &n))
+                return "bad marshaled integer";
+            *out = fenn_wrap_number((double) n);
+            break;
+        }
+        case FENN_MARSHAL_NUMBER: {
+            double d;
+            if (!fenn_buffer_read_u64(&u->in, &x))
+                return "unexpected end of marshaled data";
+            memcpy(&d, &x, sizeof(d));
+            *out = fenn_wrap_number(d);
+            break;
+        }
+        case FENN_MARSHAL_STRING:
+            if (!fenn_unmarshal_length(u, 1, &len))
+                return "bad marshaled string";
+            *out = fenn_wrap_string(fenn_string(u->in.data, len));
+            u->in.data += len;
+            fenn_array_push(u->refs, *out);
+            break;
+        case FENN_MARSHAL_SYMBOL:
+        case FENN_MARSHAL_KEYWORD: {
+            const uint8_t *sym;
+            if (!fenn_unmarshal_length(u, 1, &len))
+                return "bad marshaled symbol";
+            sym = fenn_symbol(u->in.data, len);
+            u->in.data += len;
+            fenn_array_push(u->syms, fenn_wrap_symbol(sym));
+            *out = tag == FENN_MARSHAL_KEYWORD ? fenn_wrap_keyword(sym) : fenn_wrap_symbol(sym);
+            break;
+        }
+        case FENN_MARSHAL_SYMBOLREF:
+        case FENN_MARSHAL_KEYWORDREF:
+            if (!fenn_unmarshal_ref(u, u->syms, out))
+                return "bad marshaled symbol reference";
+            if (tag == FENN_MARSHAL_KEYWORDREF)
+                *out = fenn_wrap_keyword(fenn_unwrap_symbol(*out));
+            break;
+        case FENN_MARSHAL_BUFFER: {
+            FennBuffer *b;
+            const uint8_t *bytes;
+            // Buffers may be longer than the other values
+            if (!fenn_buffer_read_varint(&u->in, &x) || x > INT64_MAX ||
+                !fenn_buffer_read_bytes(&u->in, &bytes, (int64_t) x))
+                return "bad marshaled buffer";
+            b = fenn_buffer((int64_t) x);
+            if (x > 0)
+                memcpy(b->data, bytes, x);
+            b->count = (int64_t) x;
+            *out = fenn_wrap_buffer(b);
+            fenn_array_push(u->refs, *out);
+            break;
+        }
+        case FENN_MARSHAL_TUPLE: {
+            FennObject *tuple;
+            if (!fenn_unmarshal_length(u, 1, &len))
+                return "bad marshaled tuple";
+            tuple = fenn_tuple_begin(len);
+            for (i = 0; i < len; i++) {
+                if (NULL != (err = fenn_unmarshal_one(u, tuple + i))) {
+                    // Leave nothing uninitialized for the collector
+                    for (; i < len; i++)
+                        tuple[i] = fenn_wrap_nil();
+                    return err;
+                }
+            }
+            *out = fenn_wrap_tuple(fenn_tuple_end(tuple));
+            fenn_array_push(u->refs, *out);
+            break;
+        }
+        case FENN_MARSHAL_ARRAY: {
+            FennArray *array;
+            if (!fenn_unmarshal_length(u, 1, &len))
+                return "bad marshaled array";
+            array = fenn_array(len);
+            *out = fenn_wrap_array(array);
+            fenn_array_push(u->refs, *out);
+            for (i = 0; i < len; i++) {
+                if (NULL != (err = fenn_unmarshal_one(u, &value)))
+                    return err;
+                fenn_array_push(array, value);
+            }
+            break;
+        }
+        case FENN_MARSHAL_STRUCT: {
+            FennKV *st;
+            if (!fenn_unmarshal_length(u, 2, &len))
+                return "bad marshaled struct";
+            st = fenn_struct_begin(len);
+            for (i = 0; i < len; i++) {
+                if (NULL != (err = fenn_unmarshal_one(u, &key)) ||
+                    NULL != (err = fenn_unmarshal_one(u, &value))) {
+                    // Finish it anyway to give back the scratch area
+                    fenn_struct_end(st);
+                    return err;
+                }
+                fenn_struct_put(st, key, value);
+            }
+            *out = fenn_wrap_struct(fenn_struct_end(st));
+            fenn_array_push(u->refs, *out);
+            break;
+        }
+        case FENN_MARSHAL_TABLE: {
+            FennTable *t;
+            if (!fenn_unmarshal_length(u, 2, &len))
+                return "bad marshaled table";
+            t = fenn_table(len);
+            *out = fenn_wrap_table(t);
+            fenn_array_push(u->refs, *out);
+            for (i = 0; i < len; i++) {
+                if (NULL != (err = fenn_unmarshal_one(u, &key)) ||
+                    NULL != (err = fenn_unmarshal_one(u, &value)))
+                    return err;
+                fenn_table_put(t, key, value);
+            }
+            break;
+        }
+        case FENN_MARSHAL_BTREE: {
+            FennBTree *t;
+            if (!fenn_unmarshal_length(u, 2, &len))
+                return "bad marshaled btree";
+            t = fenn_btree();
+            *out = fenn_wrap_abstract(t);
+            fenn_array_push(u->refs, *out);
+            for (i = 0; i < len; i++) {
+                if (NULL != (err = fenn_unmarshal_one(u, &key)) ||
+                    NULL != (err = fenn_unmarshal_one(u, &value)))
+                    return err;
+                fenn_btree_put(t, key, value);
+            }
+            break;
+        }
+        case FENN_MARSHAL_REF:
+            if (!fenn_unmarshal_ref(u, u->refs, out))
+                return "bad marshaled reference";
+            break;
+        default:
+            return "bad marshaled tag";
+    }
+    u->depth--;
+    return NULL;
+}
+
+/* Read the next value. Returns NULL, or an error message if the bytes are
+ * not a marshaled value, after which the context must not be used for
+ * more values. */
+const char *fenn_unmarshal_value(FennUnmarshal *u, FennObject *out) {
+    u->depth = 0;
+    *out = fenn_wrap_nil();
+    return fenn_unmarshal_one(u, out);
+}
+
+/* Read bytes holding a single marshaled value */
+const char *fenn_unmarshal(const uint8_t *bytes, size_t len, FennObject *out) {
+    FennUnmarshal u;
+    const char *err;
+    fenn_unmarshal_init(&u, bytes, len);
+    err = fenn_unmarshal_value(&u, out);
+    if (NULL == err && u.in.data != u.in.end)
+        err = "bytes left after marshaled value";
+    fenn_unmarshal_deinit(&u);
+    return err;
+}
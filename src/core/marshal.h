@@ -0,0 +1,71 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef MARSHAL_H
+#define MARSHAL_H
+
+/* Binary format for values, to move them between processes without
+ * printing and parsing them. Every value starts with a tag byte, and
+ * lengths and integers are varints. Names of symbols and keywords are
+ * written once and referred to by number after that, and so are strings,
+ * tuples, structs and mutable values, so shared parts of a value are only
+ * written once. Mutable values keep their identity and may contain
+ * themselves.
+ *
+ * A marshal context keeps its tables across values, so a stream of values
+ * pays for each name once, and must be read back with a single unmarshal
+ * context in the same order. Values must not be collected while the
+ * context that wrote them is in use. */
+
+typedef struct FennMarshal FennMarshal;
+typedef struct FennUnmarshal FennUnmarshal;
+
+/* Values nested deeper than this are not marshaled */
+#define FENN_MARSHAL_MAXDEPTH 1024
+
+struct FennMarshal {
+    FennBuffer *buffer;
+    FennTable *refs; // Values already written, to their number
+    FennTable *syms; // Names already written, to their number
+    int32_t nrefs;
+    int32_t nsyms;
+    int32_t depth;
+};
+
+struct FennUnmarshal {
+    FennBufferReader in;
+    FennArray *refs;     // Values read so far, by number
+    FennArray *syms;     // Names read so far, by number
+    int32_t depth;
+};
+
+/* Function declarations */
+FENN_API void fenn_marshal_init(FennMarshal *, FennBuffer *);
+FENN_API void fenn_marshal_deinit(FennMarshal *);
+FENN_API const char *fenn_marshal_value(FennMarshal *, FennObject);
+FENN_API const char *fenn_marshal(FennBuffer *, FennObject);
+FENN_API void fenn_unmarshal_init(FennUnmarshal *, const uint8_t *, size_t);
+FENN_API void fenn_unmarshal_deinit(FennUnmarshal *);
+FENN_API const char *fenn_unmarshal_value(FennUnmarshal *, FennObject *);
+FENN_API const char *fenn_unmarshal(const uint8_t *, size_t, FennObject *);
+
+#endif
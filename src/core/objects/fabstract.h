@@ -0,0 +1,54 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef ABSTRACT_H
+#define ABSTRACT_H
+
+typedef struct FennAbstractType FennAbstractType;
+typedef struct FennAbstractHead FennAbstractHead;
+
+/* Describes a kind of abstract value, data the core does not know the
+ * layout of. Values the data refers to must be visited by gcvisit, which
+ * returns how many it visited. Abstract values are never allocated in the
+ * nursery, so storing a value in one needs the write barrier. */
+struct FennAbstractType {
+    const char *name;
+    void (*gc)(void *data, size_t size);
+    size_t (*gcvisit)(void *data, size_t size, FennGCVisitor visit);
+};
+
+struct FennAbstractHead {
+    FennGCObject gc;
+    const FennAbstractType *type;
+    size_t size;
+    long long data[];
+};
+
+#define fenn_abstract_head(a) ((FennAbstractHead *)((char *)a - offsetof(FennAbstractHead, data)))
+#define fenn_abstract_type(a) (fenn_abstract_head(a)->type)
+#define fenn_abstract_size(a) (fenn_abstract_head(a)->size)
+
+/* Function declarations */
+FENN_API void *fenn_abstract(const FennAbstractType *, size_t);
+FENN_API int fenn_checkabstract(FennObject, const FennAbstractType *);
+
+#endif
@@ -0,0 +1,220 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include "farray.h"
+
+#include "gc.h"
+#include "util.h"
+
+/* Bulk operations store many values at once, so they use the backward
+ * barrier once rather than the write barrier for every value */
+
+/* Initialize an array */
+FennArray *fenn_array_init(FennArray *array, int32_t capacity) {
+    FennObject *data = NULL;
+    if (capacity > 0) {
+        data = malloc(sizeof(FennObject) * capacity);
+        if (NULL == data) {
+            // TODO: Handle Out Of Memory
+        }
+    }
+    array->count = 0;
+    array->capacity = capacity;
+    array->data = data;
+    return array;
+}
+
+/* Deinitialize an array (free data memory) */
+void fenn_array_deinit(FennArray *array) {
+    free(array->data);
+}
+
+/* Create a new array */
+FennArray *fenn_array(int32_t capacity) {
+    FennArray *array = fenn_gcalloc(FENN_MEMORY_ARRAY, sizeof(FennArray));
+    return fenn_array_init(array, capacity);
+}
+
+/* Create a new array with n values */
+FennArray *fenn_array_n(const FennObject *values, int32_t n) {
+    FennArray *array = fenn_array(n);
+    if (n > 0) {
+        memcpy(array->data, values, sizeof(FennObject) * n);
+        array->count = n;
+        fenn_gc_barrierback(&array->gc);
+    }
+    return array;
+}
+
+/* Ensure that the array has enough internal capacity */
+void fenn_array_ensure(FennArray *array, int32_t capacity, int32_t growth) {
+    FennObject *new_data;
+    int64_t big_capacity;
+    if (capacity <= array->capacity) return;
+    big_capacity = (int64_t) capacity * growth;
+    capacity = big_capacity > INT32_MAX ? INT32_MAX : (int32_t) big_capacity;
+    new_data = realloc(array->data, capacity * sizeof(FennObject));
+    if (NULL == new_data) {
+        // TODO: Handle Out Of Memory
+    }
+    array->data = new_data;
+    array->capacity = capacity;
+}
+
+/* Set the count of an array, new values are nil */
+void fenn_array_setcount(FennArray *array, int32_t count) {
+    if (count < 0)
+        return;
+    if (count > array->count) {
+        int32_t i;
+        fenn_array_ensure(array, count, 1);
+        for (i = array->count; i < count; i++)
+            array->data[i] = fenn_wrap_nil();
+    }
+    array->count = count;
+}
+
+/* Adds capacity for enough extra values to the array. Ensures that the
+ * next n values pushed to the array will not cause a reallocation */
+void fenn_array_extra(FennArray *array, int32_t n) {
+    /* Check for array overflow */
+    if ((int64_t)n + array->count > INT32_MAX) {
+        // TODO: handle array overflow
+    }
+    int32_t new_size = array->count + n;
+    if (new_size > array->capacity) {
+        int32_t new_capacity = new_size > INT32_MAX / 2 ? INT32_MAX : new_size * 2;
+        FennObject *new_data = realloc(array->data, new_capacity * sizeof(FennObject));
+        if (NULL == new_data) {
+            // TODO: Handle Out Of Memory
+        }
+        array->data = new_data;
+        array->capacity = new_capacity;
+    }
+}
+
+/* Push a value to the top of the array */
+void fenn_array_push(FennArray *array, FennObject x) {
+    if (array->count >= array->capacity)
+        fenn_array_extra(array, 1);
+    array->data[array->count++] = x;
+    fenn_gc_barrier(&array->gc, x);
+}
+
+/* Push n values to the top of the array. The values may come from the
+ * array itself. */
+void fenn_array_push_n(FennArray *array, const FennObject *values, int32_t n) {
+    if (n <= 0)
+        return;
+    if (array->count + n > array->capacity) {
+        // Find the values again if they move with the array
+        if (values >= array->data && values < array->data + array->count) {
+            ptrdiff_t offset = values - array->data;
+            fenn_array_extra(array, n);
+            values = array->data + offset;
+        } else {
+            fenn_array_extra(array, n);
+        }
+    }
+    memcpy(array->data + array->count, values, sizeof(FennObject) * n);
+    array->count += n;
+    fenn_gc_barrierback(&array->gc);
+}
+
+/* Pop a value from the top of the array, or nil if it is empty */
+FennObject fenn_array_pop(FennArray *array) {
+    if (array->count)
+        return array->data[--array->count];
+    return fenn_wrap_nil();
+}
+
+/* Look at the value at the top of the array, or nil if it is empty */
+FennObject fenn_array_peek(FennArray *array) {
+    if (array->count)
+        return array->data[array->count - 1];
+    return fenn_wrap_nil();
+}
+
+/* Push the values of another array, which may be the same array */
+void fenn_array_concat(FennArray *array, const FennArray *other) {
+    fenn_array_push_n(array, other->data, other->count);
+}
+
+/* Create a new array with the values of an array from start up to end.
+ * The bounds are clamped to the array. */
+FennArray *fenn_array_slice(const FennArray *array, int32_t start, int32_t end) {
+    if (start < 0) start = 0;
+    if (end > array->count) end = array->count;
+    if (end < start) end = start;
+    return fenn_array_n(array->data + start, end - start);
+}
+
+/* Insert n values before index at, moving the values after it up. The
+ * values must not come from the array. */
+void fenn_array_insert(FennArray *array, int32_t at, const FennObject *values, int32_t n) {
+    if (n <= 0 || at < 0 || at > array->count)
+        return;
+    fenn_array_extra(array, n);
+    memmove(array->data + at + n, array->data + at, sizeof(FennObject) * (array->count - at));
+    memcpy(array->data + at, values, sizeof(FennObject) * n);
+    array->count += n;
+    fenn_gc_barrierback(&array->gc);
+}
+
+/* Remove n values starting at index at, moving the values after them down */
+void fenn_array_remove(FennArray *array, int32_t at, int32_t n) {
+    if (at < 0 || at >= array->count || n <= 0)
+        return;
+    if (n > array->count - at)
+        n = array->count - at;
+    memmove(array->data + at, array->data + at + n, sizeof(FennObject) * (array->count - at - n));
+    array->count -= n;
+}
+
+/* Reverse the values of an array in place */
+void fenn_array_reverse(FennArray *array) {
+    FennObject *lo, *hi;
+    if (array->count < 2)
+        return;
+    lo = array->data;
+    hi = array->data + array->count - 1;
+    while (lo < hi) {
+        FennObject tmp = *lo;
+        *lo++ = *hi;
+        *hi-- = tmp;
+    }
+}
+
+/* Set the values from start up to end to x, growing the array if end is
+ * past its count. Values skipped over when growing are nil. */
+void fenn_array_fill(FennArray *array, int32_t start, int32_t end, FennObject x) {
+    FennObject *p, *stop;
+    if (start < 0) start = 0;
+    if (end <= start)
+        return;
+    if (end > array->count)
+        fenn_array_setcount(array, end);
+    for (p = array->data + start, stop = array->data + end; p < stop; p++)
+        *p = x;
+    fenn_gc_barrier(&array->gc, x);
+}
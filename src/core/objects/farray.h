@@ -0,0 +1,54 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef ARRAY_H
+#define ARRAY_H
+
+typedef struct FennArray FennArray;
+
+struct FennArray {
+    FennGCObject gc;
+    int32_t count;
+    int32_t capacity;
+    FennObject *data;
+};
+
+/* Functions */
+FennArray *fenn_array_init(FennArray *, int32_t);
+void fenn_array_deinit(FennArray *);
+FennArray *fenn_array(int32_t);
+FennArray *fenn_array_n(const FennObject *, int32_t);
+void fenn_array_ensure(FennArray *, int32_t, int32_t);
+void fenn_array_setcount(FennArray *, int32_t);
+void fenn_array_extra(FennArray *, int32_t);
+void fenn_array_push(FennArray *, FennObject);
+void fenn_array_push_n(FennArray *, const FennObject *, int32_t);
+FennObject fenn_array_pop(FennArray *);
+FennObject fenn_array_peek(FennArray *);
+void fenn_array_concat(FennArray *, const FennArray *);
+FennArray *fenn_array_slice(const FennArray *, int32_t, int32_t);
+void fenn_array_insert(FennArray *, int32_t, const FennObject *, int32_t);
+void fenn_array_remove(FennArray *, int32_t, int32_t);
+void fenn_array_reverse(FennArray *);
+void fenn_array_fill(FennArray *, int32_t, int32_t, FennObject);
+
+#endif
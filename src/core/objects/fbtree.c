@@ -0,0 +1,510 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include "fabstract.h"
+#include "fbtree.h"
+
+#include "gc.h"
+#include "util.h"
+
+typedef struct FennBTreeInner FennBTreeInner;
+
+struct FennBTreeInner {
+    FennBTreeNode node;
+    FennBTreeNode *children[FENN_BTREE_MAX + 2];
+};
+
+/* Leaves filled by bulk loading are left with room to grow */
+#define FENN_BTREE_FILL (FENN_BTREE_MAX * 3 / 4)
+
+#define fenn_btree_inner(n) ((FennBTreeInner *)(n))
+#define fenn_btree_leaf(n) ((FennBTreeLeaf *)(n))
+
+static void fenn_btree_gc(void *data, size_t size);
+static size_t fenn_btree_gcvisit(void *data, size_t size, FennGCVisitor visit);
+
+const FennAbstractType fenn_btree_type = {
+    "core/btree",
+    fenn_btree_gc,
+    fenn_btree_gcvisit
+};
+
+static FennBTreeNode *fenn_btree_newnode(int leaf) {
+    FennBTreeNode *node = malloc(leaf ? sizeof(FennBTreeLeaf) : sizeof(FennBTreeInner));
+    if (NULL == node) {
+        // TODO: Handle Out Of Memory
+    }
+    node->count = 0;
+    node->leaf = leaf;
+    if (leaf)
+        fenn_btree_leaf(node)->next = NULL;
+    return node;
+}
+
+static void fenn_btree_freenode(FennBTreeNode *node) {
+    int32_t i;
+    if (!node->leaf) {
+        for (i = 0; i <= node->count; i++)
+            fenn_btree_freenode(fenn_btree_inner(node)->children[i]);
+    }
+    free(node);
+}
+
+static void fenn_btree_gc(void *data, size_t size) {
+    (void) size;
+    fenn_btree_freenode(((FennBTree *) data)->root);
+}
+
+static size_t fenn_btree_visitnode(FennBTreeNode *node, FennGCVisitor visit) {
+    size_t n = (size_t) node->count;
+    int32_t i;
+    // Keys of inner nodes may no longer be in any leaf, but are still
+    // compared against
+    for (i = 0; i < node->count; i++)
+        visit(node->keys + i);
+    if (node->leaf) {
+        for (i = 0; i < node->count; i++)
+            visit(fenn_btree_leaf(node)->values + i);
+        return 2 * n;
+    }
+    for (i = 0; i <= node->count; i++)
+        n += fenn_btree_visitnode(fenn_btree_inner(node)->children[i], visit);
+    return n;
+}
+
+static size_t fenn_btree_gcvisit(void *data, size_t size, FennGCVisitor visit) {
+    (void) size;
+    return fenn_btree_visitnode(((FennBTree *) data)->root, visit);
+}
+
+/* Create a new empty B-tree */
+FennBTree *fenn_btree(void) {
+    FennBTree *t = fenn_abstract(&fenn_btree_type, sizeof(FennBTree));
+    t->count = 0;
+    t->root = fenn_btree_newnode(1);
+    return t;
+}
+
+/* Number of keys in a node less than key, or also equal to it if upper is
+ * set */
+static int32_t fenn_btree_search(const FennBTreeNode *node, FennObject key, int upper) {
+    int32_t lo = 0, hi = node->count;
+    while (lo < hi) {
+        int32_t mid = lo + (hi - lo) / 2;
+        int comp = fenn_compare(node->keys[mid], key);
+        if (comp < 0 || (upper && comp == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Find the leaf a key is in or would be put in */
+static FennBTreeLeaf *fenn_btree_findleaf(FennBTree *t, FennObject key) {
+    FennBTreeNode *node = t->root;
+    while (!node->leaf)
+        node = fenn_btree_inner(node)->children[fenn_btree_search(node, key, 1)];
+    return fenn_btree_leaf(node);
+}
+
+/* Get the value of a key, or nil if there is none */
+FennObject fenn_btree_get(FennBTree *t, FennObject key) {
+    FennBTreeLeaf *leaf = fenn_btree_findleaf(t, key);
+    int32_t i = fenn_btree_search(&leaf->node, key, 0);
+    if (i < leaf->node.count && fenn_compare(leaf->node.keys[i], key) == 0)
+        return leaf->values[i];
+    return fenn_wrap_nil();
+}
+
+/* Split a node holding one key too many. Returns the new right half and
+ * stores the key that separates it from the left in sep. */
+static FennBTreeNode *fenn_btree_split(FennBTreeNode *node, FennObject *sep) {
+    int32_t half = node->count / 2;
+    FennBTreeNode *right = fenn_btree_newnode(node->leaf);
+    if (node->leaf) {
+        FennBTreeLeaf *l = fenn_btree_leaf(node), *r = fenn_btree_leaf(right);
+        right->count = node->count - half;
+        memcpy(right->keys, node->keys + half, right->count * sizeof(FennObject));
+        memcpy(r->values, l->values + half, right->count * sizeof(FennObject));
+        r->next = l->next;
+        l->next = r;
+        *sep = right->keys[0];
+    } else {
+        // The middle key moves up to the parent
+        right->count = node->count - half - 1;
+        *sep = node->keys[half];
+        memcpy(right->keys, node->keys + half + 1, right->count * sizeof(FennObject));
+        memcpy(fenn_btree_inner(right)->children, fenn_btree_inner(node)->children + half + 1,
+               (right->count + 1) * sizeof(FennBTreeNode *));
+    }
+    node->count = half;
+    return right;
+}
+
+/* Put a pair in the subtree at node, storing the old value of the key in
+ * old. If the node splits, returns the new right node and stores the key
+ * separating it in sep. */
+static FennBTreeNode *fenn_btree_insert(FennBTreeNode *node, FennObject key, FennObject value,
+                                        FennObject *old, FennObject *sep) {
+    int32_t i;
+    if (node->leaf) {
+        FennBTreeLeaf *leaf = fenn_btree_leaf(node);
+        i = fenn_btree_search(node, key, 0);
+        if (i < node->count && fenn_compare(node->keys[i], key) == 0) {
+            *old = leaf->values[i];
+            leaf->values[i] = value;
+            return NULL;
+        }
+        memmove(node->keys + i + 1, node->keys + i, (node->count - i) * sizeof(FennObject));
+        memmove(leaf->values + i + 1, leaf->values + i, (node->count - i) * sizeof(FennObject));
+        node->keys[i] = key;
+        leaf->values[i] = value;
+        node->count++;
+    } else {
+        FennBTreeInner *inner = fenn_btree_inner(node);
+        FennBTreeNode *right;
+        FennObject childsep;
+        i = fenn_btree_search(node, key, 1);
+        right = fenn_btree_insert(inner->children[i], key, value, old, &childsep);
+        if (NULL == right)
+            return NULL;
+        memmove(node->keys + i + 1, node->keys + i, (node->count - i) * sizeof(FennObject));
+        memmove(inner->children + i + 2, inner->children + i + 1, (node->count - i) * sizeof(FennBTreeNode *));
+        node->keys[i] = childsep;
+        inner->children[i + 1] = right;
+        node->count++;
+    }
+    if (node->count <= FENN_BTREE_MAX)
+        return NULL;
+    return fenn_btree_split(node, sep);
+}
+
+/* Set the value of a key. Putting a nil value removes the key, and nil
+ * keys are ignored. */
+void fenn_btree_put(FennBTree *t, FennObject key, FennObject value) {
+    FennAbstractHead *head = fenn_abstract_head(t);
+    FennObject old = fenn_wrap_nil(), sep;
+    FennBTreeNode *right;
+    if (fenn_checktype(key, FENN_NIL))
+        return;
+    if (fenn_checktype(value, FENN_NIL)) {
+        fenn_btree_remove(t, key);
+        return;
+    }
+    right = fenn_btree_insert(t->root, key, value, &old, &sep);
+    if (NULL != right) {
+        FennBTreeNode *root = fenn_btree_newnode(0);
+        root->count = 1;
+        root->keys[0] = sep;
+        fenn_btree_inner(root)->children[0] = t->root;
+        fenn_btree_inner(root)->children[1] = right;
+        t->root = root;
+    }
+    if (fenn_checktype(old, FENN_NIL))
+        t->count++;
+    fenn_gc_barrier(&head->gc, key);
+    fenn_gc_barrier(&head->gc, value);
+}
+
+/* Refill child i of an inner node after it fell below the minimum, from a
+ * sibling that can spare a key or by merging it with one */
+static void fenn_btree_fix(FennBTreeInner *parent, int32_t i) {
+    FennBTreeNode *child = parent->children[i];
+    FennBTreeNode *left = i > 0 ? parent->children[i - 1] : NULL;
+    FennBTreeNode *right = i < parent->node.count ? parent->children[i + 1] : NULL;
+    FennBTreeNode *l, *r;
+    int32_t j;
+    if (NULL != left && left->count > FENN_BTREE_MIN) {
+        memmove(child->keys + 1, child->keys, child->count * sizeof(FennObject));
+        if (child->leaf) {
+            FennObject *values = fenn_btree_leaf(child)->values;
+            memmove(values + 1, values, child->count * sizeof(FennObject));
+            child->keys[0] = left->keys[left->count - 1];
+            values[0] = fenn_btree_leaf(left)->values[left->count - 1];
+            parent->node.keys[i - 1] = child->keys[0];
+        } else {
+            FennBTreeNode **children = fenn_btree_inner(child)->children;
+            memmove(children + 1, children, (child->count + 1) * sizeof(FennBTreeNode *));
+            child->keys[0] = parent->node.keys[i - 1];
+            children[0] = fenn_btree_inner(left)->children[left->count];
+            parent->node.keys[i - 1] = left->keys[left->count - 1];
+        }
+        left->count--;
+        child->count++;
+        return;
+    }
+    if (NULL != right && right->count > FENN_BTREE_MIN) {
+        if (child->leaf) {
+            FennObject *values = fenn_btree_leaf(right)->values;
+            child->keys[child->count] = right->keys[0];
+            fenn_btree_leaf(child)->values[child->count] = values[0];
+            memmove(right->keys, right->keys + 1, (right->count - 1) * sizeof(FennObject));
+            memmove(values, values + 1, (right->count - 1) * sizeof(FennObject));
+            parent->node.keys[i] = right->keys[0];
+        } else {
+            FennBTreeNode **children = fenn_btree_inner(right)->children;
+            child->keys[child->count] = parent->node.keys[i];
+            fenn_btree_inner(child)->children[child->count + 1] = children[0];
+            parent->node.keys[i] = right->keys[0];
+            memmove(right->keys, right->keys + 1, (right->count - 1) * sizeof(FennObject));
+            memmove(children, children + 1, right->count * sizeof(FennBTreeNode *));
+        }
+        right->count--;
+        child->count++;
+        return;
+    }
+    // Neither sibling can spare a key, so merge with one of them
+    j = NULL != left ? i - 1 : i;
+    l = parent->children[j];
+    r = parent->children[j + 1];
+    if (l->leaf) {
+        memcpy(l->keys + l->count, r->keys, r->count * sizeof(FennObject));
+        memcpy(fenn_btree_leaf(l)->values + l->count, fenn_btree_leaf(r)->values, r->count * sizeof(FennObject));
+        fenn_btree_leaf(l)->next = fenn_btree_leaf(r)->next;
+        l->count += r->count;
+    } else {
+        l->keys[l->count] = parent->node.keys[j];
+        memcpy(l->keys + l->count + 1, r->keys, r->count * sizeof(FennObject));
+        memcpy(fenn_btree_inner(l)->children + l->count + 1, fenn_btree_inner(r)->children,
+               (r->count + 1) * sizeof(FennBTreeNode *));
+        l->count += r->count + 1;
+    }
+    free(r);
+    memmove(parent->node.keys + j, parent->node.keys + j + 1, (parent->node.count - j - 1) * sizeof(FennObject));
+    memmove(parent->children + j + 1, parent->children + j + 2, (parent->node.count - j - 1) * sizeof(FennBTreeNode *));
+    parent->node.count--;
+}
+
+/* Remove a key from the subtree at node, storing its value in old. Returns
+ * 1 if the node is left with too few keys. */
+static int fenn_btree_delete(FennBTreeNode *node, FennObject key, FennObject *old) {
+    int32_t i;
+    if (node->leaf) {
+        FennBTreeLeaf *leaf = fenn_btree_leaf(node);
+        i = fenn_btree_search(node, key, 0);
+        if (i < node->count && fenn_compare(node->keys[i], key) == 0) {
+            *old = leaf->values[i];
+            memmove(node->keys + i, node->keys + i + 1, (node->count - i - 1) * sizeof(FennObject));
+            memmove(leaf->values + i, leaf->values + i + 1, (node->count - i - 1) * sizeof(FennObject));
+            node->count--;
+        }
+        return node->count < FENN_BTREE_MIN;
+    }
+    i = fenn_btree_search(node, key, 1);
+    if (!fenn_btree_delete(fenn_btree_inner(node)->children[i], key, old))
+        return 0;
+    fenn_btree_fix(fenn_btree_inner(node), i);
+    return node->count < FENN_BTREE_MIN;
+}
+
+/* Remove a key. Returns the value it had, or nil if there was none. */
+FennObject fenn_btree_remove(FennBTree *t, FennObject key) {
+    FennObject old = fenn_wrap_nil();
+    fenn_btree_delete(t->root, key, &old);
+    if (!fenn_checktype(old, FENN_NIL))
+        t->count--;
+    if (!t->root->leaf && t->root->count == 0) {
+        FennBTreeNode *root = t->root;
+        t->root = fenn_btree_inner(root)->children[0];
+        free(root);
+    }
+    return old;
+}
+
+/* Remove all pairs */
+void fenn_btree_clear(FennBTree *t) {
+    fenn_btree_freenode(t->root);
+    t->root = fenn_btree_newnode(1);
+    t->count = 0;
+}
+
+/* Create a B-tree from pairs in increasing order of key, building it level
+ * by level rather than one pair at a time. Pairs that are not in strictly
+ * increasing order, or that have a nil key or value, are put one by one
+ * instead. */
+FennBTree *fenn_btree_from_sorted(const FennKV *pairs, int32_t n) {
+    FennBTree *t = fenn_btree();
+    FennBTreeNode **level;
+    FennObject *lows;
+    FennBTreeLeaf *prev = NULL;
+    int32_t i, j, count;
+    for (i = 0; i < n; i++) {
+        if (fenn_checktype(pairs[i].key, FENN_NIL) || fenn_checktype(pairs[i].value, FENN_NIL) ||
+            (i > 0 && fenn_compare(pairs[i - 1].key, pairs[i].key) >= 0)) {
+            for (j = 0; j < n; j++)
+                fenn_btree_put(t, pairs[j].key, pairs[j].value);
+            return t;
+        }
+    }
+    fenn_gc_barrierback(&fenn_abstract_head(t)->gc);
+    t->count = n;
+    if (n <= FENN_BTREE_MAX) {
+        for (i = 0; i < n; i++) {
+            t->root->keys[i] = pairs[i].key;
+            fenn_btree_leaf(t->root)->values[i] = pairs[i].value;
+        }
+        t->root->count = n;
+        return t;
+    }
+    free(t->root);
+    // Spread the pairs evenly over as few leaves as hold them at the fill
+    // level, then the leaves over inner nodes the same way
+    count = (n + FENN_BTREE_FILL - 1) / FENN_BTREE_FILL;
+    level = malloc(count * sizeof(FennBTreeNode *));
+    lows = malloc(count * sizeof(FennObject));
+    if (NULL == level || NULL == lows) {
+        // TODO: Handle Out Of Memory
+    }
+    for (i = 0; i < count; i++) {
+        int32_t start = (int32_t) ((int64_t) i * n / count);
+        int32_t end = (int32_t) ((int64_t) (i + 1) * n / count);
+        FennBTreeLeaf *leaf = fenn_btree_leaf(fenn_btree_newnode(1));
+        for (j = start; j < end; j++) {
+            leaf->node.keys[j - start] = pairs[j].key;
+            leaf->values[j - start] = pairs[j].value;
+        }
+        leaf->node.count = end - start;
+        if (NULL != prev)
+            prev->next = leaf;
+        prev = leaf;
+        level[i] = &leaf->node;
+        lows[i] = leaf->node.keys[0];
+    }
+    while (count > 1) {
+        int32_t parents = (count + FENN_BTREE_FILL) / (FENN_BTREE_FILL + 1);
+        for (i = 0; i < parents; i++) {
+            int32_t start = (int32_t) ((int64_t) i * count / parents);
+            int32_t end = (int32_t) ((int64_t) (i + 1) * count / parents);
+            FennBTreeInner *inner = fenn_btree_inner(fenn_btree_newnode(0));
+            for (j = start; j < end; j++) {
+                inner->children[j - start] = level[j];
+                if (j > start)
+                    inner->node.keys[j - start - 1] = lows[j];
+            }
+            inner->node.count = end - start - 1;
+            // Nodes of the level above are stored over ones already used
+            level[i] = &inner->node;
+            lows[i] = lows[start];
+        }
+        count = parents;
+    }
+    t->root = level[0];
+    free(level);
+    free(lows);
+    return t;
+}
+
+/* Get the last pair in the subtree at node */
+static int fenn_btree_lastin(FennBTreeNode *node, FennKV *kv) {
+    while (!node->leaf)
+        node = fenn_btree_inner(node)->children[node->count];
+    if (node->count == 0)
+        return 0;
+    kv->key = node->keys[node->count - 1];
+    kv->value = fenn_btree_leaf(node)->values[node->count - 1];
+    return 1;
+}
+
+/* Get the last pair with a key at most key in the subtree at node */
+static int fenn_btree_floorin(FennBTreeNode *node, FennObject key, FennKV *kv) {
+    int32_t i = fenn_btree_search(node, key, 1);
+    if (node->leaf) {
+        if (i == 0)
+            return 0;
+        kv->key = node->keys[i - 1];
+        kv->value = fenn_btree_leaf(node)->values[i - 1];
+        return 1;
+    }
+    if (fenn_btree_floorin(fenn_btree_inner(node)->children[i], key, kv))
+        return 1;
+    // Everything in the child before is below the key
+    return i > 0 && fenn_btree_lastin(fenn_btree_inner(node)->children[i - 1], kv);
+}
+
+/* Get the pair with the smallest key. Returns 0 if the tree is empty. */
+int fenn_btree_first(FennBTree *t, FennKV *kv) {
+    FennBTreeCursor cursor;
+    fenn_btree_start(t, &cursor);
+    return fenn_btree_next(&cursor, kv);
+}
+
+/* Get the pair with the largest key. Returns 0 if the tree is empty. */
+int fenn_btree_last(FennBTree *t, FennKV *kv) {
+    return fenn_btree_lastin(t->root, kv);
+}
+
+/* Get the pair with the largest key at most key. Returns 0 if there is
+ * none. */
+int fenn_btree_floor(FennBTree *t, FennObject key, FennKV *kv) {
+    return fenn_btree_floorin(t->root, key, kv);
+}
+
+/* Get the pair with the smallest key at least key. Returns 0 if there is
+ * none. */
+int fenn_btree_ceiling(FennBTree *t, FennObject key, FennKV *kv) {
+    FennBTreeCursor cursor;
+    fenn_btree_seek(t, key, &cursor);
+    return fenn_btree_next(&cursor, kv);
+}
+
+/* Place a cursor before the first pair */
+void fenn_btree_start(FennBTree *t, FennBTreeCursor *cursor) {
+    FennBTreeNode *node = t->root;
+    while (!node->leaf)
+        node = fenn_btree_inner(node)->children[0];
+    cursor->leaf = fenn_btree_leaf(node);
+    cursor->index = 0;
+}
+
+/* Place a cursor before the first pair with a key at least key */
+void fenn_btree_seek(FennBTree *t, FennObject key, FennBTreeCursor *cursor) {
+    cursor->leaf = fenn_btree_findleaf(t, key);
+    cursor->index = fenn_btree_search(&cursor->leaf->node, key, 0);
+}
+
+/* Get the pair after a cursor and move past it. Returns 0 at the end. */
+int fenn_btree_next(FennBTreeCursor *cursor, FennKV *kv) {
+    FennBTreeLeaf *leaf = cursor->leaf;
+    while (NULL != leaf && cursor->index >= leaf->node.count) {
+        leaf = cursor->leaf = leaf->next;
+        cursor->index = 0;
+    }
+    if (NULL == leaf)
+        return 0;
+    kv->key = leaf->node.keys[cursor->index];
+    kv->value = leaf->values[cursor->index];
+    cursor->index++;
+    return 1;
+}
+
+/* Copy up to max pairs with keys from lo up to but not including hi into
+ * pairs, in order. Returns the number copied. */
+int32_t fenn_btree_range(FennBTree *t, FennObject lo, FennObject hi, FennKV *pairs, int32_t max) {
+    FennBTreeCursor cursor;
+    int32_t n = 0;
+    fenn_btree_seek(t, lo, &cursor);
+    while (n < max && fenn_btree_next(&cursor, pairs + n) && fenn_compare(pairs[n].key, hi) < 0)
+        n++;
+    return n;
+}
@@ -0,0 +1,83 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef BTREE_H
+#define BTREE_H
+
+typedef struct FennBTree FennBTree;
+typedef struct FennBTreeNode FennBTreeNode;
+typedef struct FennBTreeLeaf FennBTreeLeaf;
+typedef struct FennBTreeCursor FennBTreeCursor;
+
+/* B-trees are mutable maps kept in the order of fenn_compare. They are
+ * abstract values of type fenn_btree_type. Pairs are stored in leaves
+ * chained in key order, so range scans walk along the leaves, and inner
+ * nodes hold the smallest key of each child after the first. Nodes hold
+ * up to FENN_BTREE_MAX keys in arrays searched by bisection, and every
+ * node but the root holds at least FENN_BTREE_MIN.
+ *
+ * A set is a B-tree whose values are all true. */
+#define FENN_BTREE_MAX 32
+#define FENN_BTREE_MIN (FENN_BTREE_MAX / 4)
+
+struct FennBTreeNode {
+    int32_t count;
+    int32_t leaf;
+    FennObject keys[FENN_BTREE_MAX + 1]; // One spare while a node splits
+};
+
+struct FennBTreeLeaf {
+    FennBTreeNode node;
+    FennBTreeLeaf *next;
+    FennObject values[FENN_BTREE_MAX + 1];
+};
+
+struct FennBTree {
+    int32_t count;
+    FennBTreeNode *root;
+};
+
+/* Position in a B-tree. Changing the tree invalidates it. */
+struct FennBTreeCursor {
+    FennBTreeLeaf *leaf;
+    int32_t index;
+};
+
+extern const FennAbstractType fenn_btree_type;
+
+/* Functions */
+FennBTree *fenn_btree(void);
+FennBTree *fenn_btree_from_sorted(const FennKV *, int32_t);
+FennObject fenn_btree_get(FennBTree *, FennObject);
+void fenn_btree_put(FennBTree *, FennObject, FennObject);
+FennObject fenn_btree_remove(FennBTree *, FennObject);
+void fenn_btree_clear(FennBTree *);
+int fenn_btree_first(FennBTree *, FennKV *);
+int fenn_btree_last(FennBTree *, FennKV *);
+int fenn_btree_floor(FennBTree *, FennObject, FennKV *);
+int fenn_btree_ceiling(FennBTree *, FennObject, FennKV *);
+void fenn_btree_start(FennBTree *, FennBTreeCursor *);
+void fenn_btree_seek(FennBTree *, FennObject, FennBTreeCursor *);
+int fenn_btree_next(FennBTreeCursor *, FennKV *);
+int32_t fenn_btree_range(FennBTree *, FennObject, FennObject, FennKV *, int32_t);
+
+#endif
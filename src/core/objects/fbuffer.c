@@ -20,6 +20,11 @@
 * IN THE SOFTWARE.
 */
 
+#ifdef __linux__
+// For mremap
+#define _GNU_SOURCE
+#endif
+
 #include <fenn.h>
 #include "fbuffer.h"
 
@@ -27,14 +32,149 @@
 #include "util.h"
 #include "fstring.h"
 
-/* Initialize a buffer */
-FennBuffer *fenn_buffer_init(FennBuffer *buffer, int32_t capacity) {
-    uint8_t *data = NULL;
-    if (capacity > 0) {
-        data = malloc(sizeof(uint8_t) * capacity);
+#ifdef __linux__
+#include <sys/mman.h>
+#define FENN_BUFFER_MAP
+#endif
+
+/* Mapped buffers take whole pages, or whole huge pages when asked for */
+#define FENN_BUFFER_PAGE 4096
+#define FENN_BUFFER_HUGEPAGE (2 << 20)
+
+/* One pool for each power of two from FENN_BUFFER_POOLMIN to
+ * FENN_BUFFER_POOLMAX */
+#define FENN_BUFFER_POOLS 15
+
+typedef struct {
+    uint8_t *data[FENN_BUFFER_POOLDEPTH];
+    int32_t count;
+} FennBufferPool;
+
+static FENN_THREAD_LOCAL FennBufferPool fenn_buffer_pools[FENN_BUFFER_POOLS];
+static FENN_THREAD_LOCAL int fenn_buffer_hugepages = 0;
+
+/* Index of the pool for the smallest power of two capacity that holds
+ * capacity bytes */
+static int fenn_buffer_pool(int64_t capacity) {
+    int i = 0;
+    while (((int64_t) FENN_BUFFER_POOLMIN << i) < capacity)
+        i++;
+    return i;
+}
+
+/* The capacity memory is actually allocated with for a capacity */
+static int64_t fenn_buffer_round(int64_t capacity) {
+    if (capacity <= FENN_BUFFER_POOLMAX)
+        return (int64_t) FENN_BUFFER_POOLMIN << fenn_buffer_pool(capacity);
+#ifdef FENN_BUFFER_MAP
+    int64_t page = fenn_buffer_hugepages ? FENN_BUFFER_HUGEPAGE : FENN_BUFFER_PAGE;
+    if (capacity > INT64_MAX - page)
+        return capacity;
+    return (capacity + page - 1) & ~(page - 1);
+#else
+    return capacity;
+#endif
+}
+
+/* Allocate memory for a rounded capacity. Small capacities come from the
+ * pool and big ones get a mapping of their own. */
+static uint8_t *fenn_buffer_alloc(int64_t capacity) {
+    uint8_t *data;
+    if (capacity <= FENN_BUFFER_POOLMAX) {
+        FennBufferPool *pool = fenn_buffer_pools + fenn_buffer_pool(capacity);
+        if (pool->count)
+            return pool->data[--pool->count];
+        data = malloc((size_t) capacity);
+    } else {
+#ifdef FENN_BUFFER_MAP
+        data = mmap(NULL, (size_t) capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == data) {
+            data = NULL;
+        } else if (fenn_buffer_hugepages) {
+            madvise(data, (size_t) capacity, MADV_HUGEPAGE);
+        }
+#else
+        data = malloc((size_t) capacity);
+#endif
+    }
+    if (NULL == data) {
+        // TODO: Handle Out Of Memory
+    }
+    return data;
+}
+
+/* Give back memory from fenn_buffer_alloc */
+static void fenn_buffer_free(uint8_t *data, int64_t capacity) {
+    if (NULL == data)
+        return;
+    if (capacity <= FENN_BUFFER_POOLMAX) {
+        FennBufferPool *pool = fenn_buffer_pools + fenn_buffer_pool(capacity);
+        if (pool->count < FENN_BUFFER_POOLDEPTH)
+            pool->data[pool->count++] = data;
+        else
+            free(data);
+        return;
+    }
+#ifdef FENN_BUFFER_MAP
+    munmap(data, (size_t) capacity);
+#else
+    free(data);
+#endif
+}
+
+/* Move the contents of a buffer to memory of a bigger rounded capacity.
+ * Mapped buffers are grown by remapping their pages rather than copying
+ * them. */
+static void fenn_buffer_grow(FennBuffer *buffer, int64_t capacity) {
+    uint8_t *data;
+    if (buffer->capacity > FENN_BUFFER_POOLMAX) {
+#ifdef FENN_BUFFER_MAP
+        data = mremap(buffer->data, (size_t) buffer->capacity, (size_t) capacity, MREMAP_MAYMOVE);
+        if (MAP_FAILED == data) {
+            // TODO: Handle Out Of Memory
+        }
+        if (fenn_buffer_hugepages)
+            madvise(data, (size_t) capacity, MADV_HUGEPAGE);
+#else
+        data = realloc(buffer->data, (size_t) capacity);
         if (NULL == data) {
             // TODO: Handle Out Of Memory
         }
+#endif
+    } else {
+        data = fenn_buffer_alloc(capacity);
+        if (buffer->count > 0)
+            memcpy(data, buffer->data, (size_t) buffer->count);
+        fenn_buffer_free(buffer->data, buffer->capacity);
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+}
+
+/* Free the memory kept for reuse by this thread */
+void fenn_buffer_pooldeinit(void) {
+    int i;
+    for (i = 0; i < FENN_BUFFER_POOLS; i++) {
+        FennBufferPool *pool = fenn_buffer_pools + i;
+        while (pool->count)
+            free(pool->data[--pool->count]);
+    }
+}
+
+/* Set whether buffers big enough to be mapped on their own should ask for
+ * transparent huge pages */
+void fenn_buffersethugepages(int enable) {
+    fenn_buffer_hugepages = enable;
+}
+
+/* Initialize a buffer */
+FennBuffer *fenn_buffer_init(FennBuffer *buffer, int64_t capacity) {
+    uint8_t *data = NULL;
+    if (capacity > 0) {
+        capacity = fenn_buffer_round(capacity);
+        data = fenn_buffer_alloc(capacity);
+    } else {
+        capacity = 0;
     }
     buffer->count = 0;
     buffer->capacity = capacity;
@@ -44,72 +184,65 @@ FennBuffer *fenn_buffer_init(FennBuffer *buffer, int32_t capacity) {
 
 /* Deinitialize a buffer (free data memory) */
 void fenn_buffer_deinit(FennBuffer *buffer) {
-    free(buffer->data);
+    fenn_buffer_free(buffer->data, buffer->capacity);
 }
 
 /* Initialize a buffer */
-FennBuffer *fenn_buffer(int32_t capacity) {
+FennBuffer *fenn_buffer(int64_t capacity) {
     FennBuffer *buffer = fenn_gcalloc(FENN_MEMORY_BUFFER, sizeof(FennBuffer));
     return fenn_buffer_init(buffer, capacity);
 }
 
 /* Ensure that the buffer has enough internal capacity */
-void fenn_buffer_ensure(FennBuffer *buffer, int32_t capacity, int32_t growth) {
-    uint8_t *new_data;
-    uint8_t *old = buffer->data;
+void fenn_buffer_ensure(FennBuffer *buffer, int64_t capacity, int32_t growth) {
     if (capacity <= buffer->capacity) return;
-    int64_t big_capacity = capacity * growth;
-    capacity = big_capacity > INT32_MAX ? INT32_MAX : (int32_t) big_capacity;
-    new_data = realloc(old, capacity * sizeof(uint8_t));
-    if (NULL == new_data) {
-        // TODO: Handle Out Of Memory
-    }
-    buffer->data = new_data;
-    buffer->capacity = capacity;
+    capacity = capacity > INT64_MAX / growth ? INT64_MAX : capacity * growth;
+    fenn_buffer_grow(buffer, fenn_buffer_round(capacity));
 }
 
 /* Ensure that the buffer has enough internal capacity */
-void fenn_buffer_setcount(FennBuffer *buffer, int32_t count) {
+void fenn_buffer_setcount(FennBuffer *buffer, int64_t count) {
     if (count < 0)
         return;
     if (count > buffer->count) {
-        int32_t oldcount = buffer->count;
+        int64_t oldcount = buffer->count;
         fenn_buffer_ensure(buffer, count, 1);
-        memset(buffer->data + oldcount, 0, count - oldcount);
+        memset(buffer->data + oldcount, 0, (size_t) (count - oldcount));
     }
     buffer->count = count;
 }
 
 /* Adds capacity for enough extra bytes to the buffer. Ensures that the
  * next n bytes pushed to the buffer will not cause a reallocation */
-void fenn_buffer_extra(FennBuffer *buffer, int32_t n) {
+void fenn_buffer_extra(FennBuffer *buffer, int64_t n) {
     /* Check for buffer overflow */
-    if ((int64_t)n + buffer->count > INT32_MAX) {
+    if (n > INT64_MAX - buffer->count) {
         // TODO: handle buffer overflow
     }
-    int32_t new_size = buffer->count + n;
-    if (new_size > buffer->capacity) {
-        int32_t new_capacity = new_size * 2;
-        uint8_t *new_data = realloc(buffer->data, new_capacity * sizeof(uint8_t));
-        if (NULL == new_data) {
-            // TODO: Handle Out Of Memory
-        }
-        buffer->data = new_data;
-        buffer->capacity = new_capacity;
-    }
+    int64_t new_size = buffer->count + n;
+    if (new_size <= buffer->capacity)
+        return;
+    // Pooled capacities are powers of two, so rounding up already at
+    // least doubles them. Only mapped buffers need the doubling.
+    if (new_size <= FENN_BUFFER_POOLMAX)
+        fenn_buffer_grow(buffer, fenn_buffer_round(new_size));
+    else
+        fenn_buffer_grow(buffer, fenn_buffer_round(new_size > INT64_MAX / 2 ? INT64_MAX : new_size * 2));
 }
 
 /* Push a cstring to buffer */
 void fenn_buffer_push_cstring(FennBuffer *buffer, const char *cstring) {
-    int32_t len = 0;
+    int64_t len = 0;
     while (cstring[len]) ++len;
     fenn_buffer_push_bytes(buffer, (const uint8_t *) cstring, len);
 }
 
 /* Push multiple bytes into the buffer */
-void fenn_buffer_push_bytes(FennBuffer *buffer, const uint8_t *string, int32_t length) {
+void fenn_buffer_push_bytes(FennBuffer *buffer, const uint8_t *string, int64_t length) {
+    if (length <= 0)
+        return;
     fenn_buffer_extra(buffer, length);
-    memcpy(buffer->data + buffer->count, string, length);
+    memcpy(buffer->data + buffer->count, string, (size_t) length);
     buffer->count += length;
 }
 
@@ -117,41 +250,223 @@ void fenn_buffer_push_string(FennBuffer *buffer, const uint8_t *string) {
     fenn_buffer_push_bytes(buffer, string, fenn_string_length(string));
 }
 
+/* Unaligned little endian stores and loads */
+static void fenn_buffer_store16(uint8_t *p, uint16_t x) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap16(x);
+#endif
+    memcpy(p, &x, 2);
+}
+
+static void fenn_buffer_store32(uint8_t *p, uint32_t x) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap32(x);
+#endif
+    memcpy(p, &x, 4);
+}
+
+static void fenn_buffer_store64(uint8_t *p, uint64_t x) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    memcpy(p, &x, 8);
+}
+
+static uint16_t fenn_buffer_load16(const uint8_t *p) {
+    uint16_t x;
+    memcpy(&x, p, 2);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap16(x);
+#endif
+    return x;
+}
+
+static uint32_t fenn_buffer_load32(const uint8_t *p) {
+    uint32_t x;
+    memcpy(&x, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap32(x);
+#endif
+    return x;
+}
+
+static uint64_t fenn_buffer_load64(const uint8_t *p) {
+    uint64_t x;
+    memcpy(&x, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+/* Make room for n more bytes, only calling out when the buffer is full */
+#define fenn_buffer_room(buffer, n) do { \
+    if ((buffer)->capacity - (buffer)->count < (n)) \
+        fenn_buffer_extra((buffer), (n)); \
+} while (0)
+
 /* Push a single byte to the buffer */
 void fenn_buffer_push_u8(FennBuffer *buffer, uint8_t byte) {
-    fenn_buffer_extra(buffer, 1);
-    buffer->data[buffer->count] = byte;
-    buffer->count++;
+    fenn_buffer_room(buffer, 1);
+    buffer->data[buffer->count++] = byte;
 }
 
 /* Push a 16 bit unsigned integer to the buffer */
 void fenn_buffer_push_u16(FennBuffer *buffer, uint16_t x) {
-    fenn_buffer_extra(buffer, 2);
-    buffer->data[buffer->count] = x & 0xFF;
-    buffer->data[buffer->count + 1] = (x >> 8) & 0xFF;
+    fenn_buffer_room(buffer, 2);
+    fenn_buffer_store16(buffer->data + buffer->count, x);
     buffer->count += 2;
 }
 
 /* Push a 32 bit unsigned integer to the buffer */
 void fenn_buffer_push_u32(FennBuffer *buffer, uint32_t x) {
-    fenn_buffer_extra(buffer, 4);
-    buffer->data[buffer->count] = x & 0xFF;
-    buffer->data[buffer->count + 1] = (x >> 8) & 0xFF;
-    buffer->data[buffer->count + 2] = (x >> 16) & 0xFF;
-    buffer->data[buffer->count + 3] = (x >> 24) & 0xFF;
+    fenn_buffer_room(buffer, 4);
+    fenn_buffer_store32(buffer->data + buffer->count, x);
     buffer->count += 4;
 }
 
 /* Push a 64 bit unsigned integer to the buffer */
 void fenn_buffer_push_u64(FennBuffer *buffer, uint64_t x) {
-    fenn_buffer_extra(buffer, 8);
-    buffer->data[buffer->count] = x & 0xFF;
-    buffer->data[buffer->count + 1] = (x >> 8) & 0xFF;
-    buffer->data[buffer->count + 2] = (x >> 16) & 0xFF;
-    buffer->data[buffer->count + 3] = (x >> 24) & 0xFF;
-    buffer->data[buffer->count + 4] = (x >> 32) & 0xFF;
-    buffer->data[buffer->count + 5] = (x >> 40) & 0xFF;
-    buffer->data[buffer->count + 6] = (x >> 48) & 0xFF;
-    buffer->data[buffer->count + 7] = (x >> 56) & 0xFF;
+    fenn_buffer_room(buffer, 8);
+    fenn_buffer_store64(buffer->data + buffer->count, x);
     buffer->count += 8;
-}
\ No newline at end of file
+}
+
+/* Push n integers of a size to the buffer, copying them straight in on
+ * little endian machines */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define fenn_buffer_push_n(buffer, xs, n, size, store) do { \
+    int64_t i; \
+    fenn_buffer_extra((buffer), (n) * (size)); \
+    for (i = 0; i < (n); i++) \
+        store((buffer)->data + (buffer)->count + i * (size), (xs)[i]); \
+    (buffer)->count += (n) * (size); \
+} while (0)
+#else
+#define fenn_buffer_push_n(buffer, xs, n, size, store) \
+    fenn_buffer_push_bytes((buffer), (const uint8_t *) (xs), (n) * (size))
+#endif
+
+/* Push n 16 bit unsigned integers to the buffer */
+void fenn_buffer_push_u16_n(FennBuffer *buffer, const uint16_t *xs, int64_t n) {
+    if (n > 0)
+        fenn_buffer_push_n(buffer, xs, n, 2, fenn_buffer_store16);
+}
+
+/* Push n 32 bit unsigned integers to the buffer */
+void fenn_buffer_push_u32_n(FennBuffer *buffer, const uint32_t *xs, int64_t n) {
+    if (n > 0)
+        fenn_buffer_push_n(buffer, xs, n, 4, fenn_buffer_store32);
+}
+
+/* Push n 64 bit unsigned integers to the buffer */
+void fenn_buffer_push_u64_n(FennBuffer *buffer, const uint64_t *xs, int64_t n) {
+    if (n > 0)
+        fenn_buffer_push_n(buffer, xs, n, 8, fenn_buffer_store64);
+}
+
+/* Push an unsigned LEB128 varint, 7 bits a byte with the high bit set on
+ * all but the last byte. Takes at most 10 bytes. */
+void fenn_buffer_push_varint(FennBuffer *buffer, uint64_t x) {
+    uint8_t *p;
+    fenn_buffer_room(buffer, 10);
+    p = buffer->data + buffer->count;
+    while (x >= 0x80) {
+        *p++ = (uint8_t) (x | 0x80);
+        x >>= 7;
+    }
+    *p++ = (uint8_t) x;
+    buffer->count = p - buffer->data;
+}
+
+/* Push a signed varint, zigzag encoded so small negative numbers are short */
+void fenn_buffer_push_zigzag(FennBuffer *buffer, int64_t x) {
+    fenn_buffer_push_varint(buffer, ((uint64_t) x << 1) ^ (uint64_t) (x >> 63));
+}
+
+/* Start reading a buffer from its first byte */
+void fenn_buffer_reader_init(FennBufferReader *reader, const FennBuffer *buffer) {
+    reader->data = buffer->data;
+    reader->end = buffer->data + buffer->count;
+}
+
+/* Read a single byte. Returns 0 if the reader is at the end. */
+int fenn_buffer_read_u8(FennBufferReader *reader, uint8_t *x) {
+    if (reader->data == reader->end)
+        return 0;
+    *x = *reader->data++;
+    return 1;
+}
+
+/* Read a 16 bit unsigned integer, or return 0 if fewer bytes are left */
+int fenn_buffer_read_u16(FennBufferReader *reader, uint16_t *x) {
+    if (reader->end - reader->data < 2)
+        return 0;
+    *x = fenn_buffer_load16(reader->data);
+    reader->data += 2;
+    return 1;
+}
+
+/* Read a 32 bit unsigned integer, or return 0 if fewer bytes are left */
+int fenn_buffer_read_u32(FennBufferReader *reader, uint32_t *x) {
+    if (reader->end - reader->data < 4)
+        return 0;
+    *x = fenn_buffer_load32(reader->data);
+    reader->data += 4;
+    return 1;
+}
+
+/* Read a 64 bit unsigned integer, or return 0 if fewer bytes are left */
+int fenn_buffer_read_u64(FennBufferReader *reader, uint64_t *x) {
+    if (reader->end - reader->data < 8)
+        return 0;
+    *x = fenn_buffer_load64(reader->data);
+    reader->data += 8;
+    return 1;
+}
+
+/* Read an unsigned LEB128 varint. Varints longer than 10 bytes, or whose
+ * 10th byte holds more than the top bit of 64, are rejected. */
+int fenn_buffer_read_varint(FennBufferReader *reader, uint64_t *x) {
+    const uint8_t *p = reader->data;
+    const uint8_t *end = reader->end;
+    uint64_t result;
+    int shift;
+    if (p < end && *p < 0x80) {
+        *x = *p;
+        reader->data = p + 1;
+        return 1;
+    }
+    if (end - p > 10)
+        end = p + 10;
+    for (result = 0, shift = 0; p < end; shift += 7) {
+        uint8_t byte = *p++;
+        if (shift == 63 && byte > 1)
+            return 0;
+        result |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *x = result;
+            reader->data = p;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Read a signed varint written by fenn_buffer_push_zigzag */
+int fenn_buffer_read_zigzag(FennBufferReader *reader, int64_t *x) {
+    uint64_t u;
+    if (!fenn_buffer_read_varint(reader, &u))
+        return 0;
+    *x = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+    return 1;
+}
+
+/* Read n bytes in place */
+int fenn_buffer_read_bytes(FennBufferReader *reader, const uint8_t **bytes, int64_t n) {
+    if (n < 0 || reader->end - reader->data < n)
+        return 0;
+    *bytes = reader->data;
+    reader->data += n;
+    return 1;
+}
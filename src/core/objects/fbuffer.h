@@ -28,24 +28,59 @@ typedef struct FennBuffer FennBuffer;
 
 struct FennBuffer {
     FennGCObject gc;
-    int32_t count;
-    int32_t capacity;
+    int64_t count;
+    int64_t capacity;
     uint8_t *data;
 };
 
+/* A cursor over bytes pushed to a buffer. Integers are little endian, and
+ * varints are LEB128, with zigzag varints for signed integers. Reads
+ * return 0 and leave the cursor where it was when the bytes left do not
+ * hold a whole value. The cursor points into the buffer's data, so it must
+ * be set up again after the buffer grows. */
+typedef struct FennBufferReader FennBufferReader;
+
+struct FennBufferReader {
+    const uint8_t *data; // Next byte to read
+    const uint8_t *end;
+};
+
+/* Capacities up to this are rounded to powers of two and recycled
+ * through a pool when buffers die. Bigger buffers are mapped on their own
+ * where the system can grow a mapping in place. */
+#define FENN_BUFFER_POOLMIN 64
+#define FENN_BUFFER_POOLMAX (1 << 20)
+
+/* Buffers freed per pool size kept for reuse */
+#define FENN_BUFFER_POOLDEPTH 16
+
 /* Functions */
-FennBuffer *fenn_buffer_init(FennBuffer *, int32_t);
-void fenn_buffer_destroy(FennBuffer *);
-FennBuffer *fenn_buffer(int32_t);
-void fenn_buffer_ensure(FennBuffer *, int32_t, int32_t);
-void fenn_buffer_setcount(FennBuffer *, int32_t);
-void fenn_buffer_extra(FennBuffer *, int32_t n);
+FennBuffer *fenn_buffer_init(FennBuffer *, int64_t);
+void fenn_buffer_deinit(FennBuffer *);
+FennBuffer *fenn_buffer(int64_t);
+void fenn_buffer_ensure(FennBuffer *, int64_t, int32_t);
+void fenn_buffer_setcount(FennBuffer *, int64_t);
+void fenn_buffer_extra(FennBuffer *, int64_t n);
 void fenn_buffer_push_cstring(FennBuffer *, const char *);
-void fenn_buffer_push_bytes(FennBuffer *, const uint8_t *, int32_t);
+void fenn_buffer_push_bytes(FennBuffer *, const uint8_t *, int64_t);
 void fenn_buffer_push_string(FennBuffer *, const uint8_t *);
 void fenn_buffer_push_u8(FennBuffer *, uint8_t);
 void fenn_buffer_push_u16(FennBuffer *, uint16_t);
 void fenn_buffer_push_u32(FennBuffer *, uint32_t);
 void fenn_buffer_push_u64(FennBuffer *, uint64_t);
+void fenn_buffer_push_u16_n(FennBuffer *, const uint16_t *, int64_t);
+void fenn_buffer_push_u32_n(FennBuffer *, const uint32_t *, int64_t);
+void fenn_buffer_push_u64_n(FennBuffer *, const uint64_t *, int64_t);
+void fenn_buffer_push_varint(FennBuffer *, uint64_t);
+void fenn_buffer_push_zigzag(FennBuffer *, int64_t);
+void fenn_buffer_reader_init(FennBufferReader *, const FennBuffer *);
+int fenn_buffer_read_u8(FennBufferReader *, uint8_t *);
+int fenn_buffer_read_u16(FennBufferReader *, uint16_t *);
+int fenn_buffer_read_u32(FennBufferReader *, uint32_t *);
+int fenn_buffer_read_u64(FennBufferReader *, uint64_t *);
+int fenn_buffer_read_varint(FennBufferReader *, uint64_t *);
+int fenn_buffer_read_zigzag(FennBufferReader *, int64_t *);
+int fenn_buffer_read_bytes(FennBufferReader *, const uint8_t **, int64_t);
+void fenn_buffer_pooldeinit(void);
 
 #endif
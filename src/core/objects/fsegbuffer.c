@@ -0,0 +1,333 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include "fabstract.h"
+#include "fbuffer.h"
+#include "fsegbuffer.h"
+
+#include "gc.h"
+#include "util.h"
+#include "fstring.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+/* Most segments handed to a single writev */
+#if defined(IOV_MAX)
+#define FENN_SEGBUFFER_IOV IOV_MAX
+#else
+#define FENN_SEGBUFFER_IOV 1024
+#endif
+
+static void fenn_segbuffer_gc(void *data, size_t size);
+static size_t fenn_segbuffer_gcvisit(void *data, size_t size, FennGCVisitor visit);
+
+const FennAbstractType fenn_segbuffer_type = {
+    "core/segbuffer",
+    fenn_segbuffer_gc,
+    fenn_segbuffer_gcvisit
+};
+
+static void fenn_segbuffer_freesegments(FennSegment *seg) {
+    while (NULL != seg) {
+        FennSegment *next = seg->next;
+        free(seg);
+        seg = next;
+    }
+}
+
+static void fenn_segbuffer_gc(void *data, size_t size) {
+    FennSegBuffer *sb = (FennSegBuffer *) data;
+    (void) size;
+    fenn_segbuffer_freesegments(sb->head);
+    free(sb->spare);
+}
+
+static size_t fenn_segbuffer_gcvisit(void *data, size_t size, FennGCVisitor visit) {
+    FennSegment *seg;
+    size_t n = 0;
+    (void) size;
+    for (seg = ((FennSegBuffer *) data)->head; NULL != seg; seg = seg->next) {
+        if (!fenn_checktype(seg->source, FENN_NIL)) {
+            visit(&seg->source);
+            n++;
+        }
+    }
+    return n;
+}
+
+/* Create a new empty segmented buffer */
+FennSegBuffer *fenn_segbuffer(void) {
+    FennSegBuffer *sb = fenn_abstract(&fenn_segbuffer_type, sizeof(FennSegBuffer));
+    sb->head = NULL;
+    sb->tail = NULL;
+    sb->spare = NULL;
+    sb->offset = 0;
+    sb->count = 0;
+    sb->segments = 0;
+    return sb;
+}
+
+static void fenn_segbuffer_append(FennSegBuffer *sb, FennSegment *seg) {
+    seg->next = NULL;
+    if (NULL == sb->tail)
+        sb->head = seg;
+    else
+        sb->tail->next = seg;
+    sb->tail = seg;
+    sb->segments++;
+}
+
+/* Add an owned segment with room for at least capacity bytes */
+static FennSegment *fenn_segbuffer_newsegment(FennSegBuffer *sb, int64_t capacity) {
+    FennSegment *seg;
+    if (capacity <= FENN_SEGBUFFER_SEGMENT && NULL != sb->spare) {
+        seg = sb->spare;
+        sb->spare = NULL;
+    } else {
+        if (capacity < FENN_SEGBUFFER_SEGMENT)
+            capacity = FENN_SEGBUFFER_SEGMENT;
+        seg = malloc(sizeof(FennSegment) + (size_t) capacity);
+        if (NULL == seg) {
+            // TODO: Handle Out Of Memory
+        }
+        seg->capacity = capacity;
+    }
+    seg->source = fenn_wrap_nil();
+    seg->start = 0;
+    seg->count = 0;
+    fenn_segbuffer_append(sb, seg);
+    return seg;
+}
+
+/* Copy bytes to the end of the buffer. The last segment is filled up and
+ * whatever does not fit goes in a single new segment. */
+void fenn_segbuffer_push_bytes(FennSegBuffer *sb, const uint8_t *bytes, int64_t len) {
+    FennSegment *seg = sb->tail;
+    if (len <= 0)
+        return;
+    sb->count += len;
+    if (NULL != seg && seg->capacity > seg->count) {
+        int64_t n = seg->capacity - seg->count;
+        if (n > len)
+            n = len;
+        memcpy(seg->data + seg->count, bytes, (size_t) n);
+        seg->count += n;
+        bytes += n;
+        len -= n;
+        if (len == 0)
+            return;
+    }
+    seg = fenn_segbuffer_newsegment(sb, len);
+    memcpy(seg->data, bytes, (size_t) len);
+    seg->count = len;
+}
+
+void fenn_segbuffer_push_cstring(FennSegBuffer *sb, const char *cstring) {
+    fenn_segbuffer_push_bytes(sb, (const uint8_t *) cstring, (int64_t) strlen(cstring));
+}
+
+void fenn_segbuffer_push_u8(FennSegBuffer *sb, uint8_t byte) {
+    FennSegment *seg = sb->tail;
+    if (NULL == seg || seg->count >= seg->capacity)
+        seg = fenn_segbuffer_newsegment(sb, 1);
+    seg->data[seg->count++] = byte;
+    sb->count++;
+}
+
+/* Add a segment that refers to bytes of a string or buffer */
+static void fenn_segbuffer_splice(FennSegBuffer *sb, FennObject source, int64_t start, int64_t len) {
+    FennSegment *seg = malloc(sizeof(FennSegment));
+    if (NULL == seg) {
+        // TODO: Handle Out Of Memory
+    }
+    seg->source = source;
+    seg->start = start;
+    seg->count = len;
+    seg->capacity = 0;
+    fenn_segbuffer_append(sb, seg);
+    sb->count += len;
+    fenn_gc_barrier(&fenn_abstract_head(sb)->gc, source);
+}
+
+/* Add a string to the end of the buffer without copying it */
+void fenn_segbuffer_splice_string(FennSegBuffer *sb, const uint8_t *str) {
+    int32_t len = fenn_string_length(str);
+    if (len < FENN_SEGBUFFER_SPLICEMIN)
+        fenn_segbuffer_push_bytes(sb, str, len);
+    else
+        fenn_segbuffer_splice(sb, fenn_wrap_string(str), 0, len);
+}
+
+/* Add len bytes of a buffer from start to the end of the segmented buffer
+ * without copying them. A negative len takes the rest of the buffer. */
+void fenn_segbuffer_splice_buffer(FennSegBuffer *sb, FennBuffer *buffer, int64_t start, int64_t len) {
+    if (start < 0 || start > buffer->count)
+        return;
+    if (len < 0 || len > buffer->count - start)
+        len = buffer->count - start;
+    if (len < FENN_SEGBUFFER_SPLICEMIN)
+        fenn_segbuffer_push_bytes(sb, buffer->data + start, len);
+    else
+        fenn_segbuffer_splice(sb, fenn_wrap_buffer(buffer), start, len);
+}
+
+/* The bytes of a segment as they are now. Spliced buffers may have shrunk
+ * since. */
+static const uint8_t *fenn_segbuffer_bytes(const FennSegment *seg, int64_t *len) {
+    *len = seg->count;
+    switch (fenn_type(seg->source)) {
+        case FENN_STRING:
+            return fenn_unwrap_string(seg->source) + seg->start;
+        case FENN_BUFFER: {
+            FennBuffer *buffer = fenn_unwrap_buffer(seg->source);
+            if (seg->start >= buffer->count)
+                *len = 0;
+            else if (*len > buffer->count - seg->start)
+                *len = buffer->count - seg->start;
+            return buffer->data + seg->start;
+        }
+        default:
+            return seg->data;
+    }
+}
+
+/* Free a segment that is no longer in the buffer, or keep it for reuse */
+static void fenn_segbuffer_release(FennSegBuffer *sb, FennSegment *seg) {
+    if (NULL == sb->spare && seg->capacity == FENN_SEGBUFFER_SEGMENT)
+        sb->spare = seg;
+    else
+        free(seg);
+}
+
+/* Remove everything from the buffer, keeping one segment for reuse */
+void fenn_segbuffer_clear(FennSegBuffer *sb) {
+    FennSegment *seg = sb->head;
+    while (NULL != seg) {
+        FennSegment *next = seg->next;
+        fenn_segbuffer_release(sb, seg);
+        seg = next;
+    }
+    sb->head = NULL;
+    sb->tail = NULL;
+    sb->offset = 0;
+    sb->count = 0;
+    sb->segments = 0;
+}
+
+/* Remove the first n bytes, which have been written out */
+static void fenn_segbuffer_consume(FennSegBuffer *sb, int64_t n) {
+    FennSegment *seg;
+    sb->count -= n;
+    n += sb->offset;
+    while (NULL != (seg = sb->head)) {
+        int64_t len;
+        fenn_segbuffer_bytes(seg, &len);
+        if (n < len)
+            break;
+        n -= len;
+        sb->head = seg->next;
+        sb->segments--;
+        fenn_segbuffer_release(sb, seg);
+    }
+    if (NULL == sb->head)
+        sb->tail = NULL;
+    sb->offset = n;
+}
+
+/* Copy the contents to the end of a buffer */
+void fenn_segbuffer_flatten(FennSegBuffer *sb, FennBuffer *buffer) {
+    FennSegment *seg;
+    int64_t skip = sb->offset;
+    fenn_buffer_extra(buffer, sb->count);
+    for (seg = sb->head; NULL != seg; seg = seg->next) {
+        int64_t len;
+        const uint8_t *bytes = fenn_segbuffer_bytes(seg, &len);
+        if (len > skip)
+            fenn_buffer_push_bytes(buffer, bytes + skip, len - skip);
+        skip = 0;
+    }
+}
+
+/* Write the contents to a file descriptor and clear the buffer. All
+ * segments go out in a single writev unless there are more than the
+ * system takes at once or the write is cut short. Returns the number of
+ * bytes written, or -1 on error, such as EAGAIN on a non-blocking
+ * descriptor. The bytes written before an error are removed, so calling
+ * it again carries on where it stopped. */
+int64_t fenn_segbuffer_flush(FennSegBuffer *sb, int fd) {
+    int64_t written = 0;
+#ifdef _WIN32
+    while (NULL != sb->head) {
+        int64_t len;
+        const uint8_t *bytes = fenn_segbuffer_bytes(sb->head, &len);
+        int n = 0;
+        if (len > sb->offset) {
+            len -= sb->offset;
+            n = _write(fd, bytes + sb->offset, (unsigned) (len > INT32_MAX ? INT32_MAX : len));
+            if (n < 0)
+                return -1;
+        }
+        written += n;
+        fenn_segbuffer_consume(sb, n);
+    }
+#else
+    struct iovec iov[FENN_SEGBUFFER_IOV];
+    while (NULL != sb->head) {
+        FennSegment *seg = sb->head;
+        int64_t skip = sb->offset;
+        ssize_t n;
+        int count = 0;
+        // Gather segments from the first one not fully written
+        while (NULL != seg && count < FENN_SEGBUFFER_IOV) {
+            int64_t len;
+            const uint8_t *bytes = fenn_segbuffer_bytes(seg, &len);
+            if (len > skip) {
+                iov[count].iov_base = (void *) (bytes + skip);
+                iov[count].iov_len = (size_t) (len - skip);
+                count++;
+            }
+            skip = 0;
+            seg = seg->next;
+        }
+        if (count == 0)
+            break;
+        n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += n;
+        fenn_segbuffer_consume(sb, n);
+    }
+#endif
+    fenn_segbuffer_clear(sb);
+    return written;
+}
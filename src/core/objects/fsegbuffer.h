@@ -0,0 +1,74 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef SEGBUFFER_H
+#define SEGBUFFER_H
+
+typedef struct FennSegBuffer FennSegBuffer;
+typedef struct FennSegment FennSegment;
+
+/* Segmented buffers collect output in a chain of segments instead of one
+ * block, so appending never copies what was written before. They are
+ * abstract values of type fenn_segbuffer_type. Bytes pushed are copied
+ * into segments the buffer owns, while long strings and buffers can be
+ * spliced in as segments of their own without copying. A spliced buffer
+ * is read when the bytes are written out, so later changes to it show
+ * up. */
+
+/* Size of the segments bytes are copied into */
+#define FENN_SEGBUFFER_SEGMENT 0x10000
+
+/* Shorter strings and buffers are copied rather than spliced */
+#define FENN_SEGBUFFER_SPLICEMIN 256
+
+struct FennSegment {
+    FennSegment *next;
+    FennObject source;  // String or buffer the bytes are spliced from, or nil
+    int64_t start;      // Offset of the bytes in the source
+    int64_t count;
+    int64_t capacity;   // Room in data, 0 for spliced segments
+    uint8_t data[];
+};
+
+struct FennSegBuffer {
+    FennSegment *head;
+    FennSegment *tail;
+    FennSegment *spare; // Emptied segment kept for reuse
+    int64_t offset;     // Bytes of the first segment already written out
+    int64_t count;      // Bytes not yet written out
+    int32_t segments;
+};
+
+extern const FennAbstractType fenn_segbuffer_type;
+
+/* Functions */
+FennSegBuffer *fenn_segbuffer(void);
+void fenn_segbuffer_push_bytes(FennSegBuffer *, const uint8_t *, int64_t);
+void fenn_segbuffer_push_cstring(FennSegBuffer *, const char *);
+void fenn_segbuffer_push_u8(FennSegBuffer *, uint8_t);
+void fenn_segbuffer_splice_string(FennSegBuffer *, const uint8_t *);
+void fenn_segbuffer_splice_buffer(FennSegBuffer *, FennBuffer *, int64_t, int64_t);
+void fenn_segbuffer_clear(FennSegBuffer *);
+void fenn_segbuffer_flatten(FennSegBuffer *, FennBuffer *);
+int64_t fenn_segbuffer_flush(FennSegBuffer *, int);
+
+#endif
@@ -49,7 +49,8 @@ const uint8_t *fenn_string(const uint8_t *buf, int32_t len) {
     head->length = len;
     head->hash = fenn_string_calchash(buf, len);
     uint8_t *data = (uint8_t *)head->data;
-    memcpy(data, buf, len);
+    if (len > 0)
+        memcpy(data, buf, len);
     data[len] = 0;
     return data;
 }
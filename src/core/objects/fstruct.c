@@ -0,0 +1,468 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include <math.h>
+#include "fstruct.h"
+#include "ftrie.h"
+#include "gc.h"
+#include "shapecache.h"
+#include "util.h"
+
+/* Structs small enough to be shaped are built in a scratch area, so only
+ * the struct that is kept is allocated. Structs built while it is in use
+ * are built in the heap. */
+#define FENN_STRUCT_SCRATCH (sizeof(FennStructHead) + 2 * FENN_SHAPE_MAXKEYS * sizeof(FennKV))
+static FENN_THREAD_LOCAL uint64_t fenn_struct_scratch[FENN_STRUCT_SCRATCH / sizeof(uint64_t) + 1];
+static FENN_THREAD_LOCAL int fenn_struct_scratchused;
+
+/* Smallest capacity that keeps a struct of count pairs at most half full */
+static int32_t fenn_struct_capacityof(int32_t count) {
+    int32_t cap = 0;
+    if (count > 0) {
+        cap = 2;
+        while (cap < 2 * count)
+            cap <<= 1;
+    }
+    return cap;
+}
+
+/* Make a transient trie struct, empty or with the pairs of a finished
+ * one, that fenn_struct_put adds at most limit pairs to */
+static FennKV *fenn_struct_newtrie(const FennKV *from, int64_t limit) {
+    FennStructHead *head = fenn_gcalloc(FENN_MEMORY_STRUCT, sizeof(FennStructHead) + sizeof(FennStructTrie));
+    FennStructTrie *trie = fenn_struct_trie(head->data);
+    head->gc.flags |= FENN_MEM_TRIE;
+    head->hash = 0;
+    head->capacity = 0;
+    head->shape = fenn_wrap_nil();
+    trie->owner = fenn_trie_newowner();
+    trie->limit = limit;
+    if (NULL == from) {
+        head->length = 0;
+        trie->root = fenn_trie_wrap(fenn_trie(trie->owner));
+        trie->sum = 0;
+    } else {
+        head->length = fenn_struct_length(from);
+        trie->root = fenn_struct_trie(from)->root;
+        trie->sum = fenn_struct_trie(from)->sum;
+    }
+    return (FennKV *) head->data;
+}
+
+/* Start building a struct with room for count pairs. Larger structs than
+ * can be shaped are built as transients. */
+FennKV *fenn_struct_begin(int32_t count) {
+    int32_t i, cap = fenn_struct_capacityof(count);
+    FennStructHead *head;
+    FennKV *data;
+    if (count > FENN_SHAPE_MAXKEYS)
+        return fenn_struct_newtrie(NULL, cap / 2);
+    if (!fenn_struct_scratchused) {
+        head = (FennStructHead *) fenn_struct_scratch;
+        head->gc.flags = FENN_MEMORY_STRUCT;
+        head->gc.next = NULL;
+        fenn_struct_scratchused = 1;
+    } else {
+        head = fenn_gcalloc(FENN_MEMORY_STRUCT, sizeof(FennStructHead) + (cap * sizeof(FennKV)));
+    }
+    data = (FennKV *) head->data;
+    head->length = 0;
+    head->hash = 0;
+    head->capacity = cap;
+    head->shape = fenn_wrap_nil();
+    for (i = 0; i < cap; i++) {
+        data[i].key = fenn_wrap_nil();
+        data[i].value = fenn_wrap_nil();
+    }
+    return data;
+}
+
+/* Put a pair in a transient, or remove the key if the value is nil. Only
+ * fenn_struct_assoc removes keys, fenn_struct_put ignores nil values. */
+static void fenn_struct_trieput(FennKV *st, FennObject key, FennObject value) {
+    FennStructHead *head = fenn_struct_head(st);
+    FennStructTrie *trie = fenn_struct_trie(st);
+    FennTrieNode *root = fenn_trie_unwrap(trie->root);
+    int32_t hash = fenn_hash(key);
+    FennObject old;
+    if (fenn_checktype(value, FENN_NIL))
+        root = fenn_trie_remove(root, hash, key, trie->owner, &old);
+    else
+        root = fenn_trie_put(root, hash, key, value, trie->owner, &old);
+    if (!fenn_checktype(old, FENN_NIL)) {
+        trie->sum -= fenn_kv_hashpair(key, old);
+        head->length--;
+    }
+    if (!fenn_checktype(value, FENN_NIL)) {
+        trie->sum += fenn_kv_hashpair(key, value);
+        head->length++;
+    }
+    trie->root = fenn_trie_wrap(root);
+    fenn_gc_barrier(&head->gc, trie->root);
+}
+
+/* Keys no struct holds */
+static int fenn_struct_badkey(FennObject key) {
+    return fenn_checktype(key, FENN_NIL) ||
+           (fenn_checktype(key, FENN_NUMBER) && isnan(fenn_unwrap_number(key)));
+}
+
+/* Add a pair to a struct being built. Pairs with a nil key or value, or a
+ * NaN key, are left out. If a key is put twice the last value is kept.
+ * Pairs that do not fit in the room fenn_struct_begin made are dropped,
+ * half the capacity of a flat struct of count pairs, however large the
+ * struct. Transients made by fenn_struct_transient grow as needed. */
+void fenn_struct_put(FennKV *st, FennObject key, FennObject value) {
+    uint32_t mask = (uint32_t) fenn_struct_capacity(st) - 1;
+    uint32_t index;
+    int32_t hash, dist;
+    int moved = 0;
+    if (fenn_struct_badkey(key) || fenn_checktype(value, FENN_NIL))
+        return;
+    if (fenn_struct_istrie(st)) {
+        FennStructTrie *trie = fenn_struct_trie(st);
+        if (fenn_struct_length(st) >= trie->limit &&
+            NULL == fenn_trie_find(fenn_trie_unwrap(trie->root), fenn_hash(key), key))
+            return;
+        fenn_struct_trieput(st, key, value);
+        return;
+    }
+    hash = fenn_hash(key);
+    index = (uint32_t) hash & mask;
+    for (dist = 0;; dist++, index = (index + 1) & mask) {
+        FennKV *kv = st + index;
+        FennKV temp;
+        int32_t otherhash, otherdist;
+        int status;
+        if (fenn_checktype(kv->key, FENN_NIL)) {
+            if (!moved && 2 * fenn_struct_length(st) >= fenn_struct_capacity(st))
+                return;
+            kv->key = key;
+            kv->value = value;
+            fenn_struct_length(st)++;
+            return;
+        }
+        otherhash = fenn_hash(kv->key);
+        otherdist = (int32_t) ((index - (uint32_t) otherhash) & mask);
+        // Pairs nearer their home slot give way, ties are broken by hash and
+        // then by key so the layout does not depend on the order of insertion
+        if (dist != otherdist)
+            status = dist < otherdist ? -1 : 1;
+        else if (hash != otherhash)
+            status = hash < otherhash ? -1 : 1;
+        else
+            status = fenn_compare(key, kv->key);
+        if (status == 0) {
+            kv->value = value;
+            return;
+        }
+        if (status < 0)
+            continue;
+        if (!moved && 2 * fenn_struct_length(st) >= fenn_struct_capacity(st))
+            return;
+        // Take the slot and carry on placing the pair that was in it
+        temp = *kv;
+        kv->key = key;
+        kv->value = value;
+        key = temp.key;
+        value = temp.value;
+        hash = otherhash;
+        dist = otherdist;
+        moved = 1;
+    }
+}
+
+/* Records are shaped, structs whose keys are all keywords */
+static int fenn_struct_shapeable(const FennKV *st) {
+    int32_t i, cap = fenn_struct_capacity(st);
+    if (fenn_struct_length(st) == 0 || fenn_struct_length(st) > FENN_SHAPE_MAXKEYS)
+        return 0;
+    for (i = 0; i < cap; i++) {
+        if (!fenn_checktype(st[i].key, FENN_NIL) && !fenn_checktype(st[i].key, FENN_KEYWORD))
+            return 0;
+    }
+    return 1;
+}
+
+/* Make the shape for the keys of a struct. hash is its hash as given by
+ * fenn_kv_shapehash. */
+static FennKV *fenn_struct_newshape(const FennKV *st, int32_t hash) {
+    int32_t i, n = 0, cap = fenn_struct_capacity(st);
+    FennStructHead *head = fenn_gcalloc(FENN_MEMORY_STRUCT, sizeof(FennStructHead) + (cap * sizeof(FennKV)));
+    FennKV *shape = (FennKV *) head->data;
+    head->length = fenn_struct_length(st);
+    head->hash = hash;
+    head->capacity = cap;
+    head->shape = fenn_wrap_nil();
+    for (i = 0; i < cap; i++) {
+        shape[i].key = st[i].key;
+        shape[i].value = fenn_checktype(st[i].key, FENN_NIL) ? fenn_wrap_nil() : fenn_wrap_number(n++);
+    }
+    return shape;
+}
+
+/* Finish a transient. Ones left with few enough pairs are made flat. */
+static const FennKV *fenn_struct_endtrie(FennKV *st) {
+    FennStructHead *head = fenn_struct_head(st);
+    FennStructTrie *trie = fenn_struct_trie(st);
+    trie->owner = 0;
+    if (head->length <= FENN_SHAPE_MAXKEYS) {
+        FennKV kv;
+        FennKV *flat = fenn_struct_begin(head->length);
+        int32_t i = 0;
+        while (0 != (i = fenn_struct_next(st, i, &kv)))
+            fenn_struct_put(flat, kv.key, kv.value);
+        return fenn_struct_end(flat);
+    }
+    head->hash = fenn_kv_hashfinish(trie->sum, (uint64_t) head->length);
+    return st;
+}
+
+/* Finish building a struct */
+const FennKV *fenn_struct_end(FennKV *st) {
+    FennStructHead *head = fenn_struct_head(st);
+    FennStructHead *result = head;
+    int scratch = head == (FennStructHead *) fenn_struct_scratch;
+    int32_t i, hash, length = head->length;
+    int32_t cap = fenn_struct_capacityof(length);
+    if (head->gc.flags & FENN_MEM_TRIE)
+        return fenn_struct_endtrie(st);
+    if (head->capacity != cap) {
+        // Some pairs were left out, so rebuild at the capacity equal structs
+        // are given
+        FennKV kv;
+        FennKV *newst = fenn_struct_begin(length);
+        i = 0;
+        while (0 != (i = fenn_struct_next(st, i, &kv)))
+            fenn_struct_put(newst, kv.key, kv.value);
+        if (scratch)
+            fenn_struct_scratchused = 0;
+        return fenn_struct_end(newst);
+    }
+    hash = fenn_kv_calchash(st, cap);
+    if (fenn_struct_shapeable(st)) {
+        int32_t shapehash = fenn_kv_shapehash(st, cap);
+        const FennKV *shape = fenn_shapecache_find(st, shapehash);
+        FennObject *values;
+        if (NULL == shape)
+            shape = fenn_shapecache_add(fenn_struct_newshape(st, shapehash));
+        result = fenn_gcalloc(FENN_MEMORY_STRUCT, sizeof(FennStructHead) + (length * sizeof(FennObject)));
+        result->capacity = 0;
+        result->shape = fenn_wrap_struct(shape);
+        values = (FennObject *) result->data;
+        for (i = 0; i < cap; i++) {
+            if (!fenn_checktype(st[i].key, FENN_NIL))
+                *values++ = st[i].value;
+        }
+    } else if (scratch) {
+        size_t size = sizeof(FennStructHead) + (cap * sizeof(FennKV));
+        result = fenn_gcalloc(FENN_MEMORY_STRUCT, size);
+        memcpy((char *) result + sizeof(FennGCObject),
+               (char *) head + sizeof(FennGCObject),
+               size - sizeof(FennGCObject));
+    }
+    if (scratch)
+        fenn_struct_scratchused = 0;
+    result->length = length;
+    result->hash = hash;
+    // Structs too large for the nursery may have been filled with young values
+    if (!(result->gc.flags & (FENN_MEM_YOUNG | FENN_MEM_REMEMBERED)))
+        fenn_gc_remember(&result->gc);
+    return result->data;
+}
+
+/* Start a transient with the pairs of a struct. A transient is built like
+ * any struct, but holds its pairs in a trie whose nodes it changes in
+ * place once it has copied them. The trie of a large struct is shared
+ * until then, so a few changes to it copy only a few nodes. */
+FennKV *fenn_struct_transient(const FennKV *st) {
+    FennKV kv;
+    FennKV *t;
+    int32_t i = 0;
+    if (fenn_struct_istrie(st))
+        return fenn_struct_newtrie(st, INT64_MAX);
+    t = fenn_struct_newtrie(NULL, INT64_MAX);
+    while (0 != (i = fenn_struct_next(st, i, &kv)))
+        fenn_struct_put(t, kv.key, kv.value);
+    return t;
+}
+
+/* Get a struct like st with the value of a key changed, or the key removed
+ * if the value is nil. Large structs share all but about log32(n) nodes
+ * with the result, small ones are copied. */
+const FennKV *fenn_struct_assoc(const FennKV *st, FennObject key, FennObject value) {
+    FennKV kv;
+    FennKV *t;
+    int32_t i = 0;
+    if (fenn_struct_badkey(key) || fenn_u64(fenn_struct_get(st, key)) == fenn_u64(value))
+        return st;
+    if (fenn_struct_istrie(st)) {
+        t = fenn_struct_transient(st);
+        fenn_struct_trieput(t, key, value);
+    } else {
+        // Leaving the key out of the copy removes it
+        t = fenn_struct_begin(fenn_struct_length(st) + 1);
+        while (0 != (i = fenn_struct_next(st, i, &kv))) {
+            if (!fenn_equals(kv.key, key))
+                fenn_struct_put(t, kv.key, kv.value);
+        }
+        fenn_struct_put(t, key, value);
+    }
+    return fenn_struct_end(t);
+}
+
+/* Get a struct like st without a key */
+const FennKV *fenn_struct_dissoc(const FennKV *st, FennObject key) {
+    return fenn_struct_assoc(st, key, fenn_wrap_nil());
+}
+
+/* Find the slot of a key in a struct that is not shaped, or -1 */
+static int32_t fenn_struct_slot(const FennKV *st, FennObject key) {
+    uint32_t mask = (uint32_t) fenn_struct_capacity(st) - 1;
+    uint32_t index;
+    int32_t hash, dist;
+    if (fenn_struct_capacity(st) == 0 || fenn_checktype(key, FENN_NIL))
+        return -1;
+    hash = fenn_hash(key);
+    index = (uint32_t) hash & mask;
+    for (dist = 0;; dist++, index = (index + 1) & mask) {
+        const FennKV *kv = st + index;
+        int32_t otherhash;
+        if (fenn_checktype(kv->key, FENN_NIL))
+            return -1;
+        if (fenn_u64(kv->key) == fenn_u64(key))
+            return (int32_t) index;
+        otherhash = fenn_hash(kv->key);
+        // Past the point where the key would have been placed
+        if ((int32_t) ((index - (uint32_t) otherhash) & mask) < dist)
+            return -1;
+        if (otherhash == hash && fenn_equals(kv->key, key))
+            return (int32_t) index;
+    }
+}
+
+/* Get the position of the value of a key in structs of a shape, or -1 if
+ * the shape has no such key. Lets a field be read from many records of
+ * the same shape with a single lookup. */
+int32_t fenn_shape_index(const FennKV *shape, FennObject key) {
+    int32_t slot = fenn_struct_slot(shape, key);
+    return slot < 0 ? -1 : (int32_t) fenn_unwrap_number(shape[slot].value);
+}
+
+/* Get the value of a key, or nil if there is none */
+FennObject fenn_struct_get(const FennKV *st, FennObject key) {
+    FennObject shape = fenn_struct_shape(st);
+    int32_t i;
+    if (fenn_struct_istrie(st)) {
+        const FennObject *value = fenn_trie_find(fenn_trie_unwrap(fenn_struct_trie(st)->root), fenn_hash(key), key);
+        return NULL == value ? fenn_wrap_nil() : *value;
+    }
+    if (!fenn_checktype(shape, FENN_NIL)) {
+        i = fenn_shape_index(fenn_unwrap_struct(shape), key);
+        return i < 0 ? fenn_wrap_nil() : fenn_struct_values(st)[i];
+    }
+    i = fenn_struct_slot(st, key);
+    return i < 0 ? fenn_wrap_nil() : st[i].value;
+}
+
+/* Get the first pair at or after position i and store it in kv. Returns
+ * the position to continue from, or 0 after the last pair. Iteration
+ * starts at 0 and visits pairs in the same order for equal structs. */
+int32_t fenn_struct_next(const FennKV *st, int32_t i, FennKV *kv) {
+    FennObject shape = fenn_struct_shape(st);
+    const FennKV *slots = fenn_checktype(shape, FENN_NIL) ? st : fenn_unwrap_struct(shape);
+    int32_t cap = fenn_struct_capacity(slots);
+    if (fenn_struct_istrie(st))
+        return fenn_trie_nth(fenn_trie_unwrap(fenn_struct_trie(st)->root), i, kv) ? i + 1 : 0;
+    for (; i < cap; i++) {
+        if (!fenn_checktype(slots[i].key, FENN_NIL)) {
+            kv->key = slots[i].key;
+            kv->value = (slots == st)
+                        ? st[i].value
+                        : fenn_struct_values(st)[(int32_t) fenn_unwrap_number(slots[i].value)];
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* Check if two structs are equal. Equal structs list their pairs in the
+ * same order whether they are shaped or not, and are tries only if both
+ * are too large to be flat. */
+int fenn_struct_equal(const FennKV *lhs, const FennKV *rhs) {
+    int32_t i, j;
+    FennKV l, r;
+    if (lhs == rhs)
+        return 1;
+    if (fenn_struct_length(lhs) != fenn_struct_length(rhs))
+        return 0;
+    if (fenn_struct_hash(lhs) != fenn_struct_hash(rhs))
+        return 0;
+    if (fenn_struct_istrie(lhs))
+        return fenn_trie_equal(fenn_trie_unwrap(fenn_struct_trie(lhs)->root),
+                               fenn_trie_unwrap(fenn_struct_trie(rhs)->root));
+    if (!fenn_checktype(fenn_struct_shape(lhs), FENN_NIL) &&
+        fenn_u64(fenn_struct_shape(lhs)) == fenn_u64(fenn_struct_shape(rhs))) {
+        for (i = 0; i < fenn_struct_length(lhs); i++) {
+            if (!fenn_equals(fenn_struct_values(lhs)[i], fenn_struct_values(rhs)[i]))
+                return 0;
+        }
+        return 1;
+    }
+    i = j = 0;
+    while (0 != (i = fenn_struct_next(lhs, i, &l))) {
+        j = fenn_struct_next(rhs, j, &r);
+        if (!fenn_equals(l.key, r.key) || !fenn_equals(l.value, r.value))
+            return 0;
+    }
+    return 1;
+}
+
+/* Compare structs, first by length and then pair by pair in iteration
+ * order. The order depends on the hash seed but is consistent with
+ * fenn_struct_equal. */
+int fenn_struct_compare(const FennKV *lhs, const FennKV *rhs) {
+    int32_t i, j;
+    int32_t llen = fenn_struct_length(lhs);
+    int32_t rlen = fenn_struct_length(rhs);
+    FennKV l, r;
+    if (lhs == rhs)
+        return 0;
+    if (llen != rlen)
+        return llen < rlen ? -1 : 1;
+    if (fenn_struct_istrie(lhs))
+        return fenn_trie_compare(fenn_trie_unwrap(fenn_struct_trie(lhs)->root),
+                                 fenn_trie_unwrap(fenn_struct_trie(rhs)->root));
+    i = j = 0;
+    while (0 != (i = fenn_struct_next(lhs, i, &l))) {
+        int comp;
+        j = fenn_struct_next(rhs, j, &r);
+        comp = fenn_compare(l.key, r.key);
+        if (comp != 0)
+            return comp;
+        comp = fenn_compare(l.value, r.value);
+        if (comp != 0)
+            return comp;
+    }
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef STRUCT_H
+#define STRUCT_H
+
+typedef struct FennStructHead FennStructHead;
+
+/* Structs are immutable hash tables stored inline after their header.
+ * The capacity is a power of two at least twice the number of pairs, and
+ * empty slots have a nil key. Pairs are placed with Robin Hood hashing and
+ * collisions are ordered by hash and then by key, so equal structs have
+ * the same layout however they were built.
+ *
+ * Structs whose keys are all keywords, like most records, are shaped
+ * instead. Their keys are kept once in a shared shape, a struct mapping
+ * each key to a position, and only the values are stored after the
+ * header, in slot order.
+ *
+ * Structs with more pairs than that are stored as hash tries instead (see
+ * ftrie.h), so they can be changed one pair at a time without being
+ * copied. Their data is a FennStructTrie. */
+struct FennStructHead {
+    FennGCObject gc;
+    int32_t length;
+    int32_t hash;
+    int32_t capacity; // Slots after the header, 0 if shaped
+    FennObject shape; // Shape of a shaped struct, otherwise nil
+    const FennKV data[];
+};
+
+/* Data of a struct stored as a trie */
+typedef struct FennStructTrie {
+    FennObject root; // Root node
+    uint64_t owner;  // Owner of the nodes a transient may change, 0 when done
+    uint64_t sum;    // Sum of the hashes of the pairs
+    int64_t limit;   // Most pairs fenn_struct_put may add while building
+} FennStructTrie;
+
+/* Struct data seen as either layout, so tries are reached through a type
+ * that aliases the pairs */
+typedef union FennStructData {
+    FennKV pair;
+    FennStructTrie trie;
+} FennStructData;
+
+/* Structs with more keys than this are never shaped, and are tries */
+#define FENN_SHAPE_MAXKEYS 32
+
+#define fenn_struct_head(t) ((FennStructHead *)((char *)t - offsetof(FennStructHead, data)))
+#define fenn_struct_length(t) (fenn_struct_head(t)->length)
+#define fenn_struct_hash(t) (fenn_struct_head(t)->hash)
+#define fenn_struct_capacity(t) (fenn_struct_head(t)->capacity)
+#define fenn_struct_shape(t) (fenn_struct_head(t)->shape)
+#define fenn_struct_values(t) ((const FennObject *)(t))
+#define fenn_struct_trie(t) (&((FennStructData *)(t))->trie)
+#define fenn_struct_istrie(t) (fenn_struct_head(t)->gc.flags & FENN_MEM_TRIE)
+
+/* Function declarations */
+FENN_API FennKV *fenn_struct_begin(int32_t);
+FENN_API void fenn_struct_put(FennKV *, FennObject, FennObject);
+FENN_API const FennKV *fenn_struct_end(FennKV *);
+FENN_API FennKV *fenn_struct_transient(const FennKV *);
+FENN_API const FennKV *fenn_struct_assoc(const FennKV *, FennObject, FennObject);
+FENN_API const FennKV *fenn_struct_dissoc(const FennKV *, FennObject);
+FENN_API FennObject fenn_struct_get(const FennKV *, FennObject);
+FENN_API int32_t fenn_struct_next(const FennKV *, int32_t, FennKV *);
+FENN_API int32_t fenn_shape_index(const FennKV *, FennObject);
+FENN_API int fenn_struct_equal(const FennKV *, const FennKV *);
+FENN_API int fenn_struct_compare(const FennKV *, const FennKV *);
+
+#endif
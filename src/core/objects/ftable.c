@@ -0,0 +1,357 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include <math.h>
+#include "ftable.h"
+
+#include "gc.h"
+#include "util.h"
+#include "fstruct.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#define FENN_TABLE_SSE2
+#include <emmintrin.h>
+#endif
+
+/* Bit i is set for every slot i of a group that matches */
+typedef uint32_t FennTableMask;
+
+#define fenn_table_tag(hash) ((uint8_t) ((uint32_t) (hash) & 0x7F))
+#define fenn_table_group(hash) ((uint32_t) (hash) >> 7)
+
+/* Slots of a group with the given control byte */
+static FennTableMask fenn_table_match(const uint8_t *group, uint8_t ctrl) {
+#ifdef FENN_TABLE_SSE2
+    __m128i bytes = _mm_loadu_si128((const __m128i *) group);
+    return (FennTableMask) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char) ctrl)));
+#else
+    FennTableMask mask = 0;
+    int i;
+    for (i = 0; i < FENN_TABLE_GROUP; i++)
+        mask |= (FennTableMask) (group[i] == ctrl) << i;
+    return mask;
+#endif
+}
+
+/* Slots of a group that are empty or deleted, the only control bytes with
+ * the high bit set */
+static FennTableMask fenn_table_matchfree(const uint8_t *group) {
+#ifdef FENN_TABLE_SSE2
+    return (FennTableMask) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+#else
+    FennTableMask mask = 0;
+    int i;
+    for (i = 0; i < FENN_TABLE_GROUP; i++)
+        mask |= (FennTableMask) (group[i] >> 7) << i;
+    return mask;
+#endif
+}
+
+/* Number of slots needed to hold count pairs at most 7/8 full */
+static int32_t fenn_table_capacityof(int32_t count) {
+    int32_t cap = FENN_TABLE_GROUP;
+    if (count <= 0)
+        return 0;
+    while (cap - (cap >> 3) < count)
+        cap <<= 1;
+    return cap;
+}
+
+/* Give a table empty slots */
+static void fenn_table_alloc(FennTable *t, int32_t capacity) {
+    uint8_t *ctrl = NULL;
+    FennKV *data = NULL;
+    if (capacity > 0) {
+        // Control bytes first, the slots after them stay aligned as the
+        // capacity is a multiple of the group size
+        ctrl = malloc(capacity + capacity * sizeof(FennKV));
+        if (NULL == ctrl) {
+            // TODO: Handle Out Of Memory
+        }
+        memset(ctrl, FENN_TABLE_EMPTY, capacity);
+        data = (FennKV *) (ctrl + capacity);
+    }
+    t->capacity = capacity;
+    t->deleted = 0;
+    t->ctrl = ctrl;
+    t->data = data;
+}
+
+/* Find a free slot for a key that is not in the table. The table must
+ * have at least one empty slot. */
+static FennKV *fenn_table_slot(FennTable *t, int32_t hash) {
+    uint32_t gmask = ((uint32_t) t->capacity / FENN_TABLE_GROUP) - 1;
+    uint32_t g = fenn_table_group(hash) & gmask;
+    uint32_t step;
+    for (step = 1;; step++) {
+        uint8_t *group = t->ctrl + g * FENN_TABLE_GROUP;
+        FennTableMask avail = fenn_table_matchfree(group);
+        if (avail) {
+            int32_t i = (int32_t) (g * FENN_TABLE_GROUP) + __builtin_ctz(avail);
+            if (t->ctrl[i] == FENN_TABLE_DELETED)
+                t->deleted--;
+            t->ctrl[i] = fenn_table_tag(hash);
+            return t->data + i;
+        }
+        g = (g + step) & gmask;
+    }
+}
+
+/* Move every pair into new slots, dropping the deleted ones */
+static void fenn_table_rehash(FennTable *t, int32_t capacity) {
+    uint8_t *oldctrl = t->ctrl;
+    FennKV *olddata = t->data;
+    int32_t i, oldcapacity = t->capacity;
+    fenn_table_alloc(t, capacity);
+    for (i = 0; i < oldcapacity; i++) {
+        if (!(oldctrl[i] & FENN_TABLE_EMPTY)) {
+            // Keys cache their hash or are cheap to hash again
+            FennKV *kv = fenn_table_slot(t, fenn_hash(olddata[i].key));
+            *kv = olddata[i];
+        }
+    }
+    free(oldctrl);
+}
+
+/* Initialize a table with room for capacity pairs */
+FennTable *fenn_table_init(FennTable *t, int32_t capacity) {
+    t->count = 0;
+    t->shape = fenn_wrap_nil();
+    t->values = NULL;
+    fenn_table_alloc(t, fenn_table_capacityof(capacity));
+    return t;
+}
+
+/* Deinitialize a table (free slot memory) */
+void fenn_table_deinit(FennTable *t) {
+    free(t->ctrl);
+    free(t->values);
+}
+
+/* Create a new table with room for capacity pairs */
+FennTable *fenn_table(int32_t capacity) {
+    FennTable *t = fenn_gcalloc(FENN_MEMORY_TABLE, sizeof(FennTable));
+    return fenn_table_init(t, capacity);
+}
+
+/* Create a new table with the pairs of a struct. A shaped struct gives
+ * the table its shape. */
+FennTable *fenn_table_from_struct(const FennKV *st) {
+    FennTable *t;
+    FennKV kv;
+    int32_t i = 0;
+    if (fenn_checktype(fenn_struct_shape(st), FENN_NIL)) {
+        t = fenn_table(fenn_struct_length(st));
+        while (0 != (i = fenn_struct_next(st, i, &kv)))
+            fenn_table_put(t, kv.key, kv.value);
+        return t;
+    }
+    t = fenn_table(0);
+    t->count = fenn_struct_length(st);
+    t->shape = fenn_struct_shape(st);
+    t->values = malloc(t->count * sizeof(FennObject));
+    if (NULL == t->values) {
+        // TODO: Handle Out Of Memory
+    }
+    memcpy(t->values, fenn_struct_values(st), t->count * sizeof(FennObject));
+    if (!(t->gc.flags & (FENN_MEM_YOUNG | FENN_MEM_REMEMBERED)))
+        fenn_gc_remember(&t->gc);
+    return t;
+}
+
+/* Move the pairs of a shaped table into hashed slots */
+static void fenn_table_unshape(FennTable *t) {
+    const FennKV *shape = fenn_unwrap_struct(t->shape);
+    FennObject *values = t->values;
+    int32_t i, cap = fenn_struct_capacity(shape);
+    t->shape = fenn_wrap_nil();
+    t->values = NULL;
+    fenn_table_alloc(t, fenn_table_capacityof(t->count + 1));
+    for (i = 0; i < cap; i++) {
+        if (!fenn_checktype(shape[i].key, FENN_NIL)) {
+            FennKV *kv = fenn_table_slot(t, fenn_hash(shape[i].key));
+            kv->key = shape[i].key;
+            kv->value = values[(int32_t) fenn_unwrap_number(shape[i].value)];
+        }
+    }
+    free(values);
+}
+
+/* Find the slot of a key with a known hash, or NULL if it is not in the
+ * table. A probe can stop at the first group with an empty slot, as a
+ * key is only ever placed past a group that had no free slot. */
+static FennKV *fenn_table_lookup(FennTable *t, FennObject key, int32_t hash) {
+    uint32_t gmask, g, step;
+    uint8_t tag = fenn_table_tag(hash);
+    if (t->capacity == 0)
+        return NULL;
+    gmask = ((uint32_t) t->capacity / FENN_TABLE_GROUP) - 1;
+    g = fenn_table_group(hash) & gmask;
+    for (step = 1;; step++) {
+        const uint8_t *group = t->ctrl + g * FENN_TABLE_GROUP;
+        FennKV *data = t->data + g * FENN_TABLE_GROUP;
+        FennTableMask match = fenn_table_match(group, tag);
+        while (match) {
+            FennKV *kv = data + __builtin_ctz(match);
+            if (fenn_u64(kv->key) == fenn_u64(key) || fenn_equals(kv->key, key))
+                return kv;
+            match &= match - 1;
+        }
+        if (fenn_table_match(group, FENN_TABLE_EMPTY))
+            return NULL;
+        g = (g + step) & gmask;
+    }
+}
+
+/* Get the value of a key, or nil if there is none */
+FennObject fenn_table_get(FennTable *t, FennObject key) {
+    FennKV *kv;
+    if (!fenn_checktype(t->shape, FENN_NIL)) {
+        int32_t i = fenn_shape_index(fenn_unwrap_struct(t->shape), key);
+        return i < 0 ? fenn_wrap_nil() : t->values[i];
+    }
+    if (t->count == 0)
+        return fenn_wrap_nil();
+    kv = fenn_table_lookup(t, key, fenn_hash(key));
+    return NULL == kv ? fenn_wrap_nil() : kv->value;
+}
+
+/* Set the value of a key. Putting nil removes the key. Nil and NaN keys
+ * are ignored. */
+void fenn_table_put(FennTable *t, FennObject key, FennObject value) {
+    FennKV *kv;
+    int32_t hash;
+    if (fenn_checktype(key, FENN_NIL))
+        return;
+    if (fenn_checktype(key, FENN_NUMBER) && isnan(fenn_unwrap_number(key)))
+        return;
+    if (fenn_checktype(value, FENN_NIL)) {
+        fenn_table_remove(t, key);
+        return;
+    }
+    if (!fenn_checktype(t->shape, FENN_NIL)) {
+        int32_t i = fenn_shape_index(fenn_unwrap_struct(t->shape), key);
+        if (i >= 0) {
+            t->values[i] = value;
+            fenn_gc_barrier(&t->gc, value);
+            return;
+        }
+        fenn_table_unshape(t);
+    }
+    hash = fenn_hash(key);
+    kv = fenn_table_lookup(t, key, hash);
+    if (NULL == kv) {
+        int32_t used = t->count + t->deleted + 1;
+        if (used > t->capacity - (t->capacity >> 3)) {
+            // Grow if the table is more than half live pairs, otherwise
+            // the deleted slots are worth reclaiming in place
+            int32_t cap = t->capacity;
+            if (cap == 0)
+                cap = FENN_TABLE_GROUP;
+            else if (t->count + 1 > cap >> 1)
+                cap <<= 1;
+            fenn_table_rehash(t, cap);
+        }
+        kv = fenn_table_slot(t, hash);
+        kv->key = key;
+        t->count++;
+        fenn_gc_barrier(&t->gc, key);
+    }
+    kv->value = value;
+    fenn_gc_barrier(&t->gc, value);
+}
+
+/* Remove a key from a table. Returns the value it had, or nil */
+FennObject fenn_table_remove(FennTable *t, FennObject key) {
+    FennKV *kv;
+    FennObject ret;
+    int32_t i;
+    if (!fenn_checktype(t->shape, FENN_NIL)) {
+        if (fenn_shape_index(fenn_unwrap_struct(t->shape), key) < 0)
+            return fenn_wrap_nil();
+        fenn_table_unshape(t);
+    }
+    if (t->count == 0)
+        return fenn_wrap_nil();
+    kv = fenn_table_lookup(t, key, fenn_hash(key));
+    if (NULL == kv)
+        return fenn_wrap_nil();
+    ret = kv->value;
+    i = (int32_t) (kv - t->data);
+    // A probe that reached this group stopped here if the group has an
+    // empty slot, so the slot can be emptied rather than marked deleted
+    if (fenn_table_match(t->ctrl + (i & ~(FENN_TABLE_GROUP - 1)), FENN_TABLE_EMPTY)) {
+        t->ctrl[i] = FENN_TABLE_EMPTY;
+    } else {
+        t->ctrl[i] = FENN_TABLE_DELETED;
+        t->deleted++;
+    }
+    t->count--;
+    return ret;
+}
+
+/* Remove every pair from a table, keeping its slots */
+void fenn_table_clear(FennTable *t) {
+    if (!fenn_checktype(t->shape, FENN_NIL)) {
+        free(t->values);
+        t->shape = fenn_wrap_nil();
+        t->values = NULL;
+    }
+    if (t->capacity > 0)
+        memset(t->ctrl, FENN_TABLE_EMPTY, t->capacity);
+    t->count = 0;
+    t->deleted = 0;
+}
+
+/* Get the first pair at or after position i and store it in kv. Returns
+ * the position to continue from, or 0 after the last pair. */
+int32_t fenn_table_next(FennTable *t, int32_t i, FennKV *kv) {
+    if (!fenn_checktype(t->shape, FENN_NIL)) {
+        const FennKV *shape = fenn_unwrap_struct(t->shape);
+        for (; i < fenn_struct_capacity(shape); i++) {
+            if (!fenn_checktype(shape[i].key, FENN_NIL)) {
+                kv->key = shape[i].key;
+                kv->value = t->values[(int32_t) fenn_unwrap_number(shape[i].value)];
+                return i + 1;
+            }
+        }
+        return 0;
+    }
+    for (; i < t->capacity; i++) {
+        if (!(t->ctrl[i] & FENN_TABLE_EMPTY)) {
+            *kv = t->data[i];
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* Make a struct with the pairs of a table */
+const FennKV *fenn_table_to_struct(FennTable *t) {
+    FennKV *st = fenn_struct_begin(t->count);
+    FennKV kv;
+    int32_t i = 0;
+    while (0 != (i = fenn_table_next(t, i, &kv)))
+        fenn_struct_put(st, kv.key, kv.value);
+    return fenn_struct_end(st);
+}
@@ -0,0 +1,63 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef TABLE_H
+#define TABLE_H
+
+typedef struct FennTable FennTable;
+
+/* Tables are mutable hash tables. Slots are split into groups of 16, and a
+ * control byte per slot holds either the low 7 bits of the hash of its
+ * key, or marks the slot as empty or deleted. A lookup checks the control
+ * bytes of a whole group at once and only compares keys whose tag matches.
+ *
+ * A table made from a shaped struct shares its shape and only stores the
+ * values. It keeps the shape while values of its keys are changed, and
+ * moves to hashed slots once a key is added or removed. */
+#define FENN_TABLE_GROUP 16
+#define FENN_TABLE_EMPTY 0x80
+#define FENN_TABLE_DELETED 0xFE
+
+struct FennTable {
+    FennGCObject gc;
+    int32_t count;      // Number of pairs
+    int32_t capacity;   // Number of slots, 0 or a power of two of at least a group
+    int32_t deleted;    // Slots marked deleted
+    uint8_t *ctrl;      // Control byte of every slot
+    FennKV *data;       // Slots, only those with a tag in ctrl are in use
+    FennObject shape;   // Shape of a shaped table, otherwise nil
+    FennObject *values; // Values of a shaped table, in the order of its shape
+};
+
+/* Functions */
+FennTable *fenn_table_init(FennTable *, int32_t);
+void fenn_table_deinit(FennTable *);
+FennTable *fenn_table(int32_t);
+FennTable *fenn_table_from_struct(const FennKV *);
+FennObject fenn_table_get(FennTable *, FennObject);
+void fenn_table_put(FennTable *, FennObject, FennObject);
+FennObject fenn_table_remove(FennTable *, FennObject);
+void fenn_table_clear(FennTable *);
+int32_t fenn_table_next(FennTable *, int32_t, FennKV *);
+const FennKV *fenn_table_to_struct(FennTable *);
+
+#endif
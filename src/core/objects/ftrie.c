@@ -0,0 +1,370 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include "ftrie.h"
+
+#include "gc.h"
+#include "util.h"
+#include "fstruct.h"
+
+/* The node layout must let child nodes pass for structs */
+typedef char fenn_trie_layout[offsetof(FennTrieNode, slots) == offsetof(FennStructHead, data) ? 1 : -1];
+
+/* Keys that share all their hash bits below this shift collide */
+#define FENN_TRIE_MAXSHIFT 30
+#define FENN_TRIE_BITS 5
+
+#define fenn_trie_bit(hash, shift) ((uint32_t) 1 << (((uint32_t) (hash) >> (shift)) & 0x1F))
+#define fenn_trie_index(map, bit) __builtin_popcount((map) & ((bit) - 1))
+#define fenn_trie_editable(node, owner) ((owner) != 0 && (node)->owner == (owner))
+// Collision nodes have no bitmaps, all their slots are pairs
+#define fenn_trie_pairs(node) (((node)->datamap | (node)->nodemap) ? __builtin_popcount((node)->datamap) : (node)->count)
+#define fenn_trie_keyeq(a, b) (fenn_u64(a) == fenn_u64(b) || fenn_equals((a), (b)))
+
+static FENN_THREAD_LOCAL uint64_t fenn_trie_owners;
+
+/* Get a new owner for the nodes of a transient */
+uint64_t fenn_trie_newowner(void) {
+    return ++fenn_trie_owners;
+}
+
+static FennTrieNode *fenn_trie_alloc(int32_t size, uint64_t owner) {
+    FennTrieNode *node = fenn_gcalloc(FENN_MEMORY_TRIE, sizeof(FennTrieNode) + (size * sizeof(FennObject)));
+    node->count = 0;
+    node->size = size;
+    node->datamap = 0;
+    node->nodemap = 0;
+    node->owner = owner;
+    // Nodes too large for the nursery are filled with young values
+    if (!(node->gc.flags & (FENN_MEM_YOUNG | FENN_MEM_REMEMBERED)))
+        fenn_gc_remember(&node->gc);
+    return node;
+}
+
+/* Make an empty trie */
+FennTrieNode *fenn_trie(uint64_t owner) {
+    return fenn_trie_alloc(0, owner);
+}
+
+/* Copy the header of a node into a new node of size slots */
+static FennTrieNode *fenn_trie_copy(const FennTrieNode *node, int32_t size, uint64_t owner) {
+    FennTrieNode *copy = fenn_trie_alloc(size, owner);
+    copy->count = node->count;
+    copy->datamap = node->datamap;
+    copy->nodemap = node->nodemap;
+    return copy;
+}
+
+/* Set a slot, in place if the node belongs to owner */
+static FennTrieNode *fenn_trie_set(FennTrieNode *node, int32_t i, FennObject x, uint64_t owner) {
+    if (fenn_u64(node->slots[i]) == fenn_u64(x))
+        return node;
+    if (!fenn_trie_editable(node, owner)) {
+        FennTrieNode *copy = fenn_trie_copy(node, node->size, owner);
+        memcpy(copy->slots, node->slots, node->size * sizeof(FennObject));
+        node = copy;
+    }
+    node->slots[i] = x;
+    fenn_gc_barrier(&node->gc, x);
+    return node;
+}
+
+/* Copy a node with a pair inserted at slot i */
+static FennTrieNode *fenn_trie_insertpair(const FennTrieNode *node, int32_t i, FennObject key, FennObject value, uint64_t owner) {
+    FennTrieNode *copy = fenn_trie_copy(node, node->size + 2, owner);
+    memcpy(copy->slots, node->slots, i * sizeof(FennObject));
+    copy->slots[i] = key;
+    copy->slots[i + 1] = value;
+    memcpy(copy->slots + i + 2, node->slots + i, (node->size - i) * sizeof(FennObject));
+    copy->count++;
+    return copy;
+}
+
+/* Copy a node without the pair at slot i */
+static FennTrieNode *fenn_trie_removepair(const FennTrieNode *node, int32_t i, uint64_t owner) {
+    FennTrieNode *copy = fenn_trie_copy(node, node->size - 2, owner);
+    memcpy(copy->slots, node->slots, i * sizeof(FennObject));
+    memcpy(copy->slots + i, node->slots + i + 2, (node->size - i - 2) * sizeof(FennObject));
+    copy->count--;
+    return copy;
+}
+
+/* Copy a node with the pair for bit replaced by a child node */
+static FennTrieNode *fenn_trie_pushdown(const FennTrieNode *node, uint32_t bit, FennTrieNode *child, uint64_t owner) {
+    int32_t d = 2 * fenn_trie_index(node->datamap, bit);
+    int32_t c = 2 * __builtin_popcount(node->datamap) - 2 + fenn_trie_index(node->nodemap, bit);
+    FennTrieNode *copy = fenn_trie_copy(node, node->size - 1, owner);
+    memcpy(copy->slots, node->slots, d * sizeof(FennObject));
+    memcpy(copy->slots + d, node->slots + d + 2, (c - d) * sizeof(FennObject));
+    copy->slots[c] = fenn_trie_wrap(child);
+    memcpy(copy->slots + c + 1, node->slots + c + 2, (node->size - c - 2) * sizeof(FennObject));
+    copy->datamap &= ~bit;
+    copy->nodemap |= bit;
+    return copy;
+}
+
+/* Copy a node with the child node for bit replaced by its only pair */
+static FennTrieNode *fenn_trie_pullup(const FennTrieNode *node, uint32_t bit, FennObject key, FennObject value, uint64_t owner) {
+    int32_t d = 2 * fenn_trie_index(node->datamap, bit);
+    int32_t c = 2 * __builtin_popcount(node->datamap) + fenn_trie_index(node->nodemap, bit);
+    FennTrieNode *copy = fenn_trie_copy(node, node->size + 1, owner);
+    memcpy(copy->slots, node->slots, d * sizeof(FennObject));
+    copy->slots[d] = key;
+    copy->slots[d + 1] = value;
+    memcpy(copy->slots + d + 2, node->slots + d, (c - d) * sizeof(FennObject));
+    memcpy(copy->slots + c + 2, node->slots + c + 1, (node->size - c - 1) * sizeof(FennObject));
+    copy->datamap |= bit;
+    copy->nodemap &= ~bit;
+    return copy;
+}
+
+/* Make the node at shift holding two pairs with different keys */
+static FennTrieNode *fenn_trie_pair(int32_t shift,
+                                    FennObject k1, FennObject v1, int32_t h1,
+                                    FennObject k2, FennObject v2, int32_t h2,
+                                    uint64_t owner) {
+    FennTrieNode *node;
+    uint32_t b1, b2;
+    int first;
+    if (shift > FENN_TRIE_MAXSHIFT) {
+        node = fenn_trie_alloc(4, owner);
+        first = fenn_compare(k1, k2) < 0;
+    } else {
+        b1 = fenn_trie_bit(h1, shift);
+        b2 = fenn_trie_bit(h2, shift);
+        if (b1 == b2) {
+            FennTrieNode *child = fenn_trie_pair(shift + FENN_TRIE_BITS, k1, v1, h1, k2, v2, h2, owner);
+            node = fenn_trie_alloc(1, owner);
+            node->nodemap = b1;
+            node->count = 2;
+            node->slots[0] = fenn_trie_wrap(child);
+            return node;
+        }
+        node = fenn_trie_alloc(4, owner);
+        node->datamap = b1 | b2;
+        first = b1 < b2;
+    }
+    node->count = 2;
+    node->slots[first ? 0 : 2] = k1;
+    node->slots[first ? 1 : 3] = v1;
+    node->slots[first ? 2 : 0] = k2;
+    node->slots[first ? 3 : 1] = v2;
+    return node;
+}
+
+static FennTrieNode *fenn_trie_putat(FennTrieNode *node, int32_t shift, int32_t hash,
+                                     FennObject key, FennObject value, uint64_t owner, FennObject *old) {
+    uint32_t bit;
+    int32_t i;
+    *old = fenn_wrap_nil();
+    if (shift > FENN_TRIE_MAXSHIFT) {
+        for (i = 0; i < 2 * node->count; i += 2) {
+            if (fenn_trie_keyeq(node->slots[i], key)) {
+                *old = node->slots[i + 1];
+                return fenn_trie_set(node, i + 1, value, owner);
+            }
+        }
+        for (i = 0; i < 2 * node->count && fenn_compare(node->slots[i], key) < 0; i += 2);
+        return fenn_trie_insertpair(node, i, key, value, owner);
+    }
+    bit = fenn_trie_bit(hash, shift);
+    if (node->datamap & bit) {
+        FennTrieNode *child, *copy;
+        i = 2 * fenn_trie_index(node->datamap, bit);
+        if (fenn_trie_keyeq(node->slots[i], key)) {
+            *old = node->slots[i + 1];
+            return fenn_trie_set(node, i + 1, value, owner);
+        }
+        child = fenn_trie_pair(shift + FENN_TRIE_BITS,
+                               node->slots[i], node->slots[i + 1], fenn_hash(node->slots[i]),
+                               key, value, hash, owner);
+        copy = fenn_trie_pushdown(node, bit, child, owner);
+        copy->count++;
+        return copy;
+    }
+    if (node->nodemap & bit) {
+        FennTrieNode *child, *newchild;
+        i = 2 * __builtin_popcount(node->datamap) + fenn_trie_index(node->nodemap, bit);
+        child = fenn_trie_unwrap(node->slots[i]);
+        newchild = fenn_trie_putat(child, shift + FENN_TRIE_BITS, hash, key, value, owner, old);
+        // A child changed in place was made by the same transient as its
+        // parent, so the parent can be changed in place too
+        node = fenn_trie_set(node, i, fenn_trie_wrap(newchild), owner);
+        if (fenn_checktype(*old, FENN_NIL))
+            node->count++;
+        return node;
+    }
+    node = fenn_trie_insertpair(node, 2 * fenn_trie_index(node->datamap, bit), key, value, owner);
+    node->datamap |= bit;
+    return node;
+}
+
+/* Set the value of a key, which must not be nil. Returns the new root, and
+ * stores the value the key had, or nil, in old. Nodes belonging to owner
+ * are changed in place, others are copied. */
+FennTrieNode *fenn_trie_put(FennTrieNode *root, int32_t hash, FennObject key, FennObject value,
+                            uint64_t owner, FennObject *old) {
+    return fenn_trie_putat(root, 0, hash, key, value, owner, old);
+}
+
+static FennTrieNode *fenn_trie_removeat(FennTrieNode *node, int32_t shift, int32_t hash,
+                                        FennObject key, uint64_t owner, FennObject *old) {
+    uint32_t bit;
+    int32_t i;
+    *old = fenn_wrap_nil();
+    if (shift > FENN_TRIE_MAXSHIFT) {
+        for (i = 0; i < 2 * node->count; i += 2) {
+            if (fenn_trie_keyeq(node->slots[i], key)) {
+                *old = node->slots[i + 1];
+                return fenn_trie_removepair(node, i, owner);
+            }
+        }
+        return node;
+    }
+    bit = fenn_trie_bit(hash, shift);
+    if (node->datamap & bit) {
+        i = 2 * fenn_trie_index(node->datamap, bit);
+        if (!fenn_trie_keyeq(node->slots[i], key))
+            return node;
+        *old = node->slots[i + 1];
+        node = fenn_trie_removepair(node, i, owner);
+        node->datamap &= ~bit;
+        return node;
+    }
+    if (node->nodemap & bit) {
+        FennTrieNode *child, *newchild;
+        i = 2 * __builtin_popcount(node->datamap) + fenn_trie_index(node->nodemap, bit);
+        child = fenn_trie_unwrap(node->slots[i]);
+        newchild = fenn_trie_removeat(child, shift + FENN_TRIE_BITS, hash, key, owner, old);
+        if (fenn_checktype(*old, FENN_NIL))
+            return node;
+        if (newchild->count == 1) {
+            // The last pair of a child moves up, as if it had never had a
+            // sibling
+            node = fenn_trie_pullup(node, bit, newchild->slots[0], newchild->slots[1], owner);
+        } else {
+            node = fenn_trie_set(node, i, fenn_trie_wrap(newchild), owner);
+        }
+        node->count--;
+        return node;
+    }
+    return node;
+}
+
+/* Remove a key. Returns the new root, and stores the value the key had, or
+ * nil, in old. */
+FennTrieNode *fenn_trie_remove(FennTrieNode *root, int32_t hash, FennObject key,
+                               uint64_t owner, FennObject *old) {
+    return fenn_trie_removeat(root, 0, hash, key, owner, old);
+}
+
+/* Find the value of a key with the given hash, or NULL */
+const FennObject *fenn_trie_find(const FennTrieNode *node, int32_t hash, FennObject key) {
+    int32_t i, shift;
+    for (shift = 0; shift <= FENN_TRIE_MAXSHIFT; shift += FENN_TRIE_BITS) {
+        uint32_t bit = fenn_trie_bit(hash, shift);
+        if (node->datamap & bit) {
+            i = 2 * fenn_trie_index(node->datamap, bit);
+            return fenn_trie_keyeq(node->slots[i], key) ? node->slots + i + 1 : NULL;
+        }
+        if (!(node->nodemap & bit))
+            return NULL;
+        i = 2 * __builtin_popcount(node->datamap) + fenn_trie_index(node->nodemap, bit);
+        node = fenn_trie_unwrap(node->slots[i]);
+    }
+    for (i = 0; i < 2 * node->count; i += 2) {
+        if (fenn_trie_keyeq(node->slots[i], key))
+            return node->slots + i + 1;
+    }
+    return NULL;
+}
+
+/* Get pair i, counting the pairs of a node before those of its children.
+ * Returns 0 if there are not that many pairs. */
+int fenn_trie_nth(const FennTrieNode *node, int32_t i, FennKV *kv) {
+    while (i < node->count) {
+        int32_t j, pairs = fenn_trie_pairs(node);
+        if (i < pairs) {
+            kv->key = node->slots[2 * i];
+            kv->value = node->slots[2 * i + 1];
+            return 1;
+        }
+        i -= pairs;
+        for (j = 2 * pairs;; j++) {
+            const FennTrieNode *child = fenn_trie_unwrap(node->slots[j]);
+            if (i < child->count) {
+                node = child;
+                break;
+            }
+            i -= child->count;
+        }
+    }
+    return 0;
+}
+
+/* Check if two tries hold equal pairs. Equal tries have the same nodes,
+ * and tries derived from one another share most of them. */
+int fenn_trie_equal(const FennTrieNode *lhs, const FennTrieNode *rhs) {
+    int32_t i, pairs;
+    if (lhs == rhs)
+        return 1;
+    if (lhs->count != rhs->count || lhs->size != rhs->size ||
+        lhs->datamap != rhs->datamap || lhs->nodemap != rhs->nodemap)
+        return 0;
+    pairs = 2 * fenn_trie_pairs(lhs);
+    for (i = 0; i < pairs; i++) {
+        if (!fenn_equals(lhs->slots[i], rhs->slots[i]))
+            return 0;
+    }
+    for (; i < lhs->size; i++) {
+        if (!fenn_trie_equal(fenn_trie_unwrap(lhs->slots[i]), fenn_trie_unwrap(rhs->slots[i])))
+            return 0;
+    }
+    return 1;
+}
+
+/* Compare tries node by node. The order depends on the hash seed but is
+ * consistent with fenn_trie_equal. */
+int fenn_trie_compare(const FennTrieNode *lhs, const FennTrieNode *rhs) {
+    int32_t i, pairs;
+    if (lhs == rhs)
+        return 0;
+    if (lhs->count != rhs->count)
+        return lhs->count < rhs->count ? -1 : 1;
+    if (lhs->datamap != rhs->datamap)
+        return lhs->datamap < rhs->datamap ? -1 : 1;
+    if (lhs->nodemap != rhs->nodemap)
+        return lhs->nodemap < rhs->nodemap ? -1 : 1;
+    pairs = 2 * fenn_trie_pairs(lhs);
+    for (i = 0; i < pairs; i++) {
+        int comp = fenn_compare(lhs->slots[i], rhs->slots[i]);
+        if (comp != 0)
+            return comp;
+    }
+    for (; i < lhs->size; i++) {
+        int comp = fenn_trie_compare(fenn_trie_unwrap(lhs->slots[i]), fenn_trie_unwrap(rhs->slots[i]));
+        if (comp != 0)
+            return comp;
+    }
+    return 0;
+}
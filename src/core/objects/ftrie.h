@@ -0,0 +1,64 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef TRIE_H
+#define TRIE_H
+
+typedef struct FennTrieNode FennTrieNode;
+
+/* Structs with more pairs than fit in a shape are stored as hash array
+ * mapped tries, so a struct that differs from another by one pair shares
+ * all but a path of nodes with it. Each node takes 5 bits of the hash of
+ * a key, and holds the pairs whose bits are not shared with another key
+ * below it, then a child node for the bits that are. Keys that still
+ * collide after all 32 bits share a collision node with no bitmaps, kept
+ * ordered by key.
+ *
+ * A node holding a single pair is always merged into its parent, so equal
+ * tries have the same nodes however they were built. Nodes belong to the
+ * transient that made them, if any, which may then change them in place. */
+struct FennTrieNode {
+    FennGCObject gc;
+    int32_t count;      // Pairs in the node and its children
+    int32_t size;       // Number of slots
+    uint32_t datamap;   // Hash bits of the pairs in the node
+    uint32_t nodemap;   // Hash bits of the child nodes
+    uint64_t owner;     // Transient that may change the node, or 0
+    FennObject slots[]; // Keys and values of the pairs, then child nodes
+};
+
+/* Child nodes are kept in slots as struct values, which the collector finds
+ * the node of like any struct */
+#define fenn_trie_wrap(n) fenn_wrap_struct((const FennKV *) (n)->slots)
+#define fenn_trie_unwrap(x) ((FennTrieNode *)((char *) fenn_unwrap_struct(x) - offsetof(FennTrieNode, slots)))
+
+/* Functions */
+uint64_t fenn_trie_newowner(void);
+FennTrieNode *fenn_trie(uint64_t);
+FennTrieNode *fenn_trie_put(FennTrieNode *, int32_t, FennObject, FennObject, uint64_t, FennObject *);
+FennTrieNode *fenn_trie_remove(FennTrieNode *, int32_t, FennObject, uint64_t, FennObject *);
+const FennObject *fenn_trie_find(const FennTrieNode *, int32_t, FennObject);
+int fenn_trie_nth(const FennTrieNode *, int32_t, FennKV *);
+int fenn_trie_equal(const FennTrieNode *, const FennTrieNode *);
+int fenn_trie_compare(const FennTrieNode *, const FennTrieNode *);
+
+#endif
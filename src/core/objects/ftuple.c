@@ -22,20 +22,42 @@
 
 #include <fenn.h>
 #include "ftuple.h"
+#include "gc.h"
+#include "tuplecache.h"
 #include "util.h"
 
 FennObject *fenn_tuple_begin(int32_t length) {
     size_t size = sizeof(FennTupleHead) + (length * sizeof(FennObject));
     FennTupleHead *head = fenn_gcalloc(FENN_MEMORY_TUPLE, size);
-    head->sm_start = -1;
-    head->sm_end = -1;
     head->length = length;
     return (FennObject *)(head->data);
 }
 
+/* Start a tuple with room for a source map, see fenn_tuple_sourcemap */
+FennObject *fenn_tuple_beginmapped(int32_t length) {
+    size_t size = sizeof(FennTupleHead) + (length * sizeof(FennObject)) + sizeof(FennSourceMap);
+    FennTupleHead *head = fenn_gcalloc(FENN_MEMORY_TUPLE, size);
+    head->gc.flags |= FENN_MEM_SOURCEMAP;
+    head->length = length;
+    return (FennObject *)(head->data);
+}
+
+/* Get the source map of a tuple, or NULL if it was not made with one */
+FennSourceMap *fenn_tuple_sourcemap(const FennObject *tuple) {
+    if (!(fenn_tuple_flag(tuple) & FENN_MEM_SOURCEMAP))
+        return NULL;
+    return (FennSourceMap *)(tuple + fenn_tuple_length(tuple));
+}
+
 /* Finish building a tuple */
 const FennObject *fenn_tuple_end(FennObject *tuple) {
+    FennGCObject *gc = &fenn_tuple_head(tuple)->gc;
     fenn_tuple_hash(tuple) = fenn_array_calchash(tuple, fenn_tuple_length(tuple));
+    if (fenn_tuplecache_enabled() && !(gc->flags & FENN_MEM_SOURCEMAP))
+        return fenn_tuplecache_intern(tuple);
+    // Tuples too large for the nursery may have been filled with young values
+    if (!(gc->flags & (FENN_MEM_YOUNG | FENN_MEM_REMEMBERED)))
+        fenn_gc_remember(gc);
     return (const FennObject *)tuple;
 }
 
@@ -53,10 +75,11 @@ int fenn_tuple_equal(const FennObject *lhs, const FennObject *rhs) {
     int32_t rlen = fenn_tuple_length(rhs);
     int32_t lhash = fenn_tuple_hash(lhs);
     int32_t rhash = fenn_tuple_hash(rhs);
-    if (lhash == 0)
-        lhash = fenn_tuple_hash(lhs) = fenn_array_calchash(lhs, llen);
-    if (rhash == 0)
-        rhash = fenn_tuple_hash(rhs) = fenn_array_calchash(rhs, rlen);
+    // Always the case for hash-consed tuples
+    if (lhs == rhs)
+        return 1;
+    // fenn_tuple_end always sets the hash, and tuples in images may not be
+    // written to
     if (lhash != rhash)
         return 0;
     if (llen != rlen)
@@ -74,6 +97,8 @@ int fenn_tuple_compare(const FennObject *lhs, const FennObject *rhs) {
     int32_t llen = fenn_tuple_length(lhs);
     int32_t rlen = fenn_tuple_length(rhs);
     int32_t count = llen < rlen ? llen : rlen;
+    if (lhs == rhs)
+        return 0;
     for (i = 0; i < count; ++i) {
         int comp = fenn_compare(lhs[i], rhs[i]);
         if (comp != 0) return comp;
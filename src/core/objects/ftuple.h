@@ -24,33 +24,33 @@
 #define TUPLE_H
 
 typedef struct FennTupleHead FennTupleHead;
+typedef struct FennSourceMap FennSourceMap;
 
 struct FennTupleHead {
     FennGCObject gc;
     int32_t length;
     int32_t hash;
-    int32_t sm_start;
-    int32_t sm_startline;
-    int32_t sm_startcol;
-    int32_t sm_end;
-    int32_t sm_endline;
-    int32_t sm_endcol;
     const FennObject data[];
 };
 
+/* Where a tuple was read from, as byte offsets into the source. Only tuples
+ * made by the parser carry one, stored after their elements, so other
+ * tuples pay nothing for it. Lines and columns can be found with a
+ * FennLineIndex over the source. */
+struct FennSourceMap {
+    int32_t start;
+    int32_t end;
+};
+
 #define fenn_tuple_head(t) ((FennTupleHead *)((char *)t - offsetof(FennTupleHead, data)))
 #define fenn_tuple_length(t) (fenn_tuple_head(t)->length)
 #define fenn_tuple_hash(t) (fenn_tuple_head(t)->hash)
-#define fenn_tuple_sm_start(t) (fenn_tuple_head(t)->sm_start)
-#define fenn_tuple_sm_startline(t) (fenn_tuple_head(t)->sm_startline)
-#define fenn_tuple_sm_startcol(t) (fenn_tuple_head(t)->sm_startcol)
-#define fenn_tuple_sm_end(t) (fenn_tuple_head(t)->sm_end)
-#define fenn_tuple_sm_endline(t) (fenn_tuple_head(t)->sm_endline)
-#define fenn_tuple_sm_endcol(t) (fenn_tuple_head(t)->sm_endcol)
 #define fenn_tuple_flag(t) (fenn_tuple_head(t)->gc.flags)
 
 /* Function declarations */
 FENN_API FennObject *fenn_tuple_begin(int32_t);
+FENN_API FennObject *fenn_tuple_beginmapped(int32_t);
+FENN_API FennSourceMap *fenn_tuple_sourcemap(const FennObject *);
 FENN_API const FennObject *fenn_tuple_end(FennObject *);
 FENN_API const FennObject *fenn_tuple_n(const FennObject *, int32_t);
 FENN_API int fenn_tuple_equal(const FennObject *, const FennObject *);
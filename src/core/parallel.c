@@ -0,0 +1,307 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include <parser.h>
+#include "gc.h"
+#include "scan.h"
+#include "parallel.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#define FENN_PARALLEL_THREADS
+#endif
+
+/* Bytes fed to a parser between collector steps */
+#define PARSER_PARALLEL_SLICE 0x10000
+
+typedef struct ParserChunk ParserChunk;
+
+/* One part of the input and everything parsed from it */
+struct ParserChunk {
+    const uint8_t *bytes;   // The whole input
+    size_t start;           // Start of this part
+    size_t end;             // End of this part
+    ParserBatch batch;
+    size_t offset;          // Parser position at an error, see chunk_where
+    size_t linestart;
+    int lineno;
+    FennGCHeap heap;        // Objects of a part parsed on another thread
+    int threaded;
+#ifdef FENN_PARALLEL_THREADS
+    pthread_t thread;
+#endif
+};
+
+/* Pre-scan */
+
+/* Skip the string starting at p. Mirrors stringchar: """ opens a long
+ * string closed by the next """, otherwise '\\' escapes the next byte. */
+static const uint8_t *split_string(const uint8_t *p, const uint8_t *end) {
+    const uint8_t *q;
+    if (end - p >= 3 && p[1] == '"' && p[2] == '"') {
+        // The first byte after the opening quotes is never a closing quote
+        q = end - p > 4 ? p + 4 : end;
+        while (NULL != (q = memchr(q, '"', (size_t) (end - q)))) {
+            if (end - q >= 3 && q[1] == '"' && q[2] == '"') {
+                q += 3;
+                break;
+            }
+            q++;
+        }
+        return NULL == q ? end : q;
+    }
+    if (end - p >= 2 && p[1] == '"')
+        return p + 2;
+    q = p + 1;
+    while (q < end) {
+        q = fenn_scan_stringstop(q, end);
+        if (q == end)
+            break;
+        if (*q == '"')
+            return q + 1;
+        if (*q == '\\' && ++q == end)
+            break;
+        q++;
+    }
+    return end;
+}
+
+/* Find up to parts - 1 points, spread evenly, where the input can be split
+ * between top level forms. A split is made after a whitespace byte at the
+ * top level, where no reader macro or '@' is waiting for its form. Fills
+ * splits with the offset of every part and returns the number of parts. */
+size_t parser_split(const uint8_t *bytes, size_t len, size_t parts, size_t *splits) {
+    const uint8_t *p = bytes, *end = bytes + len;
+    const uint8_t *target;
+    long depth = 0;
+    int waiting = 0;
+    size_t n = 1;
+    splits[0] = 0;
+    if (parts < 2)
+        return 1;
+    target = bytes + len / parts;
+    while (p < end) {
+        uint8_t c = *p++;
+        switch (c) {
+            case '"':
+                p = split_string(p - 1, end);
+                waiting = 0;
+                break;
+            case '#':
+                p = memchr(p, '\n', (size_t) (end - p));
+                if (NULL == p) p = end;
+                break;
+            case '(':
+            case '[':
+            case '{':
+                depth++;
+                waiting = 0;
+                break;
+            case ')':
+            case ']':
+            case '}':
+                // Unbalanced input, leave the error to a single parser
+                if (--depth < 0)
+                    return n;
+                break;
+            case '\'':
+            case ',':
+            case ';':
+            case '`':
+            case '@':
+                waiting = 1;
+                break;
+            default:
+                if (!(char_class[c] & CC_WHITESPACE)) {
+                    while (p < end && (char_class[*p] & CC_SYMBOL))
+                        p++;
+                    waiting = 0;
+                    break;
+                }
+                if (depth == 0 && !waiting && p >= target && p < end) {
+                    splits[n] = (size_t) (p - bytes);
+                    if (++n == parts)
+                        return n;
+                    target = bytes + len / parts * n;
+                }
+                break;
+        }
+    }
+    return n;
+}
+
+/* Batches */
+
+static void batch_init(ParserBatch *batch) {
+    batch->forms = NULL;
+    batch->count = 0;
+    batch->cap = 0;
+    batch->clean = 0;
+    batch->error = NULL;
+    batch->lineno = 0;
+    batch->colno = 0;
+    fenn_gc_addrootset(&batch->forms, &batch->count, &batch->clean);
+}
+
+static void batch_push(ParserBatch *batch, const FennObject *forms, size_t n) {
+    size_t newcount = batch->count + n;
+    if (newcount > batch->cap) {
+        FennObject *next;
+        size_t newcap = 2 * newcount;
+        next = realloc(batch->forms, sizeof(FennObject) * newcap);
+        if (NULL == next) {
+            // TODO: Handle Out Of Memory error
+        }
+        batch->forms = next;
+        batch->cap = newcap;
+    }
+    memcpy(batch->forms + batch->count, forms, sizeof(FennObject) * n);
+    batch->count = newcount;
+}
+
+void parser_batch_destroy(ParserBatch *batch) {
+    fenn_gc_removerootset(&batch->forms);
+    free(batch->forms);
+    batch->forms = NULL;
+    batch->count = 0;
+    batch->cap = 0;
+}
+
+/* Parsing */
+
+/* Parse a part of the input into its batch on the current thread */
+static void chunk_parse(ParserChunk *chunk) {
+    const uint8_t *p = chunk->bytes + chunk->start;
+    const uint8_t *end = chunk->bytes + chunk->end;
+    FennObject forms[64];
+    Parser parser;
+    size_t n;
+    batch_init(&chunk->batch);
+    parser_init(&parser);
+    parser.offset = chunk->start;
+    parser.linestart = chunk->start;
+    while (p < end && !parser.error) {
+        size_t len = (size_t) (end - p);
+        p += parser_consume_bytes(&parser, p, len < PARSER_PARALLEL_SLICE ? len : PARSER_PARALLEL_SLICE);
+        while ((n = parser_produce_many(&parser, forms, 64)))
+            batch_push(&chunk->batch, forms, n);
+        fenn_maybe_collect();
+    }
+    if (!parser.error)
+        parser_eof(&parser);
+    while ((n = parser_produce_many(&parser, forms, 64)))
+        batch_push(&chunk->batch, forms, n);
+    if (parser.error) {
+        chunk->batch.error = parser.error;
+        chunk->offset = parser.offset;
+        chunk->linestart = parser.linestart;
+        chunk->lineno = parser.lineno;
+    }
+    parser_destroy(&parser);
+}
+
+/* Position of the error in a part. Its parser only counted the lines from
+ * the start of the part, the ones before are only counted when needed. */
+static void chunk_where(ParserChunk *chunk, int *line, int *col) {
+    const uint8_t *nl = NULL;
+    size_t linestart = chunk->linestart;
+    int before = (int) fenn_scan_newlines(chunk->bytes, chunk->bytes + chunk->start, &nl);
+    // The line the part starts in began before it
+    if (chunk->lineno == 1)
+        linestart = NULL != nl ? (size_t) (nl + 1 - chunk->bytes) : 0;
+    *line = before + chunk->lineno;
+    *col = 1 + (int) (chunk->offset - linestart);
+}
+
+#ifdef FENN_PARALLEL_THREADS
+/* Worker threads parse into a heap of their own and detach it */
+static void *chunk_thread(void *arg) {
+    ParserChunk *chunk = arg;
+    fenn_init();
+    chunk_parse(chunk);
+    fenn_gc_detach(&chunk->heap);
+    fenn_gc_removerootset(&chunk->batch.forms);
+    fenn_deinit();
+    return NULL;
+}
+#endif
+
+int parser_parse_parallel(ParserBatch *batch, const uint8_t *bytes, size_t len, int threads) {
+    size_t parts = threads > 1 && len >= PARSER_PARALLEL_MIN ? (size_t) threads : 1;
+    size_t *splits;
+    ParserChunk *chunks;
+    size_t i, n;
+#ifndef FENN_PARALLEL_THREADS
+    parts = 1;
+#endif
+    batch_init(batch);
+    splits = malloc(sizeof(size_t) * parts);
+    chunks = calloc(parts, sizeof(ParserChunk));
+    if (NULL == splits || NULL == chunks) {
+        // TODO: Handle Out Of Memory error
+        free(splits);
+        free(chunks);
+        batch->error = "out of memory";
+        return 1;
+    }
+    n = parser_split(bytes, len, parts, splits);
+    for (i = 0; i < n; i++) {
+        chunks[i].bytes = bytes;
+        chunks[i].start = splits[i];
+        chunks[i].end = i + 1 < n ? splits[i + 1] : len;
+    }
+
+    // The first part is parsed here while the workers parse the rest
+#ifdef FENN_PARALLEL_THREADS
+    for (i = 1; i < n; i++)
+        chunks[i].threaded = !pthread_create(&chunks[i].thread, NULL, chunk_thread, chunks + i);
+#endif
+    chunk_parse(chunks);
+
+    // Merge in source order. Forms after the first error are dropped
+    for (i = 0; i < n; i++) {
+        ParserChunk *chunk = chunks + i;
+#ifdef FENN_PARALLEL_THREADS
+        if (chunk->threaded) {
+            pthread_join(chunk->thread, NULL);
+            fenn_gc_attach(&chunk->heap, chunk->batch.forms, chunk->batch.count);
+        }
+#endif
+        if (i > 0 && !chunk->threaded)
+            chunk_parse(chunk);
+        if (NULL == batch->error) {
+            batch_push(batch, chunk->batch.forms, chunk->batch.count);
+            batch->error = chunk->batch.error;
+            if (NULL != batch->error)
+                chunk_where(chunk, &batch->lineno, &batch->colno);
+        }
+        if (chunk->threaded) {
+            free(chunk->batch.forms);
+        } else {
+            parser_batch_destroy(&chunk->batch);
+        }
+    }
+    free(splits);
+    free(chunks);
+    return NULL != batch->error;
+}
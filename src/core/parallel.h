@@ -0,0 +1,55 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/* Parallel front end for the parser. A quick pre-scan that knows about
+ * brackets, strings and comments splits the input between top level forms,
+ * each part is parsed on its own thread with its own heap, and the heaps
+ * and forms are then merged back into the calling thread in source order. */
+
+/* Inputs smaller than this are not worth splitting */
+#define PARSER_PARALLEL_MIN 0x40000
+
+/* Top level forms parsed from a whole input */
+typedef struct ParserBatch ParserBatch;
+
+struct ParserBatch {
+    FennObject *forms;   // Forms in source order, rooted until destroyed
+    size_t count;
+    size_t cap;
+    size_t clean;        // See FennGCRootSet
+    const char *error;   // NULL if the whole input was parsed
+    int lineno;          // Position of the error
+    int colno;
+};
+
+size_t parser_split(const uint8_t *, size_t, size_t, size_t *);
+
+/* Parse bytes on up to threads threads. Returns 0 on success and 1 on a
+ * parse error, in which case the batch holds the forms before the error.
+ * The batch is a root set, it must not be moved until it is destroyed. */
+int parser_parse_parallel(ParserBatch *, const uint8_t *, size_t, int);
+void parser_batch_destroy(ParserBatch *);
+
+#endif
@@ -22,47 +22,48 @@
 
 #include <fenn.h>
 #include <parser.h>
+#include "gc.h"
+#include "scan.h"
+#include "symcache.h"
 #include "objects/fstring.h"
+#include "objects/farray.h"
+#include "objects/fstruct.h"
+#include "objects/ftable.h"
 #include "objects/ftuple.h"
 #include "objects/fbuffer.h"
 
 /* First we have the utility functions to check the types of characters */
 
+/* Character classes, see the CC_ flags in parser.h. Whitespace is
+ * ' ', '\t', '\n', '\r', '\0', '\v' and '\f'. Symbols may use letters,
+ * digits, any byte with the high bit set and "!$%&*+-./:<?=>@^_|". */
+const uint8_t char_class[256] = {
+    1, 0, 0, 0, 0, 0, 0, 0, 0, 1, 5, 1, 1, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 2, 4, 0, 2, 2, 2, 0, 0, 0, 2, 2, 0, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 4, 0, 2, 2,
+    0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 2, 0, 0, 0,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2
+};
+
 /* Checks if a character is whitespace - whitespace is ignored */
 int is_whitespace(uint8_t c) {
-    return (c == ' '
-            || c == '\t'
-            || c == '\n'
-            || c == '\r'
-            || c == '\0'
-            || c == '\v'
-            || c == '\f');
+    return char_class[c] & CC_WHITESPACE;
 }
 
 /* These characters can be used in symbols/identifiers */
 int is_symbol_char(uint8_t c) {
-    if (c & 0x80) return 1;
-    if (c >= 'a' && c <= 'z') return 1;
-    if (c >= 'A' && c <= 'Z') return 1;
-    if (c >= '0' && c <= '9') return 1;
-    return (c == '!' ||
-            c == '$' ||
-            c == '%' ||
-            c == '&' ||
-            c == '*' ||
-            c == '+' ||
-            c == '-' ||
-            c == '.' ||
-            c == '/' ||
-            c == ':' ||
-            c == '<' ||
-            c == '?' ||
-            c == '=' ||
-            c == '>' ||
-            c == '@' ||
-            c == '^' ||
-            c == '_' ||
-            c == '|');
+    return char_class[c] & CC_SYMBOL;
 }
 
 /* Get hex digit from a letter */
@@ -106,8 +107,6 @@ void pushstate(Parser *p, Consumer consumer, int flags) {
     s.flags = flags;
     s.consumer = consumer;
     s.start = p->offset;
-    s.startline = p->lineno;
-    s.startcol = p->colno;
 
     // Push the state
     size_t oldcount = p->statecount;
@@ -126,43 +125,41 @@ void pushstate(Parser *p, Consumer consumer, int flags) {
     p->statecount = newcount;
 }
 
+/* Start a tuple, with room for its source map if they are kept */
+static FennObject *begintuple(Parser *p, int32_t length) {
+    return p->sourcemaps ? fenn_tuple_beginmapped(length) : fenn_tuple_begin(length);
+}
+
+/* Record where a tuple that was started in state ends */
+static void setsourcemap(Parser *p, const FennObject *tuple, const ParseState *state) {
+    FennSourceMap *map = fenn_tuple_sourcemap(tuple);
+    if (NULL == map)
+        return;
+    map->start = (int32_t) state->start;
+    map->end = (int32_t) p->offset;
+}
+
 void popstate(Parser *p, FennObject value) {
     for (;;) {
-        ParseState top = p->states[--p->statecount];
-        ParseState *newtop = p->states + p->statecount - 1;
+        ParseState *newtop = p->states + --p->statecount - 1;
         if (newtop->flags & FLAG_CONTAINER) {
-            /* Source mapping info */
-            if (fenn_checktype(value, FENN_TUPLE)) {
-                fenn_tuple_sm_start(fenn_unwrap_tuple(value)) = (int32_t) top.start;
-                fenn_tuple_sm_startline(fenn_unwrap_tuple(value)) = top.startline;
-                fenn_tuple_sm_startcol(fenn_unwrap_tuple(value)) = top.startcol;
-                fenn_tuple_sm_end(fenn_unwrap_tuple(value)) = (int32_t) p->offset;
-                fenn_tuple_sm_endline(fenn_unwrap_tuple(value)) = p->lineno;
-                fenn_tuple_sm_endcol(fenn_unwrap_tuple(value)) = p->colno;
-            }
             newtop->argn++;
             /* Keep track of number of values in the root state */
             if (p->statecount == 1) p->pending++;
             pushvalue(p, value);
             return;
         } else if (newtop->flags & FLAG_READERMAC) {
-            FennObject *t = fenn_tuple_begin(2);
+            FennObject *t = begintuple(p, 2);
             int c = newtop->flags & 0xFF;
             const char *which =
                     (c == '\'') ? "quote" :
                     (c == ',') ? "unquote" :
                     (c == ';') ? "splice" :
-                    (c == '~') ? "quasiquote" : "<unknown>";
-            // TODO: Lookup symbol from which
-            t[0] = (FennObject)NULL;
+                    (c == '`') ? "quasiquote" : "<unknown>";
+            t[0] = fenn_csymbolv(which);
             t[1] = value;
             /* Quote source mapping info */
-            fenn_tuple_sm_start(t) = (int32_t) newtop->start;
-            fenn_tuple_sm_startline(t) = top.startline;
-            fenn_tuple_sm_startcol(t) = top.startcol;
-            fenn_tuple_sm_end(t) = (int32_t) p->offset;
-            fenn_tuple_sm_endline(t) = p->lineno;
-            fenn_tuple_sm_endcol(t) = p->colno;
+            setsourcemap(p, t, newtop);
             value = fenn_wrap_tuple(fenn_tuple_end(t));
         } else {
             return;
@@ -188,10 +185,46 @@ void pushbuffer(Parser *p, uint8_t x) {
     p->buffercount = newcount;
 }
 
+/* Push a run of characters onto the end of the buffer */
+void pushbytes(Parser *p, const uint8_t *bytes, size_t n) {
+    size_t newcount = p->buffercount + n;
+    if (newcount > p->buffercap) {
+        uint8_t *next;
+        size_t newcap = 2 * newcount;
+        next = realloc(p->buffer, sizeof(uint8_t) * newcap);
+        if (NULL == next) {
+            // TODO: Handle Out of Memory error
+        }
+        p->buffer = next;
+        p->buffercap = newcap;
+    }
+    memcpy(p->buffer + p->buffercount, bytes, n);
+    p->buffercount = newcount;
+}
+
+/* Shrink the value stack to count values. Slots at or above count will be
+ * reused for new values, so they must be scanned by the next minor
+ * collection again. */
+static void truncatevalues(Parser *p, size_t count) {
+    p->valuecount = count;
+    if (p->valueclean > count)
+        p->valueclean = count;
+}
+
 /* Push a value onto the stack */
 void pushvalue(Parser *p, FennObject x) {
     size_t oldcount = p->valuecount;
     size_t newcount = oldcount + 1;
+    if (newcount > p->valuecap && p->valuehead && p->valuehead >= p->valuecap / 2) {
+        /* Half the stack has been produced, slide the rest down instead
+         * of growing. Each value moves at most once per doubling. */
+        oldcount -= p->valuehead;
+        memmove(p->values, p->values + p->valuehead, sizeof(FennObject) * oldcount);
+        p->valueclean = p->valueclean > p->valuehead ? p->valueclean - p->valuehead : 0;
+        p->valuehead = 0;
+        truncatevalues(p, oldcount);
+        newcount = oldcount + 1;
+    }
     if (newcount > p->valuecap) {
         FennObject *next;
         size_t newcap = 2 * newcount;
@@ -206,6 +239,77 @@ void pushvalue(Parser *p, FennObject x) {
     p->valuecount = newcount;
 }
 
+/* Build a tuple from the values of a container */
+FennObject closetuple(Parser *p, ParseState *state) {
+    FennObject *ret = begintuple(p, state->argn);
+    if (state->argn > 0) {
+        truncatevalues(p, p->valuecount - state->argn);
+        memcpy(ret, p->values + p->valuecount, sizeof(FennObject) * state->argn);
+    }
+    /* Source mapping info */
+    setsourcemap(p, ret, state);
+    return fenn_wrap_tuple(fenn_tuple_end(ret));
+}
+
+/* Build an array from the values of a container */
+FennObject closearray(Parser *p, ParseState *state) {
+    FennArray *array = fenn_array(state->argn);
+    if (state->argn > 0) {
+        truncatevalues(p, p->valuecount - state->argn);
+        fenn_array_push_n(array, p->values + p->valuecount, state->argn);
+    }
+    return fenn_wrap_array(array);
+}
+
+/* Build a struct from the values of a container, taken as key value pairs */
+FennObject closestruct(Parser *p, ParseState *state) {
+    FennKV *st = fenn_struct_begin(state->argn >> 1);
+    int32_t i;
+    if (state->argn > 0) {
+        truncatevalues(p, p->valuecount - state->argn);
+        for (i = 0; i < state->argn; i += 2)
+            fenn_struct_put(st, p->values[p->valuecount + i], p->values[p->valuecount + i + 1]);
+    }
+    return fenn_wrap_struct(fenn_struct_end(st));
+}
+
+/* Build a table from the values of a container, taken as key value pairs.
+ * Going through a struct gives records a shape. */
+FennObject closetable(Parser *p, ParseState *state) {
+    FennObject st = closestruct(p, state);
+    return fenn_wrap_table(fenn_table_from_struct(fenn_unwrap_struct(st)));
+}
+
+/* Close the container on top of the stack and pop it as a value */
+int closecontainer(Parser *p, ParseState *state, uint8_t c) {
+    FennObject value;
+    if (p->statecount == 1) {
+        p->error = "unexpected closing delimiter";
+        return 1;
+    }
+    if ((c == ')' && (state->flags & FLAG_PARENS)) ||
+        (c == ']' && (state->flags & FLAG_SQRBRACKETS))) {
+        if (state->flags & FLAG_ATSYM)
+            value = closearray(p, state);
+        else
+            value = closetuple(p, state);
+    } else if (c == '}' && (state->flags & FLAG_CURLYBRACKETS)) {
+        if (state->argn & 1) {
+            p->error = "struct and table literals expect even number of arguments";
+            return 1;
+        }
+        if (state->flags & FLAG_ATSYM)
+            value = closetable(p, state);
+        else
+            value = closestruct(p, state);
+    } else {
+        p->error = "mismatched delimiter";
+        return 1;
+    }
+    popstate(p, value);
+    return 1;
+}
+
 /* Consumer functions */
 
 /* Parses a single expression - returns the number of characters consumed */
@@ -249,7 +353,7 @@ int expression(Parser *p, ParseState *state, uint8_t c) {
         case ')':
         case ']':
         case '}':
-            return 1;
+            return closecontainer(p, state, c);
 
         // Check for whitespace or identifier characters
         default:
@@ -306,9 +410,9 @@ int token(Parser *p, ParseState *state, uint8_t c) {
     int start_num = start_dig || p->buffer[0] == '-' || p->buffer[0] == '+' || p->buffer[0] == '.';
 
     if (p->buffer[0] == ':') {
-        // Return keyword
-    } else if (start_num /*&& we are able to convert to number */) {
-        // Return number
+        value = fenn_keywordv(p->buffer + 1, blen - 1);
+    } else if (start_num && !fenn_scan_number(p->buffer, blen, &numval)) {
+        value = fenn_wrap_number(numval);
     } else if (!check_str_const("nil", p->buffer, blen)) {
         value = fenn_wrap_nil();
     } else if (!check_str_const("false", p->buffer, blen)) {
@@ -326,7 +430,7 @@ int token(Parser *p, ParseState *state, uint8_t c) {
                 p->error = "invalid utf-8";
                 return 0;
             }
-            // TODO: Return the symbol
+            value = fenn_symbolv(p->buffer, blen);
         }
     } else {
         p->error = "empty symbol";
@@ -392,11 +496,18 @@ int stringchar(Parser *p, ParseState *state, uint8_t c) {
         // and we need to process the character. Likewise if we have already seen
         // 3 '"' characters we need to get started...
         if (c != '"' || state->argn >= 3) {
-            // If we have two characters then we have an error
-            if(state->argn == 2) {
-                p->error = "invalid string";
+            // Two quotes and nothing else is the empty string
+            if (state->argn == 2) {
+                state->flags &= ~FLAG_LONGSTRING;
+                stringend(p, state);
+                return 0;
             }
             state->flags |= FLAG_INSTRING;
+            // The first character of a short string may start an escape
+            if (c == '\\' && !(state->flags & FLAG_LONGSTRING)) {
+                state->consumer = escape;
+                return 1;
+            }
             pushbuffer(p, c);
         } else {
             state->flags |= FLAG_LONGSTRING;
@@ -483,6 +594,8 @@ int escapehex(Parser *p, ParseState *state, uint8_t c) {
         pushbuffer(p, (state->argn & 0xFF));
         state->argn = 0;
         if(!state->counter) {
+            // Escapes only appear in short strings, delimited by one '"'
+            state->argn = 1;
             state->consumer = stringchar;
         }
     }
@@ -503,20 +616,20 @@ int stringend(Parser *p, ParseState *state) {
     int32_t buflen = (int32_t) p->buffercount;
     if (state->flags & FLAG_LONGSTRING) {
         /* Remove leading and trailing newline characters */
-        if (bufstart[0] == '\n') {
+        if (buflen > 0 && bufstart[0] == '\n') {
             bufstart++;
             buflen--;
         }
         if (buflen > 0 && bufstart[buflen - 1] == '\n') {
             buflen--;
         }
-        if (state->flags & FLAG_BUFFER) {
-            FennBuffer *b = fenn_buffer(buflen);
-            fenn_buffer_push_bytes(b, bufstart, buflen);
-            ret = fenn_wrap_buffer(b);
-        } else {
-            ret = fenn_wrap_string(fenn_string(bufstart, buflen));
-        }
+    }
+    if (state->flags & FLAG_BUFFER) {
+        FennBuffer *b = fenn_buffer(buflen);
+        fenn_buffer_push_bytes(b, bufstart, buflen);
+        ret = fenn_wrap_buffer(b);
+    } else {
+        ret = fenn_wrap_string(fenn_string(bufstart, buflen));
     }
     p->buffercount = 0;
     popstate(p, ret);
@@ -545,6 +658,7 @@ void parser_ok(Parser *parser) {
 void parser_flush(Parser *parser) {
     parser->statecount = 1;
     parser->buffercount = 0;
+    truncatevalues(parser, parser->valuehead + parser->pending);
 }
 
 /* Returns the error string from the parser */
@@ -559,38 +673,148 @@ const char *parser_error(Parser *parser) {
     return NULL;
 }
 
+/* Line and column of the current position, such as the position of an
+ * error. Lines are only counted between calls that consume bytes. */
+void parser_where(Parser *parser, int *line, int *col) {
+    *line = parser->lineno;
+    *col = 1 + (int) (parser->offset - parser->linestart);
+}
+
+/* Marks the first n pending values as produced. The slots are cleared so
+ * the collector stops treating them as roots. */
+static void parser_advance(Parser *parser, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        parser->values[parser->valuehead + i] = fenn_wrap_nil();
+    }
+    parser->valuehead += n;
+    parser->pending -= (int) n;
+    if (parser->valuehead == parser->valuecount) {
+        parser->valuehead = 0;
+        truncatevalues(parser, 0);
+    }
+}
+
 FennObject parser_produce(Parser *parser) {
     FennObject ret;
-    size_t i;
     if (parser->pending == 0) {
         return (FennObject)NULL;
     }
-    ret = parser->values[0];
-    for (i = 1; i < parser->valuecount; i++) {
-        parser->values[i - 1] = parser->values[i];
-    }
-    parser->pending--;
-    parser->valuecount--;
+    ret = parser->values[parser->valuehead];
+    parser_advance(parser, 1);
     return ret;
 }
 
+/* Copies up to max finished top level values into out, oldest first.
+ * Returns the number of values copied. */
+size_t parser_produce_many(Parser *parser, FennObject *out, size_t max) {
+    size_t n = (size_t) parser->pending;
+    if (n > max) n = max;
+    if (n == 0) return 0;
+    memcpy(out, parser->values + parser->valuehead, sizeof(FennObject) * n);
+    parser_advance(parser, n);
+    return n;
+}
+
+
+/* Consumes a single character without keeping track of lines, which is
+ * left to the callers */
+static void consume(Parser *parser, uint8_t c) {
+    int consumed = 0;
+    parser->offset++;
+    while (!consumed && !parser->error) {
+        ParseState *state = parser->states + parser->statecount - 1;
+        consumed = state->consumer(parser, state, c);
+    }
+    parser->current = c;
+}
 
 // Consumes a single character
 void parser_consume(Parser *parser, uint8_t c) {
-    int consumed = 0;
     parser_ok(parser);
-    parser->offset++;
+    consume(parser, c);
     if (c == '\n') {
         parser->lineno++;
-        parser->colno = 1;
-    } else {
-        parser->colno++;
+        parser->linestart = parser->offset;
     }
-    while (!consumed && !parser->error) {
+}
+
+/* Account for a run of characters consumed by one of the fast paths */
+static void advance(Parser *parser, const uint8_t *bytes, size_t n) {
+    parser->offset += n;
+    parser->current = bytes[n - 1];
+}
+
+/* Count the lines in bytes consumed up to end, which is at the current
+ * offset. Done once per call to parser_consume_bytes rather than per byte. */
+static void countlines(Parser *parser, const uint8_t *bytes, const uint8_t *end) {
+    const uint8_t *nl = NULL;
+    size_t lines = fenn_scan_newlines(bytes, end, &nl);
+    if (lines) {
+        parser->lineno += (int) lines;
+        parser->linestart = parser->offset - (size_t) (end - nl - 1);
+    }
+}
+
+/* Scan a run of characters that all belong to a character class */
+static const uint8_t *scan_class(const uint8_t *p, const uint8_t *end, uint8_t cls) {
+    while (p < end && (char_class[*p] & cls))
+        p++;
+    return p;
+}
+
+/* Consumes a run of characters. Runs of whitespace, symbol characters,
+ * comments and plain string contents are handled in tight loops, using the
+ * vector kernels from scan.c where the run ends at one of a few bytes.
+ * Everything else goes through the consumer of the current state one byte
+ * at a time.
+ * Produces exactly the same values as calling parser_consume on every byte.
+ * Returns the number of bytes consumed, which is less than n on error. */
+size_t parser_consume_bytes(Parser *parser, const uint8_t *bytes, size_t n) {
+    const uint8_t *p = bytes;
+    const uint8_t *end = bytes + n;
+    parser_ok(parser);
+    while (p < end && !parser->error) {
         ParseState *state = parser->states + parser->statecount - 1;
-        consumed = state->consumer(parser, state, c);
+        Consumer consumer = state->consumer;
+        const uint8_t *run = p;
+        if (consumer == token) {
+            run = scan_class(p, end, CC_SYMBOL);
+            if (run > p) {
+                const uint8_t *c;
+                for (c = p; c < run; c++) {
+                    if (*c & 0x80) {
+                        state->argn = 1; // Non ascii character in the token
+                        break;
+                    }
+                }
+                pushbytes(parser, p, (size_t) (run - p));
+            }
+        } else if (consumer == expression) {
+            run = fenn_scan_whitespace(p, end);
+        } else if (consumer == linecomment) {
+            run = memchr(p, '\n', (size_t) (end - p));
+            if (NULL == run) run = end;
+        } else if (consumer == stringchar && (state->flags & FLAG_INSTRING)) {
+            // A single stop byte is left to memchr, which is vectorised
+            if (state->flags & FLAG_LONGSTRING) {
+                run = memchr(p, '"', (size_t) (end - p));
+                if (NULL == run) run = end;
+            } else {
+                run = fenn_scan_stringstop(p, end);
+            }
+            if (run > p)
+                pushbytes(parser, p, (size_t) (run - p));
+        }
+        if (run > p) {
+            advance(parser, p, (size_t) (run - p));
+            p = run;
+        } else {
+            consume(parser, *p++);
+        }
     }
-    parser->current = c;
+    countlines(parser, bytes, p);
+    return (size_t) (p - bytes);
 }
 
 /* Handle the end of the buffer */
@@ -601,6 +825,9 @@ void parser_eof(Parser *parser) {
         parser->error = "unexpected end of input";
     }
     parser->offset--;
+    // The newline is not part of the input, report the end as its own line
+    if (parser->linestart > parser->offset)
+        parser->linestart = parser->offset;
     parser->finished = 1;
 }
 
@@ -612,8 +839,13 @@ void parser_init(Parser *parser) {
     parser->error = NULL;
     parser->offset = 0;
     parser->lineno = 1;
-    parser->colno = 1;
+    parser->linestart = 0;
     parser->finished = 0;
+#ifdef FENN_NO_SOURCEMAPS
+    parser->sourcemaps = 0;
+#else
+    parser->sourcemaps = 1;
+#endif
 
     /* States */
     parser->states = NULL;
@@ -627,12 +859,45 @@ void parser_init(Parser *parser) {
 
     // Values
     parser->values = NULL;
+    parser->valuehead = 0;
     parser->valuecount = 0;
+    parser->valueclean = 0;
     parser->valuecap = 0;
+    parser->pending = 0;
+
+    // Top level values are collected by the root state
+    pushstate(parser, expression, FLAG_CONTAINER);
+
+    // Values waiting on the stack are live, the parser must not be moved
+    fenn_gc_addrootset(&parser->values, &parser->valuecount, &parser->valueclean);
+}
+
+/* Gives back the token buffer, value stack and state stack if they have
+ * grown past PARSER_TRIM bytes and are not in use. Called between forms
+ * so a single large form does not pin its memory for the whole input. */
+void parser_trim(Parser *parser) {
+    if (parser->buffercount == 0 && parser->buffercap > PARSER_TRIM) {
+        free(parser->buffer);
+        parser->buffer = NULL;
+        parser->buffercap = 0;
+    }
+    if (parser->valuecount == 0 && parser->valuecap * sizeof(FennObject) > PARSER_TRIM) {
+        free(parser->values);
+        parser->values = NULL;
+        parser->valuecap = 0;
+    }
+    if (parser->statecount == 1 && parser->statecap * sizeof(ParseState) > PARSER_TRIM) {
+        ParseState *next = realloc(parser->states, sizeof(ParseState));
+        if (NULL != next) {
+            parser->states = next;
+            parser->statecap = 1;
+        }
+    }
 }
 
 /* Free all memory allocated in this parser */
 void parser_destroy(Parser *parser) {
+    fenn_gc_removerootset(&parser->values);
     // Free memory for buffer
     free(parser->buffer);
     // Free memory for states
@@ -41,8 +41,6 @@ struct ParseState {
     int32_t argn;
     uint32_t flags;
     size_t start;
-    int32_t startline;
-    int32_t startcol;
     Consumer consumer;
 };
 
@@ -54,11 +52,12 @@ struct Parser {
     ParseState *states;  // Store the stack of ParseStates
     size_t statecount;   // Number of states on the stack
     size_t statecap;     // Number of states allocated
-    int offset;          // Stores the current offset into the buffer we are parsing
-    int lineno;          // The current line number
-    int colno;           // The current column number
+    size_t offset;       // Stores the current offset into the buffer we are parsing
+    int lineno;          // The line starting at linestart
+    size_t linestart;    // Offset of the start of the current line, see parser_where
     int finished;        // Flag to show if we are finished parsing
     int pending;         // How many values we have pending
+    int sourcemaps;      // Give tuples a FennSourceMap, see fenn_tuple_sourcemap
 
     // Buffer
     uint8_t *buffer;     // The buffer we are currently parsing into
@@ -67,7 +66,9 @@ struct Parser {
 
     // Values
     FennObject *values;  // Stack of values to return
+    size_t valuehead;    // Index of the oldest value not yet produced
     size_t valuecount;   // Number of values present on the stack
+    size_t valueclean;   // Values below this are old, see FennGCRootSet
     size_t valuecap;     // Capacity of the value stack
 
     uint8_t current;     // The current character being processed
@@ -86,6 +87,16 @@ struct Parser {
 #define FLAG_INSTRING      ((uint32_t)0x100000)
 #define FLAG_END_CANDIDATE ((uint32_t)0x200000)
 
+/* Stacks bigger than this are released by parser_trim when idle */
+#define PARSER_TRIM 4096
+
+/* Character classes */
+#define CC_WHITESPACE 0x1
+#define CC_SYMBOL     0x2
+#define CC_STRINGSTOP 0x4 // Ends a run of plain characters in a short string
+
+extern const uint8_t char_class[256];
+
 /* Function declarations */
 
 /* Character utilities */
@@ -101,17 +112,27 @@ int check_str_const(const char *, const uint8_t *, int32_t);
 void pushstate(Parser *, Consumer, int);
 void popstate(Parser *, FennObject);
 void pushbuffer(Parser *, uint8_t);
+void pushbytes(Parser *, const uint8_t *, size_t);
 void pushvalue(Parser *, FennObject);
+FennObject closetuple(Parser *, ParseState *);
+FennObject closearray(Parser *, ParseState *);
+FennObject closestruct(Parser *, ParseState *);
+FennObject closetable(Parser *, ParseState *);
+int closecontainer(Parser *, ParseState *, uint8_t);
 
 /* Parser utility functions */
 ParserStatus parser_status(Parser *);
 int stringend(Parser *, ParseState *);
 void parser_ok(Parser *);
 void parser_consume(Parser *, uint8_t);
+size_t parser_consume_bytes(Parser *, const uint8_t *, size_t);
 void parser_eof(Parser *);
 void parser_flush(Parser *parser);
 const char *parser_error(Parser *parser);
+void parser_where(Parser *parser, int *line, int *col);
 FennObject parser_produce(Parser *parser);
+size_t parser_produce_many(Parser *parser, FennObject *out, size_t max);
+void parser_trim(Parser *parser);
 
 /* Consumers */
 int expression(Parser *, ParseState *, uint8_t);
@@ -0,0 +1,260 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include <parser.h>
+#include "scan.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#define FENN_SCAN_X86
+#include <immintrin.h>
+#endif
+
+/* Portable versions, also used for the tails of the vector versions */
+
+static const uint8_t *scan_stringstop_c(const uint8_t *p, const uint8_t *end) {
+    while (p < end && !(char_class[*p] & CC_STRINGSTOP))
+        p++;
+    return p;
+}
+
+static const uint8_t *scan_whitespace_c(const uint8_t *p, const uint8_t *end) {
+    while (p < end && (char_class[*p] & CC_WHITESPACE))
+        p++;
+    return p;
+}
+
+static size_t scan_newlines_c(const uint8_t *p, const uint8_t *end, const uint8_t **last) {
+    size_t lines = 0;
+    while (p < end && NULL != (p = memchr(p, '\n', (size_t) (end - p)))) {
+        lines++;
+        *last = p++;
+    }
+    return lines;
+}
+
+static size_t scan_linestarts_c(const uint8_t *p, const uint8_t *end, size_t base, size_t *out) {
+    const uint8_t *start = p;
+    size_t n = 0;
+    while (p < end && NULL != (p = memchr(p, '\n', (size_t) (end - p))))
+        out[n++] = base + (size_t) (++p - start);
+    return n;
+}
+
+#ifdef FENN_SCAN_X86
+
+/* SSE2 is part of the x86-64 baseline, so these are always available */
+
+static const uint8_t *scan_stringstop_sse2(const uint8_t *p, const uint8_t *end) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i slash = _mm_set1_epi8('\\');
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                              _mm_cmpeq_epi8(v, slash)),
+                                 _mm_cmpeq_epi8(v, newline));
+        int mask = _mm_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz((unsigned) mask);
+        p += 16;
+    }
+    return scan_stringstop_c(p, end);
+}
+
+/* Whitespace is ' ', '\0' and '\t' to '\r', the last is a single range */
+static const uint8_t *scan_whitespace_sse2(const uint8_t *p, const uint8_t *end) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i range = _mm_set1_epi8('\r' - '\t');
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i t = _mm_sub_epi8(v, tab);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space),
+                                              _mm_cmpeq_epi8(v, zero)),
+                                 _mm_cmpeq_epi8(_mm_min_epu8(t, range), t));
+        unsigned mask = ~(unsigned) _mm_movemask_epi8(m) & 0xFFFF;
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return scan_whitespace_c(p, end);
+}
+
+static size_t scan_newlines_sse2(const uint8_t *p, const uint8_t *end, const uint8_t **last) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t lines = 0;
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        if (mask) {
+            lines += (size_t) __builtin_popcount(mask);
+            *last = p + 31 - __builtin_clz(mask);
+        }
+        p += 16;
+    }
+    return lines + scan_newlines_c(p, end, last);
+}
+
+static size_t scan_linestarts_sse2(const uint8_t *p, const uint8_t *end, size_t base, size_t *out) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const uint8_t *start = p;
+    size_t n = 0;
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        while (mask) {
+            out[n++] = base + (size_t) (p - start) + (size_t) __builtin_ctz(mask) + 1;
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+    return n + scan_linestarts_c(p, end, base + (size_t) (p - start), out + n);
+}
+
+/* AVX2 versions, only used when the CPU supports them */
+
+__attribute__((target("avx2")))
+static const uint8_t *scan_stringstop_avx2(const uint8_t *p, const uint8_t *end) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i slash = _mm256_set1_epi8('\\');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                                    _mm256_cmpeq_epi8(v, slash)),
+                                    _mm256_cmpeq_epi8(v, newline));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return scan_stringstop_sse2(p, end);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *scan_whitespace_avx2(const uint8_t *p, const uint8_t *end) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i range = _mm256_set1_epi8('\r' - '\t');
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        __m256i t = _mm256_sub_epi8(v, tab);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                                                    _mm256_cmpeq_epi8(v, zero)),
+                                    _mm256_cmpeq_epi8(_mm256_min_epu8(t, range), t));
+        unsigned mask = ~(unsigned) _mm256_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return scan_whitespace_sse2(p, end);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t scan_newlines_avx2(const uint8_t *p, const uint8_t *end, const uint8_t **last) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t lines = 0;
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline));
+        if (mask) {
+            lines += (size_t) __builtin_popcount(mask);
+            *last = p + 31 - __builtin_clz(mask);
+        }
+        p += 32;
+    }
+    return lines + scan_newlines_sse2(p, end, last);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_linestarts_avx2(const uint8_t *p, const uint8_t *end, size_t base, size_t *out) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const uint8_t *start = p;
+    size_t n = 0;
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline));
+        while (mask) {
+            out[n++] = base + (size_t) (p - start) + (size_t) __builtin_ctz(mask) + 1;
+            mask &= mask - 1;
+        }
+        p += 32;
+    }
+    return n + scan_linestarts_sse2(p, end, base + (size_t) (p - start), out + n);
+}
+
+FennScanner fenn_scan_stringstop = scan_stringstop_sse2;
+FennScanner fenn_scan_whitespace = scan_whitespace_sse2;
+FennLineCounter fenn_scan_newlines = scan_newlines_sse2;
+FennLineIndexer fenn_scan_linestarts = scan_linestarts_sse2;
+static const char *fenn_scan_name = "sse2";
+
+#else
+
+FennScanner fenn_scan_stringstop = scan_stringstop_c;
+FennScanner fenn_scan_whitespace = scan_whitespace_c;
+FennLineCounter fenn_scan_newlines = scan_newlines_c;
+FennLineIndexer fenn_scan_linestarts = scan_linestarts_c;
+static const char *fenn_scan_name = "c";
+
+#endif
+
+static int fenn_scan_ready = 0;
+
+/* Pick the fastest kernels for this CPU. The FENN_SCAN environment variable
+ * can force "c" or "sse2" for testing. */
+void fenn_scan_init(void) {
+    const char *force;
+    // The kernels are shared by every thread, only the first call picks them
+    if (fenn_scan_ready)
+        return;
+    fenn_scan_ready = 1;
+    force = getenv("FENN_SCAN");
+    if (NULL != force && !strcmp(force, "c")) {
+        fenn_scan_stringstop = scan_stringstop_c;
+        fenn_scan_whitespace = scan_whitespace_c;
+        fenn_scan_newlines = scan_newlines_c;
+        fenn_scan_linestarts = scan_linestarts_c;
+        fenn_scan_name = "c";
+        return;
+    }
+#ifdef FENN_SCAN_X86
+    if (NULL != force && !strcmp(force, "sse2"))
+        return;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        fenn_scan_stringstop = scan_stringstop_avx2;
+        fenn_scan_whitespace = scan_whitespace_avx2;
+        fenn_scan_newlines = scan_newlines_avx2;
+        fenn_scan_linestarts = scan_linestarts_avx2;
+        fenn_scan_name = "avx2";
+    }
+#endif
+}
+
+/* Name of the kernels in use */
+const char *fenn_scan_impl(void) {
+    return fenn_scan_name;
+}
@@ -0,0 +1,50 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef SCAN_H
+#define SCAN_H
+
+/* Vectorised scanning kernels used by the parser fast paths. The best
+ * implementation for the running CPU (AVX2, SSE2 or plain C) is picked by
+ * fenn_scan_init, which fenn_init calls. */
+
+typedef const uint8_t *(*FennScanner)(const uint8_t *, const uint8_t *);
+typedef size_t (*FennLineCounter)(const uint8_t *, const uint8_t *, const uint8_t **);
+typedef size_t (*FennLineIndexer)(const uint8_t *, const uint8_t *, size_t, size_t *);
+
+/* First '"', '\\' or '\n' in [p, end), or end */
+extern FennScanner fenn_scan_stringstop;
+
+/* First byte that is not whitespace in [p, end), or end */
+extern FennScanner fenn_scan_whitespace;
+
+/* Number of '\n' in [p, end), *last is set to the last one found */
+extern FennLineCounter fenn_scan_newlines;
+
+/* Offset of the byte after every '\n' in [p, end), where p is at offset
+ * base. out needs room for end - p offsets. Returns the number written */
+extern FennLineIndexer fenn_scan_linestarts;
+
+void fenn_scan_init(void);
+const char *fenn_scan_impl(void);
+
+#endif
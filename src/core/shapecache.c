@@ -0,0 +1,85 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include "gc.h"
+#include "util.h"
+#include "shapecache.h"
+#include "weakset.h"
+#include "objects/fstruct.h"
+
+#define FENN_SHAPECACHE_MINCAP 64
+
+static int32_t fenn_shapecache_hash(const void *shape) {
+    return fenn_struct_hash((const FennKV *) shape);
+}
+
+static FennGCObject *fenn_shapecache_object(const void *shape) {
+    return &fenn_struct_head((const FennKV *) shape)->gc;
+}
+
+static FENN_THREAD_LOCAL FennWeakSet fenn_shapecache = {
+    NULL, 0, 0, 0, FENN_SHAPECACHE_MINCAP, fenn_shapecache_hash, fenn_shapecache_object
+};
+
+/* Whether a shape has the keys of a struct. Both are laid out by their
+ * keys alone, and shaped keys are interned, so the slots can be compared
+ * by value in order. */
+static int fenn_shapecache_same(const FennKV *shape, const FennKV *st) {
+    int32_t i, cap = fenn_struct_capacity(shape);
+    if (fenn_struct_length(shape) != fenn_struct_length(st) || cap != fenn_struct_capacity(st))
+        return 0;
+    for (i = 0; i < cap; i++) {
+        if (fenn_u64(shape[i].key) != fenn_u64(st[i].key))
+            return 0;
+    }
+    return 1;
+}
+
+static int fenn_shapecache_match(const void *shape, const void *st) {
+    return fenn_shapecache_same((const FennKV *) shape, (const FennKV *) st);
+}
+
+/* Find the live shape for the keys of a struct, given the hash of that
+ * shape (see fenn_kv_shapehash). Returns NULL if there is none. */
+const FennKV *fenn_shapecache_find(const FennKV *st, int32_t hash) {
+    return fenn_weakset_find(&fenn_shapecache, hash, fenn_shapecache_match, st);
+}
+
+/* Add a new shape to the table. It is moved out of the nursery first so
+ * the table never has to follow it around. Returns where it now lives. */
+const FennKV *fenn_shapecache_add(FennKV *shape) {
+    FennStructHead *head = (FennStructHead *) fenn_gc_tenure(&fenn_struct_head(shape)->gc);
+    head->gc.flags |= FENN_MEM_CONSED;
+    fenn_weakset_add(&fenn_shapecache, head->data);
+    return head->data;
+}
+
+/* Remove a shape from the table, called when the shape is freed */
+void fenn_shape_deinit(const FennKV *shape) {
+    fenn_weakset_remove(&fenn_shapecache, shape);
+}
+
+/* Free the table of the current thread */
+void fenn_shapecache_deinit(void) {
+    fenn_weakset_deinit(&fenn_shapecache);
+}
@@ -0,0 +1,37 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef SHAPECACHE_H
+#define SHAPECACHE_H
+
+/* Shapes shared by structs and tables with the same keys. A shape is a
+ * struct mapping each key to the position of its value, and a shaped
+ * struct or table only stores the values. Like the tuple hash-cons table
+ * the table of shapes is per thread and weak, shapes are removed from it
+ * when they are freed. */
+
+const FennKV *fenn_shapecache_find(const FennKV *, int32_t);
+const FennKV *fenn_shapecache_add(FennKV *);
+void fenn_shape_deinit(const FennKV *);
+void fenn_shapecache_deinit(void);
+
+#endif
@@ -0,0 +1,155 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include "slab.h"
+
+/* Slabs with at least one free slot, per size class */
+static FENN_THREAD_LOCAL FennSlab *fenn_slabs[FENN_SLAB_CLASSES];
+
+/* One completely empty slab is cached per class to avoid thrashing */
+static FENN_THREAD_LOCAL FennSlab *fenn_slab_spare[FENN_SLAB_CLASSES];
+
+/* Offset of the first slot, keeps slots 16 byte aligned */
+#define FENN_SLAB_HEADER \
+    ((sizeof(FennSlab) + FENN_SLAB_GRANULE - 1) & ~(size_t)(FENN_SLAB_GRANULE - 1))
+
+static void fenn_slab_link(FennSlab *slab) {
+    FennSlab **head = fenn_slabs + slab->sclass;
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) (*head)->prev = slab;
+    *head = slab;
+}
+
+static void fenn_slab_unlink(FennSlab *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        fenn_slabs[slab->sclass] = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+/* Get a fresh slab for a size class */
+static FennSlab *fenn_slab_new(uint32_t sclass) {
+    FennSlab *slab = fenn_slab_spare[sclass];
+    if (NULL != slab) {
+        fenn_slab_spare[sclass] = NULL;
+    } else {
+        void *mem = NULL;
+        if (posix_memalign(&mem, FENN_SLAB_SIZE, FENN_SLAB_SIZE)) {
+            // TODO: Handle Out Of Memory
+            return NULL;
+        }
+        slab = mem;
+        slab->sclass = sclass;
+        slab->size = (sclass + 1) * FENN_SLAB_GRANULE;
+        slab->count = (uint32_t) ((FENN_SLAB_SIZE - FENN_SLAB_HEADER) / slab->size);
+    }
+    slab->free = NULL;
+    slab->bump = (char *) slab + FENN_SLAB_HEADER;
+    slab->used = 0;
+    fenn_slab_link(slab);
+    return slab;
+}
+
+/* Allocate a slot large enough for size bytes. Returns NULL if the
+ * size is too large for any class. */
+void *fenn_slab_alloc(size_t size) {
+    uint32_t sclass;
+    FennSlab *slab;
+    void *slot;
+    if (size > FENN_SLAB_MAXSIZE)
+        return NULL;
+    sclass = (uint32_t) fenn_slab_class(size ? size : 1);
+    slab = fenn_slabs[sclass];
+    if (NULL == slab) {
+        slab = fenn_slab_new(sclass);
+        if (NULL == slab) return NULL;
+    }
+    if (NULL != slab->free) {
+        slot = slab->free;
+        slab->free = slab->free->next;
+    } else {
+        slot = slab->bump;
+        slab->bump += slab->size;
+    }
+    // Full slabs leave the list until a slot is freed
+    if (++slab->used == slab->count)
+        fenn_slab_unlink(slab);
+    return slot;
+}
+
+/* Return a slot to the slab it was allocated from */
+void fenn_slab_free(void *mem) {
+    FennSlab *slab = fenn_slab_of(mem);
+    FennSlot *slot = mem;
+    if (slab->used-- == slab->count)
+        fenn_slab_link(slab);
+    if (slab->used == 0) {
+        fenn_slab_unlink(slab);
+        if (NULL == fenn_slab_spare[slab->sclass]) {
+            fenn_slab_spare[slab->sclass] = slab;
+        } else {
+            free(slab);
+        }
+        return;
+    }
+    slot->next = slab->free;
+    slab->free = slot;
+}
+
+/* Hand the slabs with free slots over to another thread. Full slabs need no
+ * hand over, they join the lists of whichever thread frees a slot in them. */
+void fenn_slab_detach(FennSlab **lists) {
+    int i;
+    for (i = 0; i < FENN_SLAB_CLASSES; i++) {
+        lists[i] = fenn_slabs[i];
+        fenn_slabs[i] = NULL;
+    }
+}
+
+/* Take over slabs detached by another thread */
+void fenn_slab_attach(FennSlab **lists) {
+    int i;
+    for (i = 0; i < FENN_SLAB_CLASSES; i++) {
+        FennSlab *slab = lists[i];
+        while (NULL != slab) {
+            FennSlab *next = slab->next;
+            fenn_slab_link(slab);
+            slab = next;
+        }
+        lists[i] = NULL;
+    }
+}
+
+/* Release every cached slab. Only valid once all slots have been freed */
+void fenn_slab_deinit(void) {
+    int i;
+    for (i = 0; i < FENN_SLAB_CLASSES; i++) {
+        free(fenn_slab_spare[i]);
+        fenn_slab_spare[i] = NULL;
+        fenn_slabs[i] = NULL;
+    }
+}
@@ -0,0 +1,61 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef SLAB_H
+#define SLAB_H
+
+/* Small objects are carved out of page sized, page aligned slabs. Each slab
+ * holds slots of a single size class and keeps its own free list, so the
+ * slab that owns an object can be found by masking its address. */
+#define FENN_SLAB_SIZE     4096
+#define FENN_SLAB_GRANULE  16
+#define FENN_SLAB_CLASSES  16
+#define FENN_SLAB_MAXSIZE  (FENN_SLAB_GRANULE * FENN_SLAB_CLASSES)
+
+typedef struct FennSlab FennSlab;
+typedef struct FennSlot FennSlot;
+
+struct FennSlot {
+    FennSlot *next;
+};
+
+struct FennSlab {
+    FennSlab *next;      // Next slab of the same class with free slots
+    FennSlab *prev;      // Previous slab of the same class with free slots
+    FennSlot *free;      // Free slots in this slab
+    char *bump;          // Start of the never used slots
+    uint32_t size;       // Size of each slot
+    uint32_t count;      // Number of slots in the slab
+    uint32_t used;       // Number of slots handed out
+    uint32_t sclass;     // Size class index
+};
+
+#define fenn_slab_of(p) ((FennSlab *)((uintptr_t)(p) & ~(uintptr_t)(FENN_SLAB_SIZE - 1)))
+#define fenn_slab_class(size) (((size) + FENN_SLAB_GRANULE - 1) / FENN_SLAB_GRANULE - 1)
+
+void *fenn_slab_alloc(size_t);
+void fenn_slab_free(void *);
+void fenn_slab_detach(FennSlab **);
+void fenn_slab_attach(FennSlab **);
+void fenn_slab_deinit(void);
+
+#endif
@@ -0,0 +1,105 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include <parser.h>
+#include "gc.h"
+#include "stream.h"
+
+/* Hands finished top level forms to the callback one at a time, so those
+ * after one that stops the stream are left in the parser. The form being
+ * handed out is a root set while the callback runs, since it may
+ * allocate. */
+static int stream_drain(Parser *parser, ParserStream *stream) {
+    FennObject form;
+    FennObject *held = &form;
+    size_t count = 0;
+    int stopped = 0;
+    fenn_gc_addrootset(&held, &count, NULL);
+    while (!stopped && parser->pending) {
+        form = parser_produce(parser);
+        count = 1;
+        stream->forms++;
+        if (stream->callback(stream->data, form)) {
+            stream->stopped = 1;
+            stopped = 1;
+        }
+        count = 0;
+    }
+    fenn_gc_removerootset(&held);
+    return stopped;
+}
+
+int parser_stream(Parser *parser, FILE *in, ParserStream *stream) {
+    uint8_t *chunk = malloc(PARSER_STREAM_CHUNK);
+    size_t n;
+    int status = 0;
+    if (NULL == chunk) {
+        // TODO: Handle Out Of Memory
+        parser->error = "out of memory";
+        return 1;
+    }
+    stream->stopped = 0;
+    while ((n = fread(chunk, 1, PARSER_STREAM_CHUNK, in)) > 0) {
+        const uint8_t *p = chunk;
+        const uint8_t *end = chunk + n;
+        stream->bytes += n;
+        while (p < end) {
+            p += parser_consume_bytes(parser, p, (size_t) (end - p));
+            if (parser->error) {
+                status = 1;
+                goto done;
+            }
+            if (stream_drain(parser, stream))
+                goto done;
+        }
+        // Forms from this chunk are now garbage unless the callback kept them
+        parser_trim(parser);
+        fenn_maybe_collect();
+    }
+    if (ferror(in)) {
+        parser->error = "read error";
+        status = 1;
+        goto done;
+    }
+    parser_eof(parser);
+    if (parser->error) {
+        status = 1;
+        goto done;
+    }
+    stream_drain(parser, stream);
+done:
+    free(chunk);
+    return status;
+}
+
+int parser_stream_file(Parser *parser, const char *path, ParserStream *stream) {
+    FILE *in = fopen(path, "rb");
+    int status;
+    if (NULL == in) {
+        parser->error = "could not open file";
+        return 1;
+    }
+    status = parser_stream(parser, in, stream);
+    fclose(in);
+    return status;
+}
@@ -0,0 +1,54 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef STREAM_H
+#define STREAM_H
+
+/* Streaming front end for the parser. Input is read in fixed size chunks
+ * and every top level form is handed to a callback as soon as it closes,
+ * so memory use depends on the largest form rather than the input size. */
+
+/* Size of the chunks read from the input */
+#define PARSER_STREAM_CHUNK 0x10000
+
+/* Called once per top level form. Return nonzero to stop the stream.
+ * Forms already parsed after the one that stopped it stay in the parser,
+ * where parser_produce returns them. The form is only kept alive for the
+ * duration of the call; root it with fenn_gcroot to keep it longer. */
+typedef int (*ParserCallback)(void *data, FennObject form);
+
+typedef struct ParserStream ParserStream;
+
+struct ParserStream {
+    ParserCallback callback;
+    void *data;
+    size_t forms;   // Forms passed to the callback so far
+    size_t bytes;   // Bytes read so far
+    int stopped;    // Set if the callback stopped the stream
+};
+
+/* Both return 0 once the input is exhausted or the callback stops, and 1 on
+ * a parse or read error, in which case parser->error says what went wrong. */
+int parser_stream(Parser *, FILE *, ParserStream *);
+int parser_stream_file(Parser *, const char *, ParserStream *);
+
+#endif
@@ -0,0 +1,178 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include "gc.h"
+#include "util.h"
+#include "symcache.h"
+#include "objects/fstring.h"
+
+#define FENN_SYMCACHE_MINCAP 1024
+
+static FENN_THREAD_LOCAL const uint8_t **fenn_symcache;
+static FENN_THREAD_LOCAL uint32_t fenn_symcache_cap;
+static FENN_THREAD_LOCAL uint32_t fenn_symcache_count;
+static FENN_THREAD_LOCAL uint32_t fenn_symcache_deleted;
+
+/* Marks a slot that used to hold a symbol, probing continues past it */
+static const uint8_t fenn_symcache_tombstone[1];
+#define FENN_SYMCACHE_DELETED fenn_symcache_tombstone
+
+/* Find the slot of a symbol, or the slot where it should be inserted.
+ * Sets *found to 1 if the symbol is present. */
+static const uint8_t **fenn_symcache_find(const uint8_t *str, int32_t len, int32_t hash, int *found) {
+    uint32_t mask = fenn_symcache_cap - 1;
+    uint32_t index = (uint32_t) hash & mask;
+    const uint8_t **firstdeleted = NULL;
+    for (;;) {
+        const uint8_t **slot = fenn_symcache + index;
+        const uint8_t *sym = *slot;
+        if (NULL == sym) {
+            *found = 0;
+            return firstdeleted ? firstdeleted : slot;
+        }
+        if (sym == FENN_SYMCACHE_DELETED) {
+            if (NULL == firstdeleted) firstdeleted = slot;
+        } else if (fenn_string_equalconst(sym, str, len, hash)) {
+            *found = 1;
+            return slot;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+/* Rebuild the table with a new capacity, dropping tombstones */
+static void fenn_symcache_resize(uint32_t newcap) {
+    const uint8_t **old = fenn_symcache;
+    uint32_t oldcap = fenn_symcache_cap;
+    uint32_t i;
+    fenn_symcache = calloc(newcap, sizeof(const uint8_t *));
+    if (NULL == fenn_symcache) {
+        // TODO: Handle Out Of Memory error
+    }
+    fenn_symcache_cap = newcap;
+    fenn_symcache_deleted = 0;
+    for (i = 0; i < oldcap; i++) {
+        const uint8_t *sym = old[i];
+        if (NULL != sym && sym != FENN_SYMCACHE_DELETED) {
+            int found;
+            *fenn_symcache_find(sym, fenn_string_length(sym), fenn_string_hash(sym), &found) = sym;
+        }
+    }
+    free(old);
+}
+
+/* A symbol that is about to be swept may be handed out again */
+static const uint8_t *fenn_symcache_revive(const uint8_t *sym) {
+    FennGCObject *gc = &fenn_string_head(sym)->gc;
+    if (fenn_gc_dying(gc))
+        fenn_gc_setmark(gc);
+    return sym;
+}
+
+/* Get the interned symbol with the given name, creating it if needed */
+const uint8_t *fenn_symbol(const uint8_t *str, int32_t len) {
+    int32_t hash = fenn_string_calchash(str, len);
+    const uint8_t **slot;
+    FennStringHead *head;
+    int found;
+    if (NULL == fenn_symcache)
+        fenn_symcache_init();
+    slot = fenn_symcache_find(str, len, hash, &found);
+    if (found)
+        return fenn_symcache_revive(*slot);
+    head = fenn_gcalloc(FENN_MEMORY_SYMBOL, sizeof(FennStringHead) + len + 1);
+    head->length = len;
+    head->hash = hash;
+    memcpy((uint8_t *) head->data, str, len);
+    ((uint8_t *) head->data)[len] = 0;
+    if (*slot == FENN_SYMCACHE_DELETED)
+        fenn_symcache_deleted--;
+    *slot = head->data;
+    fenn_symcache_count++;
+    // Keep the load factor, including tombstones, under one half
+    if (2 * (fenn_symcache_count + fenn_symcache_deleted) >= fenn_symcache_cap)
+        fenn_symcache_resize(4 * fenn_symcache_count > fenn_symcache_cap
+                             ? 2 * fenn_symcache_cap
+                             : fenn_symcache_cap);
+    return head->data;
+}
+
+/* Get the interned symbol of a c string */
+const uint8_t *fenn_csymbol(const char *cstr) {
+    return fenn_symbol((const uint8_t *) cstr, (int32_t) strlen(cstr));
+}
+
+/* Intern a symbol allocated by another thread. Returns the symbol already
+ * interned under the same name if there is one, otherwise sym itself. */
+const uint8_t *fenn_symbol_adopt(const uint8_t *sym) {
+    const uint8_t **slot;
+    int found;
+    if (NULL == fenn_symcache)
+        fenn_symcache_init();
+    slot = fenn_symcache_find(sym, fenn_string_length(sym), fenn_string_hash(sym), &found);
+    if (found)
+        return fenn_symcache_revive(*slot);
+    if (*slot == FENN_SYMCACHE_DELETED)
+        fenn_symcache_deleted--;
+    *slot = sym;
+    fenn_symcache_count++;
+    if (2 * (fenn_symcache_count + fenn_symcache_deleted) >= fenn_symcache_cap)
+        fenn_symcache_resize(4 * fenn_symcache_count > fenn_symcache_cap
+                             ? 2 * fenn_symcache_cap
+                             : fenn_symcache_cap);
+    return sym;
+}
+
+/* Remove a symbol from the cache, called when the symbol is freed */
+void fenn_symbol_deinit(const uint8_t *sym) {
+    const uint8_t **slot;
+    int found;
+    if (NULL == fenn_symcache)
+        return;
+    slot = fenn_symcache_find(sym, fenn_string_length(sym), fenn_string_hash(sym), &found);
+    if (found && *slot == sym) {
+        *slot = FENN_SYMCACHE_DELETED;
+        fenn_symcache_count--;
+        fenn_symcache_deleted++;
+    }
+}
+
+/* Set up the symbol cache of the current thread */
+void fenn_symcache_init(void) {
+    fenn_symcache = calloc(FENN_SYMCACHE_MINCAP, sizeof(const uint8_t *));
+    if (NULL == fenn_symcache) {
+        // TODO: Handle Out Of Memory error
+    }
+    fenn_symcache_cap = FENN_SYMCACHE_MINCAP;
+    fenn_symcache_count = 0;
+    fenn_symcache_deleted = 0;
+}
+
+/* Free the symbol cache of the current thread */
+void fenn_symcache_deinit(void) {
+    free(fenn_symcache);
+    fenn_symcache = NULL;
+    fenn_symcache_cap = 0;
+    fenn_symcache_count = 0;
+    fenn_symcache_deleted = 0;
+}
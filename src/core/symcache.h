@@ -0,0 +1,45 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef SYMCACHE_H
+#define SYMCACHE_H
+
+/* Every symbol and keyword is interned in a per thread open addressed table,
+ * so there is only ever one copy of each name and symbols can be compared by
+ * pointer. Keywords share the table with symbols, ":foo" is the symbol "foo"
+ * wrapped as a keyword. The table is weak, symbols that become garbage are
+ * removed from it when they are freed. */
+
+FENN_API const uint8_t *fenn_symbol(const uint8_t *, int32_t);
+FENN_API const uint8_t *fenn_csymbol(const char *);
+
+#define fenn_symbolv(str, len) fenn_wrap_symbol(fenn_symbol((str), (len)))
+#define fenn_csymbolv(cstr) fenn_wrap_symbol(fenn_csymbol(cstr))
+#define fenn_keywordv(str, len) fenn_wrap_keyword(fenn_symbol((str), (len)))
+#define fenn_ckeywordv(cstr) fenn_wrap_keyword(fenn_csymbol(cstr))
+
+void fenn_symcache_init(void);
+void fenn_symcache_deinit(void);
+void fenn_symbol_deinit(const uint8_t *);
+const uint8_t *fenn_symbol_adopt(const uint8_t *);
+
+#endif
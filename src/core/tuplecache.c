@@ -0,0 +1,113 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include "gc.h"
+#include "util.h"
+#include "tuplecache.h"
+#include "weakset.h"
+#include "objects/fstring.h"
+#include "objects/ftuple.h"
+
+#define FENN_TUPLECACHE_MINCAP 1024
+
+static int32_t fenn_tuplecache_hash(const void *tuple) {
+    return fenn_tuple_hash((const FennObject *) tuple);
+}
+
+static FennGCObject *fenn_tuplecache_object(const void *tuple) {
+    return &fenn_tuple_head((const FennObject *) tuple)->gc;
+}
+
+static FENN_THREAD_LOCAL int fenn_tuplecache_on;
+static FENN_THREAD_LOCAL FennWeakSet fenn_tuplecache = {
+    NULL, 0, 0, 0, FENN_TUPLECACHE_MINCAP, fenn_tuplecache_hash, fenn_tuplecache_object
+};
+
+/* Turn hash-consing on or off for the current thread */
+void fenn_tuple_sethashcons(int enable) {
+    fenn_tuplecache_on = enable;
+}
+
+int fenn_tuplecache_enabled(void) {
+    return fenn_tuplecache_on;
+}
+
+/* Whether one tuple can stand in for another. Stricter than fenn_equals,
+ * numbers must be identical so that 0 and -0 are kept apart. */
+static int fenn_tuplecache_same(const FennObject *lhs, const FennObject *rhs) {
+    int32_t i, len = fenn_tuple_length(lhs);
+    if (lhs == rhs)
+        return 1;
+    if (len != fenn_tuple_length(rhs) || fenn_tuple_hash(lhs) != fenn_tuple_hash(rhs))
+        return 0;
+    for (i = 0; i < len; i++) {
+        FennObject x = lhs[i], y = rhs[i];
+        if (fenn_u64(x) == fenn_u64(y))
+            continue;
+        if (fenn_type(x) != fenn_type(y))
+            return 0;
+        if (fenn_checktype(x, FENN_STRING)) {
+            if (!fenn_string_equal(fenn_unwrap_string(x), fenn_unwrap_string(y)))
+                return 0;
+        } else if (fenn_checktype(x, FENN_TUPLE)) {
+            if (!fenn_tuplecache_same(fenn_unwrap_tuple(x), fenn_unwrap_tuple(y)))
+                return 0;
+        } else {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int fenn_tuplecache_match(const void *entry, const void *tuple) {
+    return fenn_tuplecache_same((const FennObject *) entry, (const FennObject *) tuple);
+}
+
+/* Get the tuple to use in place of a tuple that was just finished. Either
+ * an identical one from the table, or the tuple itself, which is moved out
+ * of the nursery first so the table never has to follow it around. */
+const FennObject *fenn_tuplecache_intern(FennObject *tuple) {
+    const FennObject *same;
+    FennTupleHead *head;
+    same = fenn_weakset_find(&fenn_tuplecache, fenn_tuple_hash(tuple), fenn_tuplecache_match, tuple);
+    if (NULL != same)
+        return same;
+    head = (FennTupleHead *) fenn_gc_tenure(&fenn_tuple_head(tuple)->gc);
+    head->gc.flags |= FENN_MEM_CONSED;
+    // The elements may be young
+    if (!(head->gc.flags & FENN_MEM_REMEMBERED))
+        fenn_gc_remember(&head->gc);
+    fenn_weakset_add(&fenn_tuplecache, head->data);
+    return head->data;
+}
+
+/* Remove a tuple from the table, called when the tuple is freed */
+void fenn_tuple_deinit(const FennObject *tuple) {
+    fenn_weakset_remove(&fenn_tuplecache, tuple);
+}
+
+/* Free the table of the current thread and turn hash-consing off */
+void fenn_tuplecache_deinit(void) {
+    fenn_weakset_deinit(&fenn_tuplecache);
+    fenn_tuplecache_on = 0;
+}
@@ -0,0 +1,40 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef TUPLECACHE_H
+#define TUPLECACHE_H
+
+/* Optional hash-consing of tuples. While it is on, fenn_tuple_end returns
+ * an identical tuple made earlier on the same thread instead of the new
+ * one, so repeated tuples share memory and are usually equal by pointer.
+ * Like the symbol cache the table is per thread and weak, tuples are
+ * removed from it when they are freed. Tuples with a source map are never
+ * shared, as they differ by where they were read from. */
+
+FENN_API void fenn_tuple_sethashcons(int);
+
+int fenn_tuplecache_enabled(void);
+const FennObject *fenn_tuplecache_intern(FennObject *);
+void fenn_tuple_deinit(const FennObject *);
+void fenn_tuplecache_deinit(void);
+
+#endif
@@ -21,25 +21,243 @@
 */
 
 #include <fenn.h>
+#include <time.h>
 #include "util.h"
+#include "objects/fstruct.h"
 #include "objects/ftuple.h"
 #include "objects/fstring.h"
 
+/* Hashing
+ *
+ * Strings are hashed a word at a time with a multiply and fold mixer in the
+ * style of wyhash. The seed is chosen at random once per process, so the
+ * hashes of untrusted keys cannot be predicted and flooded, while every
+ * thread still computes the same hash for the same bytes. */
+
+static const uint64_t fenn_hash_secret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+static uint64_t fenn_hash_seed = 0x853c49e6748fea9bull;
+static int fenn_hash_seeded = 0;
+
+/* Threads between fenn_init and fenn_deinit, which may be hashing with the
+ * seed, or -1 while one of them switches the seed */
+static volatile long fenn_hash_threads = 0;
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define fenn_hash_cas(p, old, new) (_InterlockedCompareExchange((p), (new), (old)) == (old))
+#else
+#define fenn_hash_cas(p, old, new) __sync_bool_compare_and_swap((p), (old), (new))
+#endif
+
+/* Full 64x64 bit multiply, *a gets the low and *b the high word */
+static void fenn_hash_mum(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t) *a * *b;
+    *a = (uint64_t) r;
+    *b = (uint64_t) (r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t) *a, lb = (uint32_t) *b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+/* Multiply two 64 bit words and fold the 128 bit result */
+static uint64_t fenn_hash_mix(uint64_t a, uint64_t b) {
+    fenn_hash_mum(&a, &b);
+    return a ^ b;
+}
+
+/* Unaligned little endian loads */
+static uint64_t fenn_hash_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static uint64_t fenn_hash_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+/* Hash a run of bytes */
+uint64_t fenn_hash_bytes(const uint8_t *p, size_t len) {
+    const uint64_t *s = fenn_hash_secret;
+    uint64_t seed = fenn_hash_seed;
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t mid = (len >> 3) << 2;
+            a = (fenn_hash_read32(p) << 32) | fenn_hash_read32(p + mid);
+            b = (fenn_hash_read32(p + len - 4) << 32) | fenn_hash_read32(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            // Three independent lanes keep the multipliers busy
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = fenn_hash_mix(fenn_hash_read64(p) ^ s[1], fenn_hash_read64(p + 8) ^ seed);
+                see1 = fenn_hash_mix(fenn_hash_read64(p + 16) ^ s[2], fenn_hash_read64(p + 24) ^ see1);
+                see2 = fenn_hash_mix(fenn_hash_read64(p + 32) ^ s[3], fenn_hash_read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = fenn_hash_mix(fenn_hash_read64(p) ^ s[1], fenn_hash_read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = fenn_hash_read64(p + i - 16);
+        b = fenn_hash_read64(p + i - 8);
+    }
+    a ^= s[1];
+    b ^= seed;
+    fenn_hash_mum(&a, &b);
+    return fenn_hash_mix(a ^ s[0] ^ len, b ^ s[1]);
+}
+
+/* Hash a single 64 bit word, used for numbers and pointers */
+uint64_t fenn_hash_word(uint64_t x) {
+    return fenn_hash_mix(x ^ fenn_hash_seed ^ fenn_hash_secret[0], fenn_hash_secret[1] ^ (x >> 32));
+}
+
+/* Fold a 64 bit hash into the 32 bits stored in object headers */
+#define fenn_hash_fold(h) ((int32_t) (uint32_t) ((h) ^ ((h) >> 32)))
+
+/* Pick the per process hash seed. Must happen before anything is hashed,
+ * later calls keep the seed that is already in use. */
+void fenn_hash_init(void) {
+    uint64_t seed = 0;
+    FILE *f;
+    if (fenn_hash_seeded)
+        return;
+    f = fopen("/dev/urandom", "rb");
+    if (NULL != f) {
+        if (fread(&seed, sizeof(seed), 1, f) != 1)
+            seed = 0;
+        fclose(f);
+    }
+    if (seed == 0) {
+        // No entropy source, fall back to the address of a local and the clock
+        seed = (uint64_t) (uintptr_t) &f ^ ((uint64_t) time(NULL) << 20) ^ (uint64_t) clock();
+    }
+    // Premix the seed so short keys do not pay for it on every hash
+    fenn_hash_seed = seed ^ fenn_hash_mix(seed ^ fenn_hash_secret[0], fenn_hash_secret[1]);
+    fenn_hash_seeded = 1;
+}
+
+/* The seed in use, for data laid out by hash that is saved to disk */
+uint64_t fenn_hash_getseed(void) {
+    return fenn_hash_seed;
+}
+
+/* Count a thread that is about to use the seed */
+void fenn_hash_attach(void) {
+    long n;
+    do {
+        n = fenn_hash_threads;
+    } while (n < 0 || !fenn_hash_cas(&fenn_hash_threads, n, n + 1));
+}
+
+void fenn_hash_detach(void) {
+    long n;
+    do {
+        n = fenn_hash_threads;
+    } while (n < 0 || !fenn_hash_cas(&fenn_hash_threads, n, n - 1));
+}
+
+/* Switch to a seed returned by fenn_hash_getseed in another process. Only
+ * the calling thread may be using the seed, and it must hold nothing
+ * hashed with it. Returns 0 if other threads are using the seed. */
+int fenn_hash_setseed(uint64_t seed) {
+    // Other threads wait in fenn_hash_attach until the switch is done
+    if (!fenn_hash_cas(&fenn_hash_threads, 1, -1))
+        return 0;
+    fenn_hash_seed = seed;
+    fenn_hash_seeded = 1;
+    fenn_hash_cas(&fenn_hash_threads, -1, 1);
+    return 1;
+}
+
 /* Computes hash of an array of values */
 int32_t fenn_array_calchash(const FennObject *array, int32_t len) {
     const FennObject *end = array + len;
-    uint32_t hash = 5381;
+    uint64_t hash = fenn_hash_seed ^ ((uint64_t) len * fenn_hash_secret[2]);
     while (array < end)
-        hash = (hash << 5) + hash + fenn_hash(*array++);
-    return (int32_t) hash;
+        hash = fenn_hash_mix(hash ^ (uint32_t) fenn_hash(*array++), fenn_hash_secret[1]);
+    // Never 0, so a stored tuple hash of 0 is always a damaged one
+    return fenn_hash_fold(hash) ? fenn_hash_fold(hash) : 1;
+}
+
+/* Hash of a single pair of a struct. The hash of a struct is made by
+ * summing the hashes of its pairs and finishing the sum with
+ * fenn_kv_hashfinish, so it can be kept up to date as pairs change. */
+uint64_t fenn_kv_hashpair(FennObject key, FennObject value) {
+    return fenn_hash_mix((uint32_t) fenn_hash(key) ^ fenn_hash_seed,
+                         (uint32_t) fenn_hash(value) ^ fenn_hash_secret[2]);
+}
+
+/* Hash of a struct from the sum of the hashes of its pairs */
+int32_t fenn_kv_hashfinish(uint64_t sum, uint64_t count) {
+    return fenn_hash_fold(fenn_hash_mix(sum ^ fenn_hash_secret[3], count ^ fenn_hash_secret[1]));
+}
+
+/* Computes the hash of the pairs in an array of slots. Empty slots have a
+ * nil key. The result does not depend on where in the array the pairs
+ * are. */
+int32_t fenn_kv_calchash(const FennKV *kvs, int32_t cap) {
+    const FennKV *end = kvs + cap;
+    uint64_t sum = 0, count = 0;
+    for (; kvs < end; kvs++) {
+        if (fenn_checktype(kvs->key, FENN_NIL))
+            continue;
+        sum += fenn_kv_hashpair(kvs->key, kvs->value);
+        count++;
+    }
+    return fenn_kv_hashfinish(sum, count);
+}
+
+/* Computes the hash fenn_kv_calchash would give the same slots if every
+ * value was replaced by the number of keys before it, which is the shape
+ * of a struct. */
+int32_t fenn_kv_shapehash(const FennKV *kvs, int32_t cap) {
+    const FennKV *end = kvs + cap;
+    uint64_t sum = 0, count = 0;
+    for (; kvs < end; kvs++) {
+        if (fenn_checktype(kvs->key, FENN_NIL))
+            continue;
+        sum += fenn_kv_hashpair(kvs->key, fenn_wrap_number((double) count));
+        count++;
+    }
+    return fenn_kv_hashfinish(sum, count);
 }
 
 int32_t fenn_string_calchash(const uint8_t *str, int32_t len) {
-    const uint8_t *end = str + len;
-    uint32_t hash = 5381;
-    while (str < end)
-        hash = (hash << 5) + hash + *str++;
-    return (int32_t) hash;
+    uint64_t hash = fenn_hash_bytes(str, (size_t) len);
+    return fenn_hash_fold(hash);
 }
 
 /* Check if two values are equal. This is strict equality with no conversion. */
@@ -61,11 +279,16 @@ int fenn_equals(FennObject x, FennObject y) {
             case FENN_STRING:
                 result = fenn_string_equal(fenn_unwrap_string(x), fenn_unwrap_string(y));
                 break;
+            case FENN_SYMBOL:
+            case FENN_KEYWORD:
+                // Symbols are interned
+                result = (fenn_unwrap_symbol(x) == fenn_unwrap_symbol(y));
+                break;
             case FENN_TUPLE:
                 result = fenn_tuple_equal(fenn_unwrap_tuple(x), fenn_unwrap_tuple(y));
                 break;
             case FENN_STRUCT:
-                // TODO: Compare structs
+                result = fenn_struct_equal(fenn_unwrap_struct(x), fenn_unwrap_struct(y));
                 break;
             default:
                 // Compare pointers
@@ -89,28 +312,29 @@ int32_t fenn_hash(FennObject x) {
         case FENN_STRING:
         case FENN_SYMBOL:
         case FENN_KEYWORD:
-            hash= fenn_string_hash(fenn_unwrap_string(x));
+            // Symbols are interned, so the cached hash of the name is as
+            // good as hashing the pointer and is the same on every thread
+            hash = fenn_string_hash(fenn_unwrap_string(x));
             break;
         case FENN_TUPLE:
             hash = fenn_tuple_hash(fenn_unwrap_tuple(x));
             break;
         case FENN_STRUCT:
-            // Struct hash
+            hash = fenn_struct_hash(fenn_unwrap_struct(x));
             break;
-        default:
-            if (sizeof(double) == sizeof(void *)) {
-                /* Assuming 8 byte pointer */
-                uint64_t i = fenn_u64(x);
-                hash = (int32_t)(i & 0xFFFFFFFF);
-                /* Get a bit more entropy by shifting the low bits out */
-                hash >>= 3;
-                hash ^= (int32_t)(i >> 32);
-            } else {
-                /* Assuming 4 byte pointer (or smaller) */
-                hash = (int32_t)((char *)fenn_unwrap_pointer(x) - (char *)0);
-                hash >>= 2;
-            }
+        case FENN_NUMBER: {
+            // 0.0 and -0.0 are equal so they must hash the same
+            double d = fenn_unwrap_number(x);
+            uint64_t h = fenn_hash_word(d == 0 ? 0 : fenn_u64(x));
+            hash = fenn_hash_fold(h);
             break;
+        }
+        default: {
+            // Pointers have their low bits clear, mix every bit into the result
+            uint64_t h = fenn_hash_word(fenn_u64(x));
+            hash = fenn_hash_fold(h);
+            break;
+        }
     }
     return hash;
 }
@@ -139,14 +363,18 @@ int fenn_compare(FennObject x, FennObject y) {
                 } else {
                     return fenn_unwrap_number(x) > fenn_unwrap_number(y) ? 1 : -1;
                 }
-            case FENN_STRING:
             case FENN_SYMBOL:
             case FENN_KEYWORD:
+                // Interned, so the same symbol is always the same pointer
+                if (fenn_unwrap_symbol(x) == fenn_unwrap_symbol(y))
+                    return 0;
+                return fenn_string_compare(fenn_unwrap_string(x), fenn_unwrap_string(y));
+            case FENN_STRING:
                 return fenn_string_compare(fenn_unwrap_string(x), fenn_unwrap_string(y));
             case FENN_TUPLE:
                 return fenn_tuple_compare(fenn_unwrap_tuple(x), fenn_unwrap_tuple(y));
             case FENN_STRUCT:
-                // TODO: Compare structs
+                return fenn_struct_compare(fenn_unwrap_struct(x), fenn_unwrap_struct(y));
             default:
                 // Compare pointer values
                 if (fenn_unwrap_string(x) == fenn_unwrap_string(y)) {
@@ -178,6 +406,15 @@ void *fenn_to_pointer(FennObject x) {
     return x.ptr;
 }
 
+FennObject fenn_from_double(double d) {
+    FennObject ret;
+    ret.num = d;
+    // NaNs must not look like a boxed value, store them as a canonical NaN
+    if (d != d)
+        ret.u64 = fenn_tag(FENN_NUMBER);
+    return ret;
+}
+
 FennObject fenn_from_bits(uint64_t bits) {
     FennObject o;
     o.u64 = bits;
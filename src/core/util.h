@@ -23,7 +23,18 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+void fenn_hash_init(void);
+uint64_t fenn_hash_getseed(void);
+void fenn_hash_attach(void);
+void fenn_hash_detach(void);
+int fenn_hash_setseed(uint64_t);
+uint64_t fenn_hash_bytes(const uint8_t *, size_t);
+uint64_t fenn_hash_word(uint64_t);
 int32_t fenn_array_calchash(const FennObject *, int32_t);
+uint64_t fenn_kv_hashpair(FennObject, FennObject);
+int32_t fenn_kv_hashfinish(uint64_t, uint64_t);
+int32_t fenn_kv_calchash(const FennKV *, int32_t);
+int32_t fenn_kv_shapehash(const FennKV *, int32_t);
 int32_t fenn_string_calchash(const uint8_t *, int32_t);
 int32_t fenn_hash(FennObject x);
 int fenn_equals(FennObject, FennObject);
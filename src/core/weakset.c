@@ -0,0 +1,136 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#include <fenn.h>
+#include "gc.h"
+#include "weakset.h"
+
+/* Marks a slot that used to hold an entry, probing continues past it */
+static const char fenn_weakset_tombstone[1];
+#define FENN_WEAKSET_DELETED ((const void *) fenn_weakset_tombstone)
+
+/* Insert an entry known not to be in the set, into a set without
+ * tombstones */
+static void fenn_weakset_put(FennWeakSet *set, const void *entry) {
+    uint32_t mask = set->cap - 1;
+    uint32_t index = (uint32_t) set->hash(entry) & mask;
+    while (NULL != set->slots[index])
+        index = (index + 1) & mask;
+    set->slots[index] = entry;
+}
+
+/* Rebuild the set with a new capacity, dropping tombstones */
+static void fenn_weakset_resize(FennWeakSet *set, uint32_t newcap) {
+    const void **old = set->slots;
+    uint32_t oldcap = set->cap;
+    uint32_t i;
+    set->slots = calloc(newcap, sizeof(const void *));
+    if (NULL == set->slots) {
+        // TODO: Handle Out Of Memory error
+    }
+    set->cap = newcap;
+    set->deleted = 0;
+    for (i = 0; i < oldcap; i++) {
+        if (NULL != old[i] && old[i] != FENN_WEAKSET_DELETED)
+            fenn_weakset_put(set, old[i]);
+    }
+    free(old);
+}
+
+/* Find a live entry with the given hash that matches key. Returns NULL if
+ * there is none. */
+const void *fenn_weakset_find(FennWeakSet *set, int32_t hash, FennWeakSetMatch match, const void *key) {
+    uint32_t mask, index;
+    if (NULL == set->slots)
+        return NULL;
+    mask = set->cap - 1;
+    index = (uint32_t) hash & mask;
+    for (;;) {
+        const void *entry = set->slots[index];
+        if (NULL == entry)
+            return NULL;
+        // An entry left unmarked by the last cycle is garbage waiting to
+        // be swept and may refer to objects that were already freed
+        if (entry != FENN_WEAKSET_DELETED &&
+            set->hash(entry) == hash &&
+            !fenn_gc_dying(set->object(entry)) &&
+            match(entry, key))
+            return entry;
+        index = (index + 1) & mask;
+    }
+}
+
+/* Add an entry with no live match in the set. The object must not move
+ * while it is in the set. */
+void fenn_weakset_add(FennWeakSet *set, const void *entry) {
+    uint32_t mask, index;
+    if (NULL == set->slots)
+        fenn_weakset_resize(set, set->mincap);
+    mask = set->cap - 1;
+    index = (uint32_t) set->hash(entry) & mask;
+    for (;;) {
+        const void **slot = set->slots + index;
+        if (NULL == *slot)
+            break;
+        if (*slot == FENN_WEAKSET_DELETED) {
+            set->deleted--;
+            break;
+        }
+        index = (index + 1) & mask;
+    }
+    set->slots[index] = entry;
+    set->count++;
+    // Keep the load factor, including tombstones, under one half
+    if (2 * (set->count + set->deleted) >= set->cap)
+        fenn_weakset_resize(set, 4 * set->count > set->cap ? 2 * set->cap : set->cap);
+}
+
+/* Remove an entry, called when its object is freed. Matches by pointer, a
+ * live match may have been added since the object died. */
+void fenn_weakset_remove(FennWeakSet *set, const void *entry) {
+    uint32_t mask, index;
+    if (NULL == set->slots)
+        return;
+    mask = set->cap - 1;
+    index = (uint32_t) set->hash(entry) & mask;
+    for (;;) {
+        const void **slot = set->slots + index;
+        if (NULL == *slot)
+            return;
+        if (*slot == entry) {
+            *slot = FENN_WEAKSET_DELETED;
+            set->count--;
+            set->deleted++;
+            return;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+/* Free the slots of a set, leaving it empty */
+void fenn_weakset_deinit(FennWeakSet *set) {
+    free(set->slots);
+    set->slots = NULL;
+    set->cap = 0;
+    set->count = 0;
+    set->deleted = 0;
+}
@@ -0,0 +1,53 @@
+/*
+* Copyright (c) 2019 Peter Arthur
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef WEAKSET_H
+#define WEAKSET_H
+
+/* Weak open addressed hash sets of heap objects, as used by the tuple and
+ * shape caches. Entries are pointers to the data of objects, whose hash is
+ * stored in the object. Objects the collector is about to sweep are never
+ * matched, and the owner removes an object when it is freed. A removed
+ * entry leaves a tombstone that probing continues past until the next
+ * resize. */
+
+typedef struct FennWeakSet FennWeakSet;
+
+struct FennWeakSet {
+    const void **slots;
+    uint32_t cap;
+    uint32_t count;
+    uint32_t deleted;                      // Tombstones
+    uint32_t mincap;                       // Power of two allocated first
+    int32_t (*hash)(const void *);         // Stored hash of an entry
+    FennGCObject *(*object)(const void *); // Allocation behind an entry
+};
+
+/* Whether a live entry can stand in for a key */
+typedef int (*FennWeakSetMatch)(const void *entry, const void *key);
+
+const void *fenn_weakset_find(FennWeakSet *, int32_t, FennWeakSetMatch, const void *);
+void fenn_weakset_add(FennWeakSet *, const void *);
+void fenn_weakset_remove(FennWeakSet *, const void *);
+void fenn_weakset_deinit(FennWeakSet *);
+
+#endif
@@ -64,6 +64,14 @@ union FennObject {
     void *ptr;
 };
 
+typedef struct FennKV FennKV;
+
+/* A key and its value, the slots of structs */
+struct FennKV {
+    FennObject key;
+    FennObject value;
+};
+
 typedef enum FennType FennType;
 
 /* Fenn basic data types */
@@ -122,10 +130,11 @@ FENN_API FennObject fenn_from_pointer(void *, uint64_t);
 FENN_API FennObject fenn_from_cpointer(const void *, uint64_t);
 FENN_API FennObject fenn_from_double(double);
 FENN_API FennObject fenn_from_bits(uint64_t);
+FENN_API int fenn_scan_number(const uint8_t *, int32_t, double *);
 
 // All objects except nil and false are truthy
 #define fenn_truthy(x) \
-    (!jfenn_checktype((x), FENN_NIL) && \
+    (!fenn_checktype((x), FENN_NIL) && \
      (!fenn_checktype((x), FENN_BOOL) || ((x).u64 & 0x1)))
 
 #define fenn_from_payload(t, p) \
@@ -196,12 +205,51 @@ enum FennMemoryType {
     FENN_MEMORY_FUNCTION,
     FENN_MEMORY_ABSTRACT,
     FENN_MEMORY_FUNCENV,
-    FENN_MEMORY_FUNCDEF
+    FENN_MEMORY_FUNCDEF,
+    FENN_MEMORY_TRIE
+};
+
+typedef struct FennMemoryStats FennMemoryStats;
+
+/* Allocation statistics for a single FennMemoryType */
+struct FennMemoryStats {
+    size_t objects;      // Live objects
+    size_t bytes;        // Bytes used by live objects
+    size_t allocations;  // Total number of allocations
+    size_t frees;        // Total number of objects freed
+    size_t large;        // Live objects too large for a slab
+};
+
+typedef struct FennHeapPages FennHeapPages;
+
+/* Pages of memory holding the heap of a thread */
+struct FennHeapPages {
+    size_t pages;        // Pages holding old objects or loaded images
+    size_t resident;     // Pages in memory
+    size_t shared;       // Resident pages also mapped by another process
 };
 
-void *fenn_gcalloc(FennMemoryType, size_t);
+/* Called by the collector on a slot holding a value, which it may update */
+typedef void (*FennGCVisitor)(FennObject *);
+
+FENN_API void *fenn_gcalloc(FennMemoryType, size_t);
+FENN_API void fenn_memory_stats(FennMemoryType, FennMemoryStats *);
+FENN_API int fenn_heap_pages(FennHeapPages *);
+FENN_API void fenn_mark(FennObject);
+FENN_API void fenn_collect(void);
+FENN_API int fenn_gcstep(size_t);
+FENN_API void fenn_maybe_collect(void);
+FENN_API void fenn_gcsetstep(size_t);
+FENN_API void fenn_gcsetinterval(size_t);
+FENN_API void fenn_gcsetnursery(size_t);
+FENN_API void fenn_buffersethugepages(int);
+FENN_API void fenn_gcroot(FennObject);
+FENN_API int fenn_gcunroot(FennObject);
+FENN_API int fenn_gcunrootall(FennObject);
 
 /* API */
+FENN_API void fenn_init(void);
+FENN_API void fenn_deinit(void);
 
 #ifdef __cplusplus
 }